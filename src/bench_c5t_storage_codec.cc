@@ -0,0 +1,50 @@
+// Compares the storage codecs on the `SomeJSON` struct of the storage test: the size of the encoded value,
+// and the time it takes to encode it and to decode it back.
+
+#include <chrono>
+#include <iostream>
+
+#include "bricks/dflags/dflags.h"
+
+#include "lib_c5t_storage_codec.h"
+#include "lib_test_storage.h"
+
+DEFINE_uint32(n, 1000000, "The number of times to encode and to decode the value with each codec.");
+
+template <C5T_STORAGE_CODEC CODEC>
+void Bench(char const* name, SomeJSON const& value) {
+  std::string const encoded = C5T_STORAGE_ENCODE<CODEC>(value);
+  size_t total_length = 0u;
+  auto const t0 = std::chrono::steady_clock::now();
+  for (uint32_t i = 0u; i < FLAGS_n; ++i) {
+    total_length += C5T_STORAGE_ENCODE<CODEC>(value).length();
+  }
+  auto const t1 = std::chrono::steady_clock::now();
+  int64_t total_foo = 0;
+  for (uint32_t i = 0u; i < FLAGS_n; ++i) {
+    SomeJSON decoded;
+    if (!C5T_STORAGE_DECODE(encoded, decoded)) {
+      std::cerr << "FATAL: Failed to decode the value encoded with " << name << '.' << std::endl;
+      ::abort();
+    }
+    total_foo += decoded.foo;
+  }
+  auto const t2 = std::chrono::steady_clock::now();
+  auto const ns_per_op = [](auto dt) {
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count()) / FLAGS_n;
+  };
+  std::cout << name << ": " << encoded.length() << " bytes, encode " << ns_per_op(t1 - t0) << " ns, decode "
+            << ns_per_op(t2 - t1) << " ns" << std::endl;
+  // To make sure the loops above are not optimized away.
+  if (total_length != encoded.length() * FLAGS_n || total_foo != static_cast<int64_t>(value.foo) * FLAGS_n) {
+    std::cerr << "FATAL: Inconsistent results." << std::endl;
+    ::abort();
+  }
+}
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+  SomeJSON const value = SomeJSON().SetFoo(42).SetBar("The quick brown fox jumps over the lazy dog.");
+  Bench<C5T_STORAGE_CODEC::JSON>("JSON", value);
+  Bench<C5T_STORAGE_CODEC::Binary>("Binary", value);
+}
@@ -0,0 +1,91 @@
+// Compares the directory layouts of the file-per-key storage backend on a field of `--n` keys: the flat one of the
+// earlier versions, with all the keys of the field in one directory, and the fan-out one, with the keys spread over
+// two levels of hex prefix directories. Reports the time it takes to write the keys, to look up `--lookups` random
+// ones, and to migrate the flat layout into the fan-out one.
+
+#include <chrono>
+#include <iostream>
+#include <random>
+
+#include "bricks/dflags/dflags.h"
+#include "bricks/file/file.h"
+
+#include "lib_c5t_storage.h"
+
+DEFINE_uint32(n, 1000000, "The number of keys in the field.");
+DEFINE_uint32(lookups, 100000, "The number of random keys to look up.");
+DEFINE_string(dir, ".current_bench_fanout", "The directory to run the benchmark in, removed once done.");
+
+using bench_clock_t = std::chrono::steady_clock;
+
+double NanosecondsPerOp(bench_clock_t::duration dt, uint32_t n) {
+  return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(dt).count()) / n;
+}
+
+std::string Key(uint32_t i) { return "key" + current::ToString(i); }
+
+int main(int argc, char** argv) {
+  ParseDFlags(&argc, &argv);
+
+  current::FileSystem::RmDir(
+      FLAGS_dir, current::FileSystem::RmDirParameters::Silent, current::FileSystem::RmDirRecursive::Yes);
+  current::FileSystem::MkDir(FLAGS_dir, current::FileSystem::MkDirParameters::Silent);
+  current::FileSystem::MkDir(FLAGS_dir + "/kv1", current::FileSystem::MkDirParameters::Silent);
+
+  std::mt19937 rng(42);
+  std::vector<uint32_t> lookups(FLAGS_lookups);
+  for (uint32_t& i : lookups) {
+    i = std::uniform_int_distribution<uint32_t>(0u, FLAGS_n - 1u)(rng);
+  }
+
+  // The flat layout, written as the earlier versions of the backend would.
+  auto const t0 = bench_clock_t::now();
+  for (uint32_t i = 0u; i < FLAGS_n; ++i) {
+    current::FileSystem::WriteStringToFile(current::ToString(i), (FLAGS_dir + "/kv1/" + Key(i)).c_str());
+  }
+  auto const t1 = bench_clock_t::now();
+  uint64_t flat_total = 0u;
+  for (uint32_t i : lookups) {
+    flat_total += current::FromString<uint64_t>(
+        current::FileSystem::ReadFileAsString((FLAGS_dir + "/kv1/" + Key(i)).c_str()));
+  }
+  auto const t2 = bench_clock_t::now();
+  std::cout << "flat: write " << NanosecondsPerOp(t1 - t0, FLAGS_n) << " ns, lookup "
+            << NanosecondsPerOp(t2 - t1, FLAGS_lookups) << " ns" << std::endl;
+
+  {
+    // No Bloom filter, to only measure the file system. The cache is not in the way: the backend is called directly.
+    // NOTE: The writes also keep the ordered keys of the field up to date, which the flat layout above does not.
+    auto const storage_scope =
+        C5T_STORAGE_CREATE_UNIQUE_INSANCE(FLAGS_dir, C5T_STORAGE_OPTIONS().BloomFalsePositiveRate(0));
+    C5T_STORAGE_Interface& storage = C5T_STORAGE_INSTANCE();
+
+    // The first use of the field migrates it.
+    auto const t3 = bench_clock_t::now();
+    if (!Exists(storage.DoLoad("kv1", Key(0u)))) {
+      std::cerr << "FATAL: The key is lost in the migration." << std::endl;
+      ::abort();
+    }
+    auto const t4 = bench_clock_t::now();
+    uint64_t fanout_total = 0u;
+    for (uint32_t i : lookups) {
+      fanout_total += current::FromString<uint64_t>(Value(storage.DoLoad("kv1", Key(i))));
+    }
+    auto const t5 = bench_clock_t::now();
+    for (uint32_t i = 0u; i < FLAGS_n; ++i) {
+      storage.DoSave("kv2", Key(i), current::ToString(i));
+    }
+    auto const t6 = bench_clock_t::now();
+    std::cout << "fan-out: write " << NanosecondsPerOp(t6 - t5, FLAGS_n) << " ns, lookup "
+              << NanosecondsPerOp(t5 - t4, FLAGS_lookups) << " ns" << std::endl;
+    std::cout << "migration: " << NanosecondsPerOp(t4 - t3, FLAGS_n) << " ns per key" << std::endl;
+
+    if (fanout_total != flat_total) {
+      std::cerr << "FATAL: Inconsistent results." << std::endl;
+      ::abort();
+    }
+  }
+
+  current::FileSystem::RmDir(
+      FLAGS_dir, current::FileSystem::RmDirParameters::Silent, current::FileSystem::RmDirRecursive::Yes);
+}
@@ -6,12 +6,17 @@
 #include "bricks/sync/waitable_atomic.h"
 #include "lib_c5t_lifetime_manager.h"
 #include "lib_c5t_logger.h"
+#include "lib_c5t_storage.h"
 #include "lib_demo_routes_basic.h"
 #include "lib_demo_routes_dlib.h"
 #include "lib_demo_routes_heavy.h"
+#include "lib_demo_routes_storage.h"
 #include "lib_http_server.h"
 
 DEFINE_uint16(port, 5555, "");
+DEFINE_string(storage_dir,
+              "",
+              "If set, the storage to use, with its changes tracked, see `/storage/kv` and `/storage/export`.");
 
 void Run(HTTPServerContext& ctx);
 
@@ -37,6 +42,12 @@ int main(int argc, char** argv) {
   C5T_LOGGER("demo") << "demo started";
   C5T_LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { C5T_LOGGER("life") << s; });
 
+  std::unique_ptr<C5T_STORAGE_Interface> storage;
+  if (!FLAGS_storage_dir.empty()) {
+    DefineDemoStorageFields();
+    storage = C5T_STORAGE_CREATE_UNIQUE_INSANCE(FLAGS_storage_dir, C5T_STORAGE_OPTIONS().TrackChanges());
+  }
+
   RunHTTPServer(FLAGS_port, Run);
 }
 
@@ -47,6 +58,7 @@ void Run(HTTPServerContext& ctx) {
   RegisterDemoRoutesBasic(time_to_stop_http_server_and_die, ctx);
   RegisterDemoRoutesHeavy(ctx);
   RegisterDemoRoutesDLib(current::Singleton<BinPathSingleton>().bin_path, ctx);
+  RegisterDemoRoutesStorage(ctx);
 
   time_to_stop_http_server_and_die.Wait();
   std::cout << "terminating per user request" << std::endl;
@@ -24,8 +24,9 @@ int main(int argc, char** argv) {
   // The actor model requires the lifetime manager to be active.
   C5T_LIFETIME_MANAGER_SET_LOGGER([](std::string const& s) { std::cerr << "MGR: " << s << std::endl; });
 
-  auto const topic_timer = Topic<TimerEvent>("timer");
-  auto const topic_input = Topic<InputEvent>("input");
+  // Retain a bit of history, so that the newly connected chunked HTTP clients are not starting from a blank page.
+  auto const topic_timer = Topic<TimerEvent>("timer", TopicRetention().LastN(1));
+  auto const topic_input = Topic<InputEvent>("input", TopicRetention().LastN(10).LastFor(std::chrono::minutes(5)));
 
   auto& http = HTTP(current::net::BarePort(FLAGS_port));
 
@@ -30,3 +30,20 @@ extern "C" void TestDel(IDLib& iface, std::string const& k) {
     C5T_STORAGE(kv1).Del(k);
   });
 }
+
+extern "C" void TestSetMany(IDLib& iface, std::vector<std::pair<std::string, std::string>> const& kvs) {
+  // Resolved once per load of this `dlib`, not once per call, let alone once per key.
+  static auto kv1 = C5T_STORAGE_HANDLE(kv1);
+  iface.Use<IStorage>([&kvs](IStorage& storage) { kv1(storage.Storage()).MultiSet(kvs); });
+}
+
+extern "C" std::string TestGetMany(IDLib& iface, std::vector<std::string> const& keys) {
+  static auto kv1 = C5T_STORAGE_HANDLE(kv1);
+  std::vector<std::string> v;
+  iface.Use<IStorage>([&keys, &v](IStorage& storage) {
+    for (Optional<std::string> const& value : kv1(storage.Storage()).MultiGet(keys)) {
+      v.push_back(Exists(value) ? Value(value) : "-");
+    }
+  });
+  return current::strings::Join(v, ',');
+}
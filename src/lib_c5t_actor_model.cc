@@ -1,8 +1,10 @@
+#include <deque>
 #include <mutex>
 #include <unordered_map>
 
 #include "lib_c5t_actor_model.h"
 #include "bricks/util/singleton.h"
+#include "bricks/time/chrono.h"
 
 class TopicIDGenerator final {
  private:
@@ -21,40 +23,144 @@ class TopicsSubcribersPerTypeSingleton final : public ICleanupAndLinkAndPublish
   std::mutex mutex_;
 
   std::unordered_map<EventsSubscriberID, std::unordered_set<TopicID>> s_;
-  std::unordered_map<TopicID,
-                     std::unordered_map<EventsSubscriberID, std::function<void(std::shared_ptr<crnt::CurrentSuper>)>>>
-      m2_;
+  std::unordered_map<TopicID, std::unordered_map<EventsSubscriberID, ActorModelGenericLink>> m2_;
+  std::unordered_map<TopicID, std::unordered_map<EventsSubscriberID, ActorModelInlineLink>> m3_;
+
+  // For the topics that retain their recent events, oldest first.
+  // Each type is either always inline or never inline, so only one of `e` and `inline_e` is used, per type.
+  struct RetainedEvent final {
+    std::chrono::microseconds t;
+    std::shared_ptr<crnt::CurrentSuper> e;
+    ActorModelInlineEvent inline_e;
+    ActorModelDeadline deadline;
+  };
+  struct RetainedEvents final {
+    TopicRetention retention;
+    std::deque<RetainedEvent> events;
+
+    void Trim(std::chrono::microseconds now) {
+      if (retention.max_events) {
+        while (events.size() > retention.max_events) {
+          events.pop_front();
+        }
+      }
+      if (retention.max_age.count()) {
+        while (!events.empty() && events.front().t + retention.max_age < now) {
+          events.pop_front();
+        }
+      }
+    }
+  };
+  std::unordered_map<TopicID, RetainedEvents> retained_;
 
  public:
   TopicsSubcribersPerTypeSingleton(std::type_index t) : type_index_(t), ids_used_(0ull) {}
 
   EventsSubscriberID AllocateNextID() { return static_cast<EventsSubscriberID>(++ids_used_); }
 
-  void AddGenericLink(EventsSubscriberID sid,
-                      TopicID tid,
-                      std::function<void(std::shared_ptr<crnt::CurrentSuper>)> f) override {
+  void AddGenericLink(EventsSubscriberID sid, TopicID tid, ActorModelGenericLink f) override {
     C5T_ACTOR_MODEL_INSTANCE().InternalRegisterTypeForSubscriber(type_index_, sid, *this);
     std::lock_guard lock(mutex_);
     s_[sid].insert(tid);
+    auto const cit = retained_.find(tid);
+    if (cit != std::end(retained_)) {
+      // Replay under the same lock that `PublishGenericEvents` uses, so that nothing is missed or delivered twice.
+      RetainedEvents& r = cit->second;
+      r.Trim(current::time::Now());
+      std::vector<std::shared_ptr<crnt::CurrentSuper>> replay;
+      std::vector<ActorModelDeadline> deadlines;
+      for (auto const& e : r.events) {
+        replay.push_back(e.e);
+        deadlines.push_back(e.deadline);
+      }
+      if (!replay.empty()) {
+        f(replay.data(), deadlines.data(), replay.size());
+      }
+    }
     m2_[tid][sid] = std::move(f);
   }
 
+  void AddInlineLink(EventsSubscriberID sid, TopicID tid, ActorModelInlineLink f) override {
+    C5T_ACTOR_MODEL_INSTANCE().InternalRegisterTypeForSubscriber(type_index_, sid, *this);
+    std::lock_guard lock(mutex_);
+    s_[sid].insert(tid);
+    auto const cit = retained_.find(tid);
+    if (cit != std::end(retained_)) {
+      RetainedEvents& r = cit->second;
+      r.Trim(current::time::Now());
+      std::vector<ActorModelInlineEvent> replay;
+      std::vector<ActorModelDeadline> deadlines;
+      for (auto const& e : r.events) {
+        replay.push_back(e.inline_e);
+        deadlines.push_back(e.deadline);
+      }
+      if (!replay.empty()) {
+        f(replay.data(), deadlines.data(), replay.size());
+      }
+    }
+    m3_[tid][sid] = std::move(f);
+  }
+
   void CleanupSubscriberByID(EventsSubscriberID sid) override {
     std::lock_guard lock(mutex_);
     for (TopicID tid : s_[sid]) {
       m2_[tid].erase(sid);
+      m3_[tid].erase(sid);
     }
     s_.erase(sid);
   }
 
-  void PublishGenericEvent(TopicID tid, std::shared_ptr<crnt::CurrentSuper> e2) override {
+  void PublishGenericEvents(TopicID tid,
+                            std::shared_ptr<crnt::CurrentSuper> const* events,
+                            ActorModelDeadline const* deadlines,
+                            size_t count) override {
     std::lock_guard lock(mutex_);
+    auto const cit = retained_.find(tid);
+    if (cit != std::end(retained_)) {
+      auto const now = current::time::Now();
+      for (size_t i = 0u; i < count; ++i) {
+        RetainedEvent& r = cit->second.events.emplace_back();
+        r.t = now;
+        r.e = events[i];
+        r.deadline = deadlines[i];
+      }
+      cit->second.Trim(now);
+    }
     for (auto const& e : m2_[tid]) {
-      // NOTE(dkorolev): This `.second` should just quickly add a `shared_ptr` to the queue.
+      // NOTE: This `.second` should just quickly add the `shared_ptr`-s to the queue.
       // TODO(dkorolev): Maybe make it more explicit from the code, since a lambda is ambiguous.
-      e.second(e2);
+      e.second(events, deadlines, count);
+    }
+  }
+
+  void PublishInlineEvents(TopicID tid,
+                           ActorModelInlineEvent const* events,
+                           ActorModelDeadline const* deadlines,
+                           size_t count) override {
+    std::lock_guard lock(mutex_);
+    auto const cit = retained_.find(tid);
+    if (cit != std::end(retained_)) {
+      auto const now = current::time::Now();
+      for (size_t i = 0u; i < count; ++i) {
+        RetainedEvent& r = cit->second.events.emplace_back();
+        r.t = now;
+        r.inline_e = events[i];
+        r.deadline = deadlines[i];
+      }
+      cit->second.Trim(now);
+    }
+    for (auto const& e : m3_[tid]) {
+      // NOTE: This copies the events by value into the mailbox of the subscriber.
+      e.second(events, deadlines, count);
     }
   }
+
+  void SetTopicRetention(TopicID tid, TopicRetention const& retention) override {
+    std::lock_guard lock(mutex_);
+    RetainedEvents& r = retained_[tid];
+    r.retention = retention;
+    r.Trim(current::time::Now());
+  }
 };
 
 class TopicsSubcribersAllTypesSingleton final : public C5T_ACTOR_MODEL_Interface {
@@ -65,6 +171,7 @@ class TopicsSubcribersAllTypesSingleton final : public C5T_ACTOR_MODEL_Interface
   std::unordered_map<std::type_index, ICleanup*> cleanups_per_type_;
   std::unordered_map<EventsSubscriberID, std::unordered_set<std::type_index>> types_per_ids_;
 
+  std::mutex impls_mutex_;
   std::unordered_map<std::type_index, std::unique_ptr<ICleanupAndLinkAndPublish>> impls_;
 
  public:
@@ -91,6 +198,9 @@ class TopicsSubcribersAllTypesSingleton final : public C5T_ACTOR_MODEL_Interface
   }
 
   ICleanupAndLinkAndPublish& HandlerPerType(std::type_index t) override {
+    // NOTE: Topics with retention are configured via `HandlerPerType()` as they are created, possibly from multiple
+    // threads, so this map needs its own lock. The instances themselves are stable.
+    std::lock_guard lock(impls_mutex_);
     auto& p = impls_[t];
     if (!p) {
       p = std::make_unique<TopicsSubcribersPerTypeSingleton>(t);
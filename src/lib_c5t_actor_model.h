@@ -1,10 +1,17 @@
 #pragma once
 
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <thread>
 #include <vector>
 #include <typeindex>
+#include <type_traits>
 #include <unordered_set>
+#include <variant>
 
 // TODO: even more reasons for a `.cc` file!
 #include "bricks/sync/waitable_atomic.h"
@@ -16,6 +23,25 @@
 enum class TopicID : uint64_t {};
 TopicID GetNextUniqueTopicID();
 
+// Small trivially copyable events are delivered by value: stored inline in the mailbox slot and copied into each
+// subscriber's mailbox, with no `shared_ptr`, no heap allocation, and no need to derive from `crnt::CurrentSuper`.
+// Larger events, as well as the events that are not trivially copyable, use the `shared_ptr` path.
+constexpr static size_t kActorModelInlineEventMaxSize = 32u;
+
+struct ActorModelInlineEvent final {
+  alignas(std::max_align_t) unsigned char bytes[kActorModelInlineEventMaxSize];
+
+  template <class T>
+  T const& As() const {
+    return *std::launder(reinterpret_cast<T const*>(bytes));
+  }
+};
+
+template <class T>
+constexpr static bool kActorModelIsInlineEvent = std::is_trivially_copyable_v<T> &&
+                                                 sizeof(T) <= kActorModelInlineEventMaxSize &&
+                                                 alignof(T) <= alignof(ActorModelInlineEvent);
+
 template <class T>
 struct TopicKeysOfType {
   std::unordered_set<TopicID> topic_ids_;
@@ -81,11 +107,36 @@ class TopicKey final {
   }
 };
 
+// Optionally, a topic can retain its most recent events, to replay them to each newly added subscriber.
+// The limits are "at most `max_events` events" and/or "only the events emitted within the last `max_age`".
+// The replay and the attaching to the live stream happen atomically: no gaps and no duplicates.
+struct TopicRetention final {
+  size_t max_events = 0u;  // Zero means "no limit on the number of events", unless `max_age` is not set either.
+  std::chrono::microseconds max_age = std::chrono::microseconds(0);  // Zero means "no limit on the age of events".
+
+  TopicRetention& LastN(size_t n) {
+    max_events = n;
+    return *this;
+  }
+  TopicRetention& LastFor(std::chrono::microseconds dt) {
+    max_age = dt;
+    return *this;
+  }
+
+  bool IsEnabled() const { return max_events != 0u || max_age.count() != 0; }
+};
+
+inline void InternalSetTopicRetention(std::type_index t, TopicID tid, TopicRetention const& retention);
+
 template <class T>
-TopicKey<T> Topic(std::string name = "") {
+TopicKey<T> Topic(std::string name = "", TopicRetention retention = TopicRetention()) {
   // TODO(dkorolev): Tons of things incl. registry, counters, telemetry, etc.
   static_cast<void>(name);
-  return TopicKey<T>((ConstructTopicKey()));
+  TopicKey<T> res((ConstructTopicKey()));
+  if (retention.IsEnabled()) {
+    InternalSetTopicRetention(std::type_index(typeid(T)), res.GetTopicID(), retention);
+  }
+  return res;
 }
 
 enum class EventsSubscriberID : uint64_t {};
@@ -96,13 +147,30 @@ class ICleanup {
   virtual void CleanupSubscriberByID(EventsSubscriberID) = 0;
 };
 
+// The events emitted with a TTL or a deadline are dropped by their subscribers, unprocessed, once they are past it.
+using ActorModelDeadline = std::chrono::steady_clock::time_point;
+constexpr static ActorModelDeadline kActorModelNoDeadline = ActorModelDeadline::max();
+
+// The links from topics to subscribers accept batches, so that the mailbox of the subscriber is locked once per batch.
+using ActorModelGenericLink = std::function<void(
+    std::shared_ptr<crnt::CurrentSuper> const* events, ActorModelDeadline const* deadlines, size_t count)>;
+using ActorModelInlineLink =
+    std::function<void(ActorModelInlineEvent const* events, ActorModelDeadline const* deadlines, size_t count)>;
+
 class ICleanupAndLinkAndPublish : public ICleanup {
  public:
   virtual ~ICleanupAndLinkAndPublish() = default;
-  virtual void AddGenericLink(EventsSubscriberID sid,
-                              TopicID tid,
-                              std::function<void(std::shared_ptr<crnt::CurrentSuper>)> f) = 0;
-  virtual void PublishGenericEvent(TopicID tid, std::shared_ptr<crnt::CurrentSuper> e2) = 0;
+  virtual void AddGenericLink(EventsSubscriberID sid, TopicID tid, ActorModelGenericLink f) = 0;
+  virtual void PublishGenericEvents(TopicID tid,
+                                    std::shared_ptr<crnt::CurrentSuper> const* events,
+                                    ActorModelDeadline const* deadlines,
+                                    size_t count) = 0;
+  virtual void AddInlineLink(EventsSubscriberID sid, TopicID tid, ActorModelInlineLink f) = 0;
+  virtual void PublishInlineEvents(TopicID tid,
+                                   ActorModelInlineEvent const* events,
+                                   ActorModelDeadline const* deadlines,
+                                   size_t count) = 0;
+  virtual void SetTopicRetention(TopicID tid, TopicRetention const& retention) = 0;
 };
 
 class ICanWait {
@@ -137,13 +205,44 @@ class ActorSubscriberScopeImpl {
 template <class W>
 class ActorSubscriberScopeFor;
 
+// The inline events are dispatched by `dispatch`, which is passed the scope of the subscriber the slot belongs to.
+struct ActorModelMailboxInlineSlot final {
+  void (*dispatch)(void* scope, ActorModelInlineEvent const& e);
+  ActorModelInlineEvent event;
+};
+
+// Either a closure, for the events passed as `shared_ptr`-s, or an inline event, or nothing, once the event is shed.
+struct ActorModelMailboxSlot final {
+  std::variant<std::monostate, std::function<void()>, ActorModelMailboxInlineSlot> event;
+  ActorModelDeadline deadline = kActorModelNoDeadline;
+};
+
 struct ActorModelQueue final {
   bool done = false;
   size_t num_queued = 0u;
-  size_t num_processed = 0u;
-  std::vector<std::function<void()>> fifo;
+  size_t num_processed = 0u;  // Includes the events that were shed.
+  size_t num_shed = 0u;
+  std::vector<ActorModelMailboxSlot> fifo;
 };
 
+// The workers that define `OnSharedEvent(std::shared_ptr<E>)` get the event itself, so that they can re-emit it as is.
+template <class W, class E, class = void>
+struct ActorWorkerAcceptsSharedEvent : std::false_type {};
+
+template <class W, class E>
+struct ActorWorkerAcceptsSharedEvent<
+    W,
+    E,
+    std::void_t<decltype(std::declval<W&>().OnSharedEvent(std::declval<std::shared_ptr<E>>()))>> : std::true_type {};
+
+// The workers that define `OnShed(size_t n)` are told, once per batch, how many expired events were dropped.
+template <class W, class = void>
+struct ActorWorkerAcceptsShed : std::false_type {};
+
+template <class W>
+struct ActorWorkerAcceptsShed<W, std::void_t<decltype(std::declval<W&>().OnShed(std::declval<size_t>()))>>
+    : std::true_type {};
+
 template <class W>
 class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
  private:
@@ -170,24 +269,49 @@ class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
     void Thread() {
       // NOTE: it's on the user to stop subscriptions if the application is terminating
       while (true) {
-        using r_t = std::pair<std::vector<std::function<void()>>, bool>;
-        r_t const w = wa.Wait([](ActorModelQueue const& q) { return q.done || !q.fifo.empty(); },
-                              [](ActorModelQueue& q) -> r_t {
-                                if (q.done) {
-                                  return {{}, true};
-                                } else {
-                                  std::vector<std::function<void()>> foo;
-                                  std::swap(q.fifo, foo);
-                                  return {foo, false};
-                                }
-                              });
+        using r_t = std::pair<std::vector<ActorModelMailboxSlot>, bool>;
+        r_t w = wa.Wait([](ActorModelQueue const& q) { return q.done || !q.fifo.empty(); },
+                        [](ActorModelQueue& q) -> r_t {
+                          if (q.done) {
+                            return {{}, true};
+                          } else {
+                            std::vector<ActorModelMailboxSlot> foo;
+                            std::swap(q.fifo, foo);
+                            return {foo, false};
+                          }
+                        });
         if (w.second) {
           worker->OnShutdown();
           break;
         } else {
-          for (auto& f : w.first) {
+          // The expired events are dropped before dispatching the rest, and are accounted for in bulk.
+          // NOTE: The clock is only read for the events that have a deadline.
+          size_t shed = 0u;
+          for (auto& slot : w.first) {
+            if (slot.deadline != kActorModelNoDeadline && slot.deadline < std::chrono::steady_clock::now()) {
+              slot.event = std::monostate();
+              ++shed;
+            }
+          }
+          if (shed) {
+            wa.MutableUse([shed](ActorModelQueue& q) {
+              q.num_shed += shed;
+              q.num_processed += shed;
+            });
+            if constexpr (ActorWorkerAcceptsShed<W>::value) {
+              worker->OnShed(shed);
+            }
+          }
+          for (auto& slot : w.first) {
+            if (std::holds_alternative<std::monostate>(slot.event)) {
+              continue;
+            }
             try {
-              f();
+              if (auto const* i = std::get_if<ActorModelMailboxInlineSlot>(&slot.event)) {
+                i->dispatch(this, i->event);
+              } else {
+                std::get<std::function<void()>>(slot.event)();
+              }
               ++wa.MutableScopedAccessor()->num_processed;
             } catch (current::Exception const&) {
               // TODO
@@ -201,6 +325,7 @@ class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
     }
 
     size_t GetNumQueued() override { return wa.ImmutableScopedAccessor()->num_queued; }
+    size_t GetNumShed() { return wa.ImmutableScopedAccessor()->num_shed; }
 
     void WaitUntilNumProcessedIsAtLeast(size_t c) override {
       wa.Wait([c](ActorModelQueue const& q) { return q.done || q.num_processed >= c; });
@@ -209,6 +334,11 @@ class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
 
   current::Owned<OfExtendedScope> extended_;
 
+  template <typename E>
+  static void DispatchInlineEvent(void* scope, ActorModelInlineEvent const& e) {
+    static_cast<OfExtendedScope*>(scope)->worker->OnEvent(e.As<E>());
+  }
+
   // Always hidden inside a `unique_ptr<>`, so no copies and no moves.
   ActorSubscriberScopeForImpl() = delete;
   ActorSubscriberScopeForImpl(ActorSubscriberScopeForImpl const&) = delete;
@@ -218,12 +348,37 @@ class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
 
  public:
   // TODO: make private, much like `ExtractImpl()` and `GetUniqueID()`.
+  // The events must be of type `E`, this is checked by the caller.
+  template <typename E>
+  void EnqueueEvents(std::shared_ptr<crnt::CurrentSuper> const* events,
+                     ActorModelDeadline const* deadlines,
+                     size_t count) {
+    extended_->wa.MutableUse([this, events, deadlines, count](ActorModelQueue& q) {
+      for (size_t i = 0u; i < count; ++i) {
+        ActorModelMailboxSlot& slot = q.fifo.emplace_back();
+        slot.event = std::function<void()>(
+            [b = current::Borrowed<OfExtendedScope>(extended_), e = std::static_pointer_cast<E>(events[i])]() {
+              if constexpr (ActorWorkerAcceptsSharedEvent<W, E>::value) {
+                b->worker->OnSharedEvent(e);
+              } else {
+                b->worker->OnEvent(*e);
+              }
+            });
+        slot.deadline = deadlines[i];
+      }
+      q.num_queued += count;
+    });
+  }
+
   template <typename E>
-  void EnqueueEvent(std::shared_ptr<E> e) {
-    current::Borrowed<OfExtendedScope> borrowed(extended_);
-    extended_->wa.MutableUse([b = std::move(borrowed), &e](ActorModelQueue& q) {
-      q.fifo.push_back([b2 = std::move(b), e2 = std::move(e)]() { b2->worker->OnEvent(*e2); });
-      ++q.num_queued;
+  void EnqueueInlineEvents(ActorModelInlineEvent const* events, ActorModelDeadline const* deadlines, size_t count) {
+    extended_->wa.MutableUse([events, deadlines, count](ActorModelQueue& q) {
+      for (size_t i = 0u; i < count; ++i) {
+        ActorModelMailboxSlot& slot = q.fifo.emplace_back();
+        slot.event = ActorModelMailboxInlineSlot{&DispatchInlineEvent<E>, events[i]};
+        slot.deadline = deadlines[i];
+      }
+      q.num_queued += count;
     });
   }
 
@@ -233,6 +388,7 @@ class ActorSubscriberScopeForImpl final : public ActorSubscriberScopeImpl {
       : extended_(current::MakeOwned<OfExtendedScope>(id, std::move(worker))) {}
 
   EventsSubscriberID GetUniqueID() const { return extended_->unique_id; }
+  size_t GetNumShed() const { return extended_->GetNumShed(); }
 };
 
 template <class W>
@@ -258,6 +414,9 @@ class ActorSubscriberScopeFor final {
 
   // TODO: move away, make private & friends again
   ActorSubscriberScopeForImpl<W>& ExtractImpl() { return *impl_; }
+
+  // The number of events this subscriber has dropped because they expired before it got to them.
+  size_t GetNumShed() const { return impl_->GetNumShed(); }
 };
 
 template <class... TS>
@@ -270,15 +429,28 @@ struct SubscribeAllImpl<T, TS...> {
     std::unordered_set<TopicID> const& ids = static_cast<TopicKeysOfType<T> const&>(topics).topic_ids_;
     for (TopicID tid : ids) {
       ICleanupAndLinkAndPublish& s = C5T_ACTOR_MODEL_INSTANCE().HandlerPerType(std::type_index(typeid(T)));
-      s.AddGenericLink(scope.GetUniqueID(), tid, [&scope](std::shared_ptr<crnt::CurrentSuper> e) {
-        std::shared_ptr<T> e2(std::dynamic_pointer_cast<T>(std::move(e)));
-        if (e2) {
-          scope.template EnqueueEvent<T>(std::move(e2));
-        } else {
-          std::cerr << "FATAL: Event type mismatch." << std::endl;
-          ::abort();
-        }
-      });
+      if constexpr (kActorModelIsInlineEvent<T>) {
+        s.AddInlineLink(
+            scope.GetUniqueID(),
+            tid,
+            [&scope](ActorModelInlineEvent const* events, ActorModelDeadline const* deadlines, size_t count) {
+              scope.template EnqueueInlineEvents<T>(events, deadlines, count);
+            });
+      } else {
+        s.AddGenericLink(
+            scope.GetUniqueID(),
+            tid,
+            [&scope](
+                std::shared_ptr<crnt::CurrentSuper> const* events, ActorModelDeadline const* deadlines, size_t count) {
+              for (size_t i = 0u; i < count; ++i) {
+                if (!dynamic_cast<T const*>(events[i].get())) {
+                  std::cerr << "FATAL: Event type mismatch." << std::endl;
+                  ::abort();
+                }
+              }
+              scope.template EnqueueEvents<T>(events, deadlines, count);
+            });
+      }
     }
     SubscribeAllImpl<TS...>::DoSubscribeAll(scope, topics);
   }
@@ -408,13 +580,263 @@ class NullableActorSubscriberScope final {
 };
 
 template <class T, class... ARGS>
-void InternalEmitEventTo(TopicID tid, std::shared_ptr<T> event) {
-  C5T_ACTOR_MODEL_INSTANCE().HandlerPerType(std::type_index(typeid(T))).PublishGenericEvent(tid, std::move(event));
+void InternalConstructInlineEvent(ActorModelInlineEvent& e, ARGS&&... args) {
+  if constexpr (std::is_constructible_v<T, ARGS...>) {
+    new (e.bytes) T(std::forward<ARGS>(args)...);
+  } else {
+    new (e.bytes) T{std::forward<ARGS>(args)...};
+  }
+}
+
+// Opt-in, per thread: while an `ActorEmitBufferScope` is alive, the `C5T_EMIT`-s made from this thread are appended
+// to a thread-local buffer, and flushed into the subscribers' mailboxes in batches, in the order they were emitted.
+// The buffer is flushed when it is full, when the latency budget of its oldest event has expired, on `Flush()`, and
+// when the scope ends. Each flush locks each affected topic and each subscriber's mailbox once per batch.
+// The latency budget holds for the producers that go idle too: each scope runs a thread that flushes the buffer once
+// the budget is spent, so the scopes are meant to be long-lived, one per producing thread.
+struct ActorEmitBuffering final {
+  size_t max_events = 1000u;
+  std::chrono::microseconds max_latency = std::chrono::milliseconds(10);
+
+  ActorEmitBuffering& MaxEvents(size_t n) {
+    max_events = n;
+    return *this;
+  }
+  ActorEmitBuffering& MaxLatency(std::chrono::microseconds dt) {
+    max_latency = dt;
+    return *this;
+  }
+};
+
+class ActorEmitBuffer final {
+ private:
+  struct BufferedEvent final {
+    ICleanupAndLinkAndPublish* handler;
+    TopicID tid;
+    std::shared_ptr<crnt::CurrentSuper> e;  // Null for the inline events.
+    ActorModelInlineEvent inline_e;
+    ActorModelDeadline deadline;
+  };
+
+  ActorEmitBuffering const params_;
+
+  // The events are added by the thread that owns the buffer, and are flushed either by it, or by `flusher_`.
+  // The owning thread only wakes up `flusher_` as the first event of a batch is added.
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool done_ = false;
+  std::vector<BufferedEvent> events_;
+  std::chrono::steady_clock::time_point first_event_added_;
+
+  // Reused across flushes, to pass each run of events for the same topic as a contiguous batch.
+  std::vector<std::shared_ptr<crnt::CurrentSuper>> generic_batch_;
+  std::vector<ActorModelInlineEvent> inline_batch_;
+  std::vector<ActorModelDeadline> deadlines_batch_;
+
+  std::thread flusher_;
+
+  BufferedEvent& Add(ICleanupAndLinkAndPublish& handler, TopicID tid, ActorModelDeadline deadline) {
+    if (events_.empty()) {
+      first_event_added_ = std::chrono::steady_clock::now();
+      cv_.notify_one();
+    }
+    BufferedEvent& e = events_.emplace_back();
+    e.handler = &handler;
+    e.tid = tid;
+    e.deadline = deadline;
+    return e;
+  }
+
+  void FlushIfNeeded() {
+    if (events_.size() >= params_.max_events ||
+        std::chrono::steady_clock::now() - first_event_added_ >= params_.max_latency) {
+      FlushImpl();
+    }
+  }
+
+  void FlusherThread() {
+    std::unique_lock lock(mutex_);
+    while (!done_) {
+      if (events_.empty()) {
+        cv_.wait(lock);
+      } else if (std::chrono::steady_clock::now() - first_event_added_ >= params_.max_latency) {
+        FlushImpl();
+      } else {
+        cv_.wait_until(lock, first_event_added_ + params_.max_latency);
+      }
+    }
+  }
+
+ public:
+  explicit ActorEmitBuffer(ActorEmitBuffering params) : params_(params) {
+    events_.reserve(params_.max_events);
+    flusher_ = std::thread([this]() { FlusherThread(); });
+  }
+
+  ~ActorEmitBuffer() {
+    {
+      std::lock_guard lock(mutex_);
+      done_ = true;
+      cv_.notify_one();
+    }
+    flusher_.join();
+    Flush();
+  }
+
+  void AddGeneric(ICleanupAndLinkAndPublish& handler,
+                  TopicID tid,
+                  std::shared_ptr<crnt::CurrentSuper> e,
+                  ActorModelDeadline deadline) {
+    std::lock_guard lock(mutex_);
+    Add(handler, tid, deadline).e = std::move(e);
+    FlushIfNeeded();
+  }
+
+  void AddInline(ICleanupAndLinkAndPublish& handler,
+                 TopicID tid,
+                 ActorModelInlineEvent const& e,
+                 ActorModelDeadline deadline) {
+    std::lock_guard lock(mutex_);
+    Add(handler, tid, deadline).inline_e = e;
+    FlushIfNeeded();
+  }
+
+  void Flush() {
+    std::lock_guard lock(mutex_);
+    FlushImpl();
+  }
+
+ private:
+  void FlushImpl() {
+    size_t i = 0u;
+    while (i < events_.size()) {
+      BufferedEvent const& head = events_[i];
+      bool const is_inline = (head.e == nullptr);
+      size_t j = i;
+      while (j < events_.size() && events_[j].handler == head.handler && events_[j].tid == head.tid) {
+        if (is_inline) {
+          inline_batch_.push_back(events_[j].inline_e);
+        } else {
+          generic_batch_.push_back(std::move(events_[j].e));
+        }
+        deadlines_batch_.push_back(events_[j].deadline);
+        ++j;
+      }
+      if (is_inline) {
+        head.handler->PublishInlineEvents(
+            head.tid, inline_batch_.data(), deadlines_batch_.data(), inline_batch_.size());
+        inline_batch_.clear();
+      } else {
+        head.handler->PublishGenericEvents(
+            head.tid, generic_batch_.data(), deadlines_batch_.data(), generic_batch_.size());
+        generic_batch_.clear();
+      }
+      deadlines_batch_.clear();
+      i = j;
+    }
+    events_.clear();
+  }
+};
+
+inline ActorEmitBuffer*& InternalActorEmitBufferOfThisThread() {
+  thread_local ActorEmitBuffer* buffer = nullptr;
+  return buffer;
+}
+
+class ActorEmitBufferScope final {
+ private:
+  ActorEmitBuffer buffer_;
+  ActorEmitBuffer* const previous_;
+
+  ActorEmitBufferScope(ActorEmitBufferScope const&) = delete;
+  ActorEmitBufferScope& operator=(ActorEmitBufferScope const&) = delete;
+  ActorEmitBufferScope(ActorEmitBufferScope&&) = delete;
+  ActorEmitBufferScope& operator=(ActorEmitBufferScope&&) = delete;
+
+ public:
+  explicit ActorEmitBufferScope(ActorEmitBuffering params = ActorEmitBuffering())
+      : buffer_(params), previous_(InternalActorEmitBufferOfThisThread()) {
+    // Nested scopes are fine, but what was buffered by the outer scope must go first.
+    if (previous_) {
+      previous_->Flush();
+    }
+    InternalActorEmitBufferOfThisThread() = &buffer_;
+  }
+
+  ~ActorEmitBufferScope() {
+    buffer_.Flush();
+    InternalActorEmitBufferOfThisThread() = previous_;
+  }
+
+  void Flush() { buffer_.Flush(); }
+};
+
+// Flushes the events buffered by this thread, if any. A no-op if there is no `ActorEmitBufferScope` active.
+inline void C5T_EMIT_FLUSH() {
+  if (ActorEmitBuffer* buffer = InternalActorEmitBufferOfThisThread()) {
+    buffer->Flush();
+  }
+}
+
+template <class T>
+void InternalPublishInlineEvent(TopicID tid, ActorModelInlineEvent const& e, ActorModelDeadline deadline) {
+  ICleanupAndLinkAndPublish& handler = C5T_ACTOR_MODEL_INSTANCE().HandlerPerType(std::type_index(typeid(T)));
+  if (ActorEmitBuffer* buffer = InternalActorEmitBufferOfThisThread()) {
+    buffer->AddInline(handler, tid, e, deadline);
+  } else {
+    handler.PublishInlineEvents(tid, &e, &deadline, 1u);
+  }
+}
+
+template <class T, class... ARGS>
+void InternalEmitEventTo(TopicID tid, std::shared_ptr<T> event, ActorModelDeadline deadline = kActorModelNoDeadline) {
+  if constexpr (kActorModelIsInlineEvent<T>) {
+    ActorModelInlineEvent e;
+    InternalConstructInlineEvent<T>(e, *event);
+    InternalPublishInlineEvent<T>(tid, e, deadline);
+  } else {
+    ICleanupAndLinkAndPublish& handler = C5T_ACTOR_MODEL_INSTANCE().HandlerPerType(std::type_index(typeid(T)));
+    std::shared_ptr<crnt::CurrentSuper> e(std::move(event));
+    if (ActorEmitBuffer* buffer = InternalActorEmitBufferOfThisThread()) {
+      buffer->AddGeneric(handler, tid, std::move(e), deadline);
+    } else {
+      handler.PublishGenericEvents(tid, &e, &deadline, 1u);
+    }
+  }
+}
+
+template <class T, class... ARGS>
+void InternalEmitWithDeadline(ActorModelDeadline deadline, TopicID tid, ARGS&&... args) {
+  if constexpr (kActorModelIsInlineEvent<T>) {
+    ActorModelInlineEvent e;
+    InternalConstructInlineEvent<T>(e, std::forward<ARGS>(args)...);
+    InternalPublishInlineEvent<T>(tid, e, deadline);
+  } else {
+    static_assert(std::is_base_of_v<crnt::CurrentSuper, T>,
+                  "The events that are not small and trivially copyable must derive from `crnt::CurrentSuper`.");
+    InternalEmitEventTo(tid, std::make_shared<T>(std::forward<ARGS>(args)...), deadline);
+  }
 }
 
 template <class T, class... ARGS>
 void C5T_EMIT(TopicID tid, ARGS&&... args) {
-  InternalEmitEventTo(tid, std::make_shared<T>(std::forward<ARGS>(args)...));
+  InternalEmitWithDeadline<T>(kActorModelNoDeadline, tid, std::forward<ARGS>(args)...);
+}
+
+// The event is dropped by each subscriber that has not started processing it by the `deadline`.
+template <class T, class... ARGS>
+void C5T_EMIT_WITH_DEADLINE(ActorModelDeadline deadline, TopicID tid, ARGS&&... args) {
+  InternalEmitWithDeadline<T>(deadline, tid, std::forward<ARGS>(args)...);
+}
+
+// The event is dropped by each subscriber that has not started processing it within `ttl` from now.
+template <class T, class... ARGS>
+void C5T_EMIT_WITH_TTL(std::chrono::microseconds ttl, TopicID tid, ARGS&&... args) {
+  InternalEmitWithDeadline<T>(std::chrono::steady_clock::now() + ttl, tid, std::forward<ARGS>(args)...);
+}
+
+inline void InternalSetTopicRetention(std::type_index t, TopicID tid, TopicRetention const& retention) {
+  C5T_ACTOR_MODEL_INSTANCE().HandlerPerType(t).SetTopicRetention(tid, retention);
 }
 
 inline void C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE() {
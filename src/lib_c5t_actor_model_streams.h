@@ -0,0 +1,193 @@
+#pragma once
+
+// A small dataflow layer on top of the actor model.
+//
+// Usage:
+//   auto const scope = C5T_STREAM(topic_in)
+//                          .Filter([](In const& e) { return e.x > 0; })
+//                          .Map([](In const& e) { return Out(e.x * 10); })
+//                          .To(topic_out);
+//
+// The whole chain of operators is fused into a single subscriber: one mailbox, one thread, one queue hop,
+// regardless of how many operators there are. The stateful operators (`Window`, `Aggregate`) keep their state
+// within that subscriber, so they need no synchronization. The chain is instantiated afresh by each `.To()`, so the
+// subscribers made from the same stream, or from its copies, each have their own state. To deliberately split a long
+// chain across threads, materialize the intermediate results into a topic with `.To()`, and start another
+// `C5T_STREAM()` from it.
+//
+// The lambdas passed to `Map` can return either the value, which is then wrapped into a `shared_ptr`,
+// or a `shared_ptr` right away, which is handy for the events that are neither copyable nor movable.
+
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "lib_c5t_actor_model.h"
+
+// The event emitted by `Window()`: the events of the window, oldest first.
+template <class T>
+struct ActorStreamWindow final : crnt::CurrentSuper {
+  std::vector<std::shared_ptr<T>> events;
+};
+
+// The event emitted by `Aggregate()` every time the aggregate for some key is updated.
+template <class K, class A>
+struct ActorStreamAggregate final : crnt::CurrentSuper {
+  K key;
+  A value;
+  ActorStreamAggregate(K key, A value) : key(std::move(key)), value(std::move(value)) {}
+};
+
+template <class R>
+struct ActorStreamMapResult final {
+  using type = R;
+  static std::shared_ptr<R> Wrap(R&& r) { return std::make_shared<R>(std::move(r)); }
+};
+
+template <class R>
+struct ActorStreamMapResult<std::shared_ptr<R>> final {
+  using type = R;
+  static std::shared_ptr<R> Wrap(std::shared_ptr<R>&& r) { return std::move(r); }
+};
+
+template <class IN, class OUT>
+class ActorStream final {
+ public:
+  using sink_t = std::function<void(std::shared_ptr<OUT>)>;
+  using stage_t = std::function<void(std::shared_ptr<IN>, sink_t const&)>;
+  // Makes the fused chain, with the fresh state of its stateful operators, once per `.To()`.
+  using make_stage_t = std::function<stage_t()>;
+
+ private:
+  template <class, class>
+  friend class ActorStream;
+
+  TopicKeys<IN> sources_;
+  make_stage_t make_stage_;
+
+  struct Worker final {
+    stage_t const stage;
+    sink_t const sink;
+
+    Worker(TopicID destination, stage_t stage)
+        : stage(std::move(stage)),
+          sink([destination](std::shared_ptr<OUT> e) { InternalEmitEventTo<OUT>(destination, std::move(e)); }) {}
+
+    void OnSharedEvent(std::shared_ptr<IN> e) { stage(std::move(e), sink); }
+    // The small trivially copyable events are delivered by value, and are only wrapped into `shared_ptr`-s here.
+    void OnEvent(IN const& e) { stage(std::make_shared<IN>(e), sink); }
+    void OnBatchDone() {}
+    void OnShutdown() {}
+  };
+
+  template <class OUT2>
+  using next_t = std::function<void(std::shared_ptr<OUT>, typename ActorStream<IN, OUT2>::sink_t const&)>;
+
+  // `make_next()` is called once per `.To()`, along with the `make_stage_()` of the operators before it.
+  template <class OUT2>
+  ActorStream<IN, OUT2> Then(std::function<next_t<OUT2>()> make_next) const {
+    return ActorStream<IN, OUT2>(sources_, [make_prev = make_stage_, moved_make_next = std::move(make_next)]() {
+      return typename ActorStream<IN, OUT2>::stage_t(
+          [prev = make_prev(), next = moved_make_next()](std::shared_ptr<IN> e,
+                                                         typename ActorStream<IN, OUT2>::sink_t const& sink) {
+            prev(std::move(e), [&](std::shared_ptr<OUT> x) { next(std::move(x), sink); });
+          });
+    });
+  }
+
+ public:
+  ActorStream(TopicKeys<IN> sources, make_stage_t make_stage)
+      : sources_(std::move(sources)), make_stage_(std::move(make_stage)) {}
+
+  template <class F>
+  ActorStream Filter(F&& f) const {
+    return Then<OUT>([moved_f = std::forward<F>(f)]() {
+      return next_t<OUT>([moved_f](std::shared_ptr<OUT> e, sink_t const& sink) {
+        if (moved_f(static_cast<OUT const&>(*e))) {
+          sink(std::move(e));
+        }
+      });
+    });
+  }
+
+  template <class F,
+            class R = std::decay_t<std::invoke_result_t<F, OUT const&>>,
+            class OUT2 = typename ActorStreamMapResult<R>::type>
+  ActorStream<IN, OUT2> Map(F&& f) const {
+    return Then<OUT2>([moved_f = std::forward<F>(f)]() {
+      return next_t<OUT2>([moved_f](std::shared_ptr<OUT> e, typename ActorStream<IN, OUT2>::sink_t const& sink) {
+        sink(ActorStreamMapResult<R>::Wrap(moved_f(static_cast<OUT const&>(*e))));
+      });
+    });
+  }
+
+  // Count-based windows: emits the last `size` events every `slide` events. Tumbling if `slide` is zero or `size`.
+  ActorStream<IN, ActorStreamWindow<OUT>> Window(size_t size, size_t slide = 0u) const {
+    using window_t = ActorStreamWindow<OUT>;
+    struct State final {
+      std::deque<std::shared_ptr<OUT>> events;
+      size_t added_since_emitted = 0u;
+    };
+    return Then<window_t>([size, slide = (slide ? slide : size)]() {
+      return next_t<window_t>([size, slide, state = std::make_shared<State>()](
+                                  std::shared_ptr<OUT> e, typename ActorStream<IN, window_t>::sink_t const& sink) {
+        state->events.push_back(std::move(e));
+        if (state->events.size() > size) {
+          state->events.pop_front();
+        }
+        ++state->added_since_emitted;
+        if (state->events.size() == size && state->added_since_emitted >= slide) {
+          state->added_since_emitted = 0u;
+          auto w = std::make_shared<window_t>();
+          w->events.assign(std::begin(state->events), std::end(state->events));
+          sink(std::move(w));
+        }
+      });
+    });
+  }
+
+  // Keyed aggregation: `a = f(a, e)` for the aggregate `a` of the key `k(e)`, starting from `a0` for each key.
+  // The aggregates of all the keys ever seen are kept for as long as the subscriber lives, so the number of distinct
+  // keys should be bounded.
+  template <class KF,
+            class A,
+            class F,
+            class K = std::decay_t<std::invoke_result_t<KF, OUT const&>>,
+            class OUT2 = ActorStreamAggregate<K, A>>
+  ActorStream<IN, OUT2> Aggregate(KF&& k, A a0, F&& f) const {
+    return Then<OUT2>([moved_k = std::forward<KF>(k), moved_a0 = std::move(a0), moved_f = std::forward<F>(f)]() {
+      return next_t<OUT2>([moved_k, moved_a0, moved_f, state = std::make_shared<std::map<K, A>>()](
+                              std::shared_ptr<OUT> e, typename ActorStream<IN, OUT2>::sink_t const& sink) {
+        OUT const& x = *e;
+        K key = moved_k(x);
+        auto it = state->find(key);
+        if (it == std::end(*state)) {
+          it = state->emplace(key, moved_a0).first;
+        }
+        it->second = moved_f(std::move(it->second), x);
+        sink(std::make_shared<OUT2>(std::move(key), it->second));
+      });
+    });
+  }
+
+  // Runs the fused chain as a single subscriber to the sources, emitting its output into `destination`.
+  [[nodiscard]] ActorSubscriberScopeFor<Worker> To(TopicKey<OUT> destination) const {
+    return sources_.template InternalSubscribeTo<Worker>(destination.GetTopicID(), make_stage_());
+  }
+};
+
+template <class T>
+ActorStream<T, T> C5T_STREAM(TopicKeys<T> sources) {
+  return ActorStream<T, T>(std::move(sources), []() {
+    return typename ActorStream<T, T>::stage_t(
+        [](std::shared_ptr<T> e, std::function<void(std::shared_ptr<T>)> const& sink) { sink(std::move(e)); });
+  });
+}
+
+template <class T>
+ActorStream<T, T> C5T_STREAM(TopicKey<T> source) {
+  return C5T_STREAM(+source);
+}
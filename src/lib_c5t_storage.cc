@@ -1,60 +1,711 @@
 // TOOD: consider LevelDB and/or `sqlite` and/or PgSQL!
 
 #include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_set>
+
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif  // __SSE4_2__
 
 #include "bricks/util/singleton.h"
 #include "bricks/file/file.h"
+#include "bricks/strings/util.h"
+#include "bricks/sync/waitable_atomic.h"
 
 // NOTE: Safe, since everything in the file is `JSON<>`-ifified, at least as of now.
 static inline std::string kStorageTombstone = "-\n";
 
-class C5T_STORAGE_Instance : public C5T_STORAGE_Interface {
- private:
-  std::string const path_;
+// The values of the file-per-key backend are written into these files first, see `WriteKeyFile()`.
+constexpr static char kStorageTmpFilePrefix[] = "c5t_storage.tmp.";
+
+// The ordered keys of the fields of the file-per-key backend, and the file that marks them as safe to use on startup.
+constexpr static char kStorageKeysFileName[] = "c5t_storage.keys";
+constexpr static char kStorageKeysCleanFileName[] = "c5t_storage.keys.clean";
+// How many keys the file-per-key backend reads from, or writes into, its index at a time.
+constexpr static size_t kStorageKeysBatchSize = 1000u;
+
+void RegisterStorageInstance(C5T_STORAGE_Interface* instance) {
+  auto& s = current::Singleton<C5T_Storage_Fields_Singleton>();
+  if (s.pimpl) {
+    std::cerr << "FATAL: Attempted to use two `C5T_STORAGE` instances." << std::endl;
+    ::abort();
+  }
+  s.pimpl = instance;
+}
+
+void UnregisterStorageInstance(C5T_STORAGE_Interface* instance) { ReplaceRegisteredStorageInstance(instance, nullptr); }
 
-  // Of type `C5T_FIELD_INTERFACE<T>*` of respective `T`-s.
-  std::map<std::string, C5T_STORAGE_FIELD_Interface*> field_inner_impls_;
+void ReplaceRegisteredStorageInstance(C5T_STORAGE_Interface* from, C5T_STORAGE_Interface* to) {
+  auto& s = current::Singleton<C5T_Storage_Fields_Singleton>();
+  if (s.pimpl != from) {
+    std::cerr << "FATAL: Confusion with active `C5T_STORAGE` instances." << std::endl;
+    ::abort();
+  }
+  s.pimpl = to;
+}
+
+static uint64_t NextStorageInstanceID() {
+  static std::atomic<uint64_t> next_id = 1u;
+  return next_id++;
+}
+
+C5T_STORAGE_Instance::C5T_STORAGE_Instance(std::string path,
+                                           C5T_STORAGE_CACHE_LIMITS const& cache_limits,
+                                           bool registered)
+    : path_(std::move(path)),
+      cache_limits_(cache_limits),
+      instance_id_(NextStorageInstanceID()),
+      registered_(registered) {
+  C5T_STORAGE_META_SINGLETON().VisitAllFields(
+      [this](C5T_STORAGE_FIELD_Interface* f) { field_inner_impls_[f->Name()] = f; });
+  if (registered_) {
+    RegisterStorageInstance(this);
+  }
+}
+
+C5T_STORAGE_Instance::~C5T_STORAGE_Instance() {
+  if (registered_) {
+    UnregisterStorageInstance(this);
+  }
+}
+
+#ifndef __SSE4_2__
+// Slicing-by-8: the table `k` is for the byte that is `k` bytes before the end of each eight-byte step.
+static std::array<std::array<uint32_t, 256>, 8> const& StorageCRC32CTables() {
+  static std::array<std::array<uint32_t, 256>, 8> const tables = []() {
+    std::array<std::array<uint32_t, 256>, 8> t;
+    for (uint32_t i = 0u; i < 256u; ++i) {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = (c >> 1) ^ ((c & 1u) ? 0x82f63b78u : 0u);
+      }
+      t[0][i] = c;
+    }
+    for (uint32_t i = 0u; i < 256u; ++i) {
+      for (size_t k = 1u; k < 8u; ++k) {
+        t[k][i] = (t[k - 1u][i] >> 8) ^ t[0][t[k - 1u][i] & 0xff];
+      }
+    }
+    return t;
+  }();
+  return tables;
+}
+#endif  // __SSE4_2__
+
+uint32_t StorageCRC32C(char const* data, size_t size, uint32_t crc) {
+  auto const* p = reinterpret_cast<unsigned char const*>(data);
+  crc = ~crc;
+#ifdef __SSE4_2__
+  uint64_t c = crc;
+  for (; size >= 8u; size -= 8u, p += 8u) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = static_cast<uint32_t>(c);
+  for (; size; --size, ++p) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+#else
+  auto const& t = StorageCRC32CTables();
+  for (; size >= 8u; size -= 8u, p += 8u) {
+    uint32_t lo;
+    uint32_t hi;
+    std::memcpy(&lo, p, sizeof(lo));
+    std::memcpy(&hi, p + 4u, sizeof(hi));
+    // NOTE: Little-endian only, same as the rest of the binary formats of the storage.
+    lo ^= crc;
+    crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^ t[3][hi & 0xff] ^
+          t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+  }
+  for (; size; --size, ++p) {
+    crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+  }
+#endif  // __SSE4_2__
+  return ~crc;
+}
+
+uint32_t StorageRecordChecksum(char const* record, uint64_t payload_length) {
+  uint32_t const crc = StorageCRC32C(record, kStorageRecordChecksumOffset);
+  return StorageCRC32C(record + kStorageRecordHeaderSize, static_cast<size_t>(payload_length), crc);
+}
+
+void AppendStorageRecord(std::string& out,
+                         char op,
+                         std::string const& field,
+                         std::string const& key,
+                         char const* value,
+                         uint32_t value_length) {
+  size_t const begin = out.length();
+  uint32_t const lengths[4] = {
+      static_cast<uint32_t>(field.length()), static_cast<uint32_t>(key.length()), value_length, 0u};
+  out += op;
+  out.append(reinterpret_cast<char const*>(lengths), sizeof(lengths));
+  out += field;
+  out += key;
+  out.append(value, value_length);
+  uint32_t const checksum =
+      StorageRecordChecksum(out.data() + begin, static_cast<uint64_t>(lengths[0]) + lengths[1] + lengths[2]);
+  std::memcpy(&out[begin + kStorageRecordChecksumOffset], &checksum, sizeof(checksum));
+}
+
+void AppendStorageRecord(std::string& out, C5T_STORAGE_WRITE const& w) {
+  if (Exists(w.value)) {
+    std::string const& value = Value(w.value);
+    AppendStorageRecord(out, kStorageRecordOpSet, w.field, w.key, value.data(), static_cast<uint32_t>(value.length()));
+  } else {
+    AppendStorageRecord(out, kStorageRecordOpDel, w.field, w.key, nullptr, 0u);
+  }
+}
+
+void AppendStorageBatchRecord(std::string& out, std::vector<C5T_STORAGE_WRITE> const& writes) {
+  std::string batch;
+  for (auto const& w : writes) {
+    AppendStorageRecord(batch, w);
+  }
+  AppendStorageRecord(out, kStorageRecordOpBatch, "", "", batch.data(), static_cast<uint32_t>(batch.length()));
+}
+
+bool ParseStorageRecords(std::string const& data, std::vector<C5T_STORAGE_WRITE>& writes) {
+  size_t i = 0u;
+  while (i < data.length()) {
+    if (data.length() - i < kStorageRecordHeaderSize) {
+      return false;
+    }
+    char const op = data[i];
+    uint32_t lengths[4];
+    std::memcpy(lengths, data.data() + i + 1u, sizeof(lengths));
+    uint64_t const payload_length = static_cast<uint64_t>(lengths[0]) + lengths[1] + lengths[2];
+    if ((op != kStorageRecordOpSet && op != kStorageRecordOpDel) ||
+        payload_length > data.length() - i - kStorageRecordHeaderSize ||
+        StorageRecordChecksum(data.data() + i, payload_length) != lengths[3]) {
+      return false;
+    }
+    i += kStorageRecordHeaderSize;
+    C5T_STORAGE_WRITE& w = writes.emplace_back();
+    w.field = data.substr(i, lengths[0]);
+    w.key = data.substr(i + lengths[0], lengths[1]);
+    if (op == kStorageRecordOpSet) {
+      w.value = data.substr(i + lengths[0] + lengths[1], lengths[2]);
+    }
+    i += static_cast<size_t>(payload_length);
+  }
+  return true;
+}
+
+// The keys of a field that may exist, so that the lookups of the keys that do not exist need not touch the disk.
+// The bits are persisted as is, so the hash is FNV-1a, not `std::hash<>`, which may differ between the builds.
+class C5T_STORAGE_BloomFilter final {
+ private:
+  size_t capacity_ = 0u;
+  size_t size_ = 0u;
+  uint32_t hashes_ = 1u;
+  std::vector<uint64_t> bits_;
 
-  // Used to `.clear()` all the containers and force-re-load as changing active storages.
-  std::map<C5T_STORAGE_FIELD_Interface const*, bool> initialized_;
+  template <class F>
+  void ForEachBit(std::string const& key, F&& f) const {
+    uint64_t h = 14695981039346656037ull;
+    for (char const c : key) {
+      h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    // Double hashing, the second hash being odd, so that it does not repeat the same bits.
+    uint64_t const h2 = ((h >> 33) ^ (h * 0x9e3779b97f4a7c15ull)) | 1u;
+    uint64_t const m = bits_.size() * 64u;
+    for (uint32_t i = 0u; i < hashes_; ++i) {
+      f((h + i * h2) % m);
+    }
+  }
 
  public:
-  explicit C5T_STORAGE_Instance(std::string path) : path_(std::move(path)) {
-    auto& s = current::Singleton<C5T_Storage_Fields_Singleton>();
-    if (s.pimpl) {
-      std::cerr << "FATAL: Attempted to use two `C5T_STORAGE` instances." << std::endl;
-      ::abort();
+  C5T_STORAGE_BloomFilter() = default;
+
+  // Sized for `capacity` keys to have the false positive rate of `false_positive_rate`.
+  C5T_STORAGE_BloomFilter(size_t capacity, double false_positive_rate)
+      : capacity_(std::max(capacity, static_cast<size_t>(1024u))) {
+    double const ln2 = std::log(2.0);
+    double const bits = -static_cast<double>(capacity_) * std::log(false_positive_rate) / (ln2 * ln2);
+    bits_.resize(static_cast<size_t>(bits / 64.0) + 1u);
+    hashes_ = static_cast<uint32_t>(std::clamp(std::lround(bits / capacity_ * ln2), 1l, 16l));
+  }
+
+  bool Full() const { return size_ >= capacity_; }
+  size_t Capacity() const { return capacity_; }
+
+  void Add(std::string const& key) {
+    ForEachBit(key, [this](uint64_t i) { bits_[i / 64u] |= (1ull << (i % 64u)); });
+    ++size_;
+  }
+
+  bool MayContain(std::string const& key) const {
+    bool result = true;
+    ForEachBit(key, [&](uint64_t i) { result = result && (bits_[i / 64u] & (1ull << (i % 64u))); });
+    return result;
+  }
+
+  // Per the share of the bits set: the probability that all the bits of a key that is not there are set.
+  double EstimatedFalsePositiveRate() const {
+    size_t set = 0u;
+    for (uint64_t const word : bits_) {
+      set += static_cast<size_t>(__builtin_popcountll(word));
     }
-    C5T_STORAGE_META_SINGLETON().VisitAllFields(
-        [this](C5T_STORAGE_FIELD_Interface* f) { field_inner_impls_[f->Name()] = f; });
-    s.pimpl = this;
+    return std::pow(static_cast<double>(set) / (bits_.size() * 64u), hashes_);
+  }
+
+  // In host byte order: `uint64_t` capacity, size, hashes, and the number of words, followed by the words.
+  std::string Serialize() const {
+    uint64_t const header[4] = {capacity_, size_, hashes_, bits_.size()};
+    std::string result(reinterpret_cast<char const*>(header), sizeof(header));
+    result.append(reinterpret_cast<char const*>(bits_.data()), bits_.size() * sizeof(uint64_t));
+    return result;
   }
-  ~C5T_STORAGE_Instance() {
-    auto& s = current::Singleton<C5T_Storage_Fields_Singleton>();
-    if (s.pimpl != this) {
-      std::cerr << "FATAL: Confusion with active `C5T_STORAGE` instances." << std::endl;
-      ::abort();
+
+  bool Deserialize(std::string const& data) {
+    uint64_t header[4];
+    if (data.length() < sizeof(header)) {
+      return false;
+    }
+    std::memcpy(header, data.data(), sizeof(header));
+    if (!header[0] || !header[2] || header[2] > 16u || !header[3] ||
+        data.length() != sizeof(header) + header[3] * sizeof(uint64_t)) {
+      return false;
     }
-    s.pimpl = nullptr;
+    capacity_ = header[0];
+    size_ = header[1];
+    hashes_ = static_cast<uint32_t>(header[2]);
+    bits_.resize(header[3]);
+    std::memcpy(bits_.data(), data.data() + sizeof(header), header[3] * sizeof(uint64_t));
+    return true;
   }
+};
+
+// The original backend: one file per key, with the value being the contents of this file.
+class C5T_STORAGE_FilePerKeyInstance final : public C5T_STORAGE_Instance {
+ private:
+  // The directories of the keys, see `C5T_STORAGE_FILE_PER_KEY_PATH()`, known to exist, so that the writes do not
+  // `MkDir()` them every time.
+  std::shared_mutex dirs_mutex_;
+  std::unordered_set<std::string> dirs_;
+
+  // The fields known to be in this layout, either as checked or as migrated to it, see `MigrateIfNeeded()`, and the
+  // locks to migrate them under, one per field, so that migrating one field does not hold up the others.
+  std::shared_mutex migration_mutex_;
+  std::set<std::string> migrated_;
+  std::map<std::string, std::mutex> migration_locks_;
+
+  // To name the temporary files of the writes, see `WriteKeyFile()`.
+  std::atomic<uint64_t> tmp_files_ = 0u;
 
-  size_t FieldsCount() const override { return field_inner_impls_.size(); }
+  // The multi-key commits are made atomic by the journal: it is written, then the keys are, then it is removed.
+  // The journal that is there on startup is from a commit that may have been applied partially, so it is re-applied.
+  // NOTE: This backend does not `fsync`, so this is atomic against the crashes of the process, not of the OS.
+  std::string const journal_path_;
+  std::mutex journal_mutex_;
 
-  void ListFields(std::function<void(std::string const&)> cb) override {
-    for (auto const& [k, _] : field_inner_impls_) {
-      cb(k);
+  // The keys of each field, in order, for `DoScan()` and `DoListKeys()`: a B+tree of the `BTree` backend in its own
+  // file, with the same fields and keys, and empty values, so that the scans neither list the directories nor keep
+  // the keys in memory. Kept up to date by the writes, which hold `index_mutex_` shared. Each field is listed into it
+  // from its directory on the first scan, holding `index_mutex_` exclusively, unless it is there already: the fields
+  // that are, `indexed_`, are also stored in it, as the keys of the field named "". As this backend does not `fsync`,
+  // the index is only trusted on startup if the instance that wrote it was destroyed cleanly, and is rebuilt otherwise.
+  std::string const index_clean_path_;
+  std::shared_mutex index_mutex_;
+  std::unique_ptr<C5T_STORAGE_Interface> index_;
+  std::set<std::string> indexed_;
+
+  // The Bloom filters of the fields, so that `DoLoad()` of a key that was never written returns right away, instead
+  // of failing to open the file. Loaded, or built by listing the directories, for all the fields by `bloom_thread_`,
+  // started as the instance is created, and grown by re-listing the directory once full, by the write that fills the
+  // filter. Neither holds `bloom_mutex_` while listing: the keys written meanwhile are collected in `bloom_building_`,
+  // and added as the filter is ready, and until then `DoLoad()` goes to the disk. Persisted as the instance is
+  // destroyed, and deleted as loaded, so that what is on disk after a crash is not trusted. Also deleted by the first
+  // write to a field whose filter is not loaded, including the writes with the filters disabled, as it would not know
+  // of the key written. The deleted keys stay in the filter, and the tombstones are read as before.
+  double const bloom_false_positive_rate_;
+  std::shared_mutex bloom_mutex_;
+  std::map<std::string, C5T_STORAGE_BloomFilter> bloom_;
+  std::map<std::string, std::vector<std::string>> bloom_building_;
+  // The fields whose persisted filter, if any, is deleted already by a write, see `BloomAdd()`.
+  std::set<std::string> bloom_not_persisted_;
+  std::atomic<bool> bloom_thread_stop_ = false;
+  std::thread bloom_thread_;
+  std::atomic<uint64_t> bloom_lookups_ = 0u;
+  std::atomic<uint64_t> bloom_negatives_ = 0u;
+  std::atomic<uint64_t> bloom_false_positives_ = 0u;
+
+  std::string BloomPath(std::string const& field) const {
+    return current::FileSystem::JoinPath(path_, "c5t_storage.bloom." + field);
+  }
+
+  std::string KeyPath(std::string const& field, std::string const& key) const {
+    return current::FileSystem::JoinPath(path_, C5T_STORAGE_FILE_PER_KEY_PATH(field, key));
+  }
+
+  // Written under a temporary name first, and then renamed, so that the crash in the middle of a write does not leave
+  // a part of the value behind, which would then read as if the key does not exist. The values stay human-readable,
+  // which is what this backend is for, so they are not framed with checksums, unlike the records of the `Log` one.
+  void WriteKeyFile(std::string const& field, std::string const& key, std::string const& contents) {
+    std::string const tmp_path =
+        current::FileSystem::JoinPath(path_, kStorageTmpFilePrefix + current::ToString(++tmp_files_));
+    current::FileSystem::WriteStringToFile(contents, tmp_path.c_str());
+    current::FileSystem::RenameFile(tmp_path, KeyPath(field, key));
+  }
+
+  // Must be called with `dirs_mutex_` held exclusively.
+  void MkDirsLocked(std::string const& field, std::string const& key) {
+    std::string const dir = C5T_STORAGE_FILE_PER_KEY_DIR(field, key);
+    if (!dirs_.count(dir)) {
+      // The field, then the first level, then the second one.
+      for (size_t i : {field.length(), field.length() + 3u, dir.length()}) {
+        current::FileSystem::MkDir(current::FileSystem::JoinPath(path_, dir.substr(0u, i)),
+                                   current::FileSystem::MkDirParameters::Silent);
+      }
+      dirs_.insert(dir);
     }
   }
 
-  bool NeedToStartFresh(C5T_STORAGE_FIELD_Interface const& field) override {
-    bool& b = initialized_[&field];
-    if (!b) {
-      b = true;
-      return true;
+  void MkDirs(std::string const& field, std::string const& key) {
+    {
+      std::shared_lock lock(dirs_mutex_);
+      if (dirs_.count(C5T_STORAGE_FILE_PER_KEY_DIR(field, key))) {
+        return;
+      }
+    }
+    std::unique_lock lock(dirs_mutex_);
+    MkDirsLocked(field, key);
+  }
+
+  // Moves the keys of `field` stored as `field/key` into their directories. Through a staging directory, so that
+  // the keys named the same as the directories of the fan-out do not get in the way. Only the files are moved, the
+  // directories of the fan-out stay, and the staging directory is removed once it is empty. If interrupted, continues
+  // from where it stopped the next time. Called before the Bloom filter of the field is loaded or looked at.
+  void MigrateIfNeeded(std::string const& field) {
+    {
+      std::shared_lock lock(migration_mutex_);
+      if (migrated_.count(field)) {
+        return;
+      }
+    }
+    std::mutex* field_mutex;
+    {
+      std::unique_lock lock(migration_mutex_);
+      field_mutex = &migration_locks_[field];
+    }
+    std::lock_guard field_lock(*field_mutex);
+    {
+      std::shared_lock lock(migration_mutex_);
+      if (migrated_.count(field)) {
+        return;
+      }
+    }
+    std::string const dir = current::FileSystem::JoinPath(path_, field);
+    std::string const staging = current::FileSystem::JoinPath(path_, "c5t_storage.migrating." + field);
+    std::vector<std::string> legacy_keys;
+    try {
+      current::FileSystem::ScanDir(dir, [&legacy_keys](std::string const& key) { legacy_keys.push_back(key); });
+    } catch (current::Exception const&) {
+      // No such field on disk yet.
+    }
+    if (!legacy_keys.empty()) {
+      current::FileSystem::MkDir(staging, current::FileSystem::MkDirParameters::Silent);
+      for (std::string const& key : legacy_keys) {
+        current::FileSystem::RenameFile(current::FileSystem::JoinPath(dir, key),
+                                        current::FileSystem::JoinPath(staging, key));
+      }
+    }
+    if (current::FileSystem::IsDir(staging)) {
+      std::vector<std::string> keys;
+      current::FileSystem::ScanDir(staging, [&keys](std::string const& key) { keys.push_back(key); });
+      for (std::string const& key : keys) {
+        MkDirs(field, key);
+        current::FileSystem::RenameFile(current::FileSystem::JoinPath(staging, key), KeyPath(field, key));
+      }
+      bool empty = true;
+      current::FileSystem::ScanDir(
+          staging,
+          [&empty](std::string const&) { empty = false; },
+          current::FileSystem::ScanDirParameters::ListFilesAndDirs);
+      if (empty) {
+        current::FileSystem::RmDir(staging);
+      }
+      // The Bloom filter persisted before the migration, if any, may not know of the keys that were moved, nor may
+      // the index.
+      current::FileSystem::RmFile(BloomPath(field), current::FileSystem::RmFileParameters::Silent);
+      std::unique_lock lock(index_mutex_);
+      index_->DoCommit({C5T_STORAGE_WRITE{"", field, nullptr}});
+      indexed_.erase(field);
+    }
+    std::unique_lock lock(migration_mutex_);
+    migrated_.insert(field);
+  }
+
+  // Calls `f(key, file)` for all the files of `field`.
+  void ScanField(std::string const& field, std::function<void(std::string const& key, std::string const& file)> f) {
+    MigrateIfNeeded(field);
+    auto const subdirs = [](std::string const& dir) {
+      std::vector<std::string> result;
+      try {
+        current::FileSystem::ScanDir(
+            dir,
+            [&result](std::string const& name) { result.push_back(name); },
+            current::FileSystem::ScanDirParameters::ListDirsOnly);
+      } catch (current::Exception const&) {
+        // No such field on disk yet.
+      }
+      return result;
+    };
+    std::string const dir = current::FileSystem::JoinPath(path_, field);
+    for (std::string const& level1 : subdirs(dir)) {
+      for (std::string const& level2 : subdirs(current::FileSystem::JoinPath(dir, level1))) {
+        std::string const leaf = current::FileSystem::JoinPath(current::FileSystem::JoinPath(dir, level1), level2);
+        current::FileSystem::ScanDir(leaf, [&](std::string const& key) {
+          f(key, current::FileSystem::JoinPath(leaf, key));
+        });
+      }
+    }
+  }
+
+  // Builds the filter of `field`, which must be in `bloom_building_` already, from what is persisted if `load` is set
+  // and it is there, and by listing the directory otherwise.
+  void BuildBloom(std::string const& field, size_t capacity, bool load) {
+    // The migration deletes the persisted filter, which would not know of the keys moved.
+    MigrateIfNeeded(field);
+    C5T_STORAGE_BloomFilter bloom;
+    bool loaded = false;
+    if (load) {
+      std::string const path = BloomPath(field);
+      try {
+        loaded = bloom.Deserialize(current::FileSystem::ReadFileAsString(path));
+        current::FileSystem::RmFile(path, current::FileSystem::RmFileParameters::Silent);
+      } catch (current::Exception const&) {
+        // Not persisted.
+      }
+    }
+    if (!loaded) {
+      std::vector<std::string> keys;
+      ScanField(field, [&keys](std::string const& key, std::string const&) { keys.push_back(key); });
+      bloom = C5T_STORAGE_BloomFilter(std::max(capacity, 2u * keys.size()), bloom_false_positive_rate_);
+      for (std::string const& key : keys) {
+        bloom.Add(key);
+      }
+    }
+    std::unique_lock lock(bloom_mutex_);
+    for (std::string const& key : bloom_building_[field]) {
+      bloom.Add(key);
+    }
+    bloom_building_.erase(field);
+    bloom_[field] = std::move(bloom);
+  }
+
+  // Loads or builds the filters of all the fields, see `bloom_thread_`.
+  void BuildBlooms() {
+    std::vector<std::string> fields;
+    ListFields([&fields](std::string const& field) { fields.push_back(field); });
+    for (std::string const& field : fields) {
+      if (bloom_thread_stop_) {
+        return;
+      }
+      {
+        std::unique_lock lock(bloom_mutex_);
+        if (bloom_.count(field) || bloom_building_.count(field)) {
+          continue;
+        }
+        bloom_building_[field];
+      }
+      BuildBloom(field, 0u, true);
+    }
+  }
+
+  // Returns `false` if `key` is certainly not there, and null if the filter of `field` is not ready.
+  Optional<bool> BloomMayContain(std::string const& field, std::string const& key) {
+    std::shared_lock lock(bloom_mutex_);
+    auto const cit = bloom_.find(field);
+    if (cit != std::end(bloom_)) {
+      return cit->second.MayContain(key);
+    }
+    return nullptr;
+  }
+
+  // Called after the file is written, so that the filter built concurrently by listing the directory sees it.
+  void BloomAdd(std::string const& field, std::string const& key) {
+    {
+      std::shared_lock lock(bloom_mutex_);
+      if (!bloom_.count(field) && !bloom_building_.count(field) && bloom_not_persisted_.count(field)) {
+        return;
+      }
+    }
+    size_t grow_to = 0u;
+    {
+      std::unique_lock lock(bloom_mutex_);
+      auto const it = bloom_.find(field);
+      if (it != std::end(bloom_)) {
+        if (it->second.Full()) {
+          grow_to = 2u * it->second.Capacity();
+          bloom_.erase(it);
+          bloom_building_[field].push_back(key);
+        } else {
+          it->second.Add(key);
+        }
+      } else {
+        auto const bit = bloom_building_.find(field);
+        if (bit != std::end(bloom_building_)) {
+          bit->second.push_back(key);
+        }
+        if (!bloom_not_persisted_.count(field)) {
+          current::FileSystem::RmFile(BloomPath(field), current::FileSystem::RmFileParameters::Silent);
+          bloom_not_persisted_.insert(field);
+        }
+      }
+    }
+    if (grow_to) {
+      BuildBloom(field, grow_to, false);
+    }
+  }
+
+  // Lists the keys of `field` into the index, unless they are there already.
+  void IndexField(std::string const& field) {
+    MigrateIfNeeded(field);
+    {
+      std::shared_lock lock(index_mutex_);
+      if (indexed_.count(field)) {
+        return;
+      }
+    }
+    std::unique_lock lock(index_mutex_);
+    if (indexed_.count(field)) {
+      return;
+    }
+    std::vector<C5T_STORAGE_WRITE> writes;
+    // What the index has of this field, if anything, is from before its keys were migrated.
+    do {
+      writes.clear();
+      index_->DoScan(field, "", "", kStorageKeysBatchSize, [&](std::string const& key, std::string const&) {
+        writes.push_back(C5T_STORAGE_WRITE{field, key, nullptr});
+      });
+      if (!writes.empty()) {
+        index_->DoCommit(writes);
+      }
+    } while (!writes.empty());
+    ScanField(field, [&](std::string const& key, std::string const& file) {
+      if (current::FileSystem::GetFileSize(file) != kStorageTombstone.length() ||
+          current::FileSystem::ReadFileAsString(file) != kStorageTombstone) {
+        writes.push_back(C5T_STORAGE_WRITE{field, key, std::string()});
+        if (writes.size() == kStorageKeysBatchSize) {
+          index_->DoCommit(writes);
+          writes.clear();
+        }
+      }
+    });
+    writes.push_back(C5T_STORAGE_WRITE{"", field, std::string()});
+    index_->DoCommit(writes);
+    indexed_.insert(field);
+  }
+
+  // Calls `f(keys)` for the keys of `field` within `[begin, end)`, from the index, in order, `kStorageKeysBatchSize`
+  // at a time, while it returns `true`.
+  void ScanIndex(std::string const& field,
+                 std::string begin,
+                 std::string const& end,
+                 std::function<bool(std::vector<std::string> const& keys)> f) {
+    IndexField(field);
+    while (true) {
+      std::vector<std::string> keys;
+      index_->DoScan(field, begin, end, kStorageKeysBatchSize, [&keys](std::string const& key, std::string const&) {
+        keys.push_back(key);
+      });
+      if (keys.empty() || !f(keys)) {
+        return;
+      }
+      begin = keys.back() + '\0';
+    }
+  }
+
+  void Apply(C5T_STORAGE_WRITE const& w) {
+    if (Exists(w.value)) {
+      DoSave(w.field, w.key, Value(w.value));
     } else {
-      return false;
+      DoDelete(w.field, w.key);
+    }
+  }
+
+ public:
+  C5T_STORAGE_FilePerKeyInstance(std::string path, C5T_STORAGE_OPTIONS const& options)
+      : C5T_STORAGE_Instance(std::move(path), options.cache_limits),
+        journal_path_(current::FileSystem::JoinPath(path_, "c5t_storage.txn")),
+        index_clean_path_(current::FileSystem::JoinPath(path_, kStorageKeysCleanFileName)),
+        bloom_false_positive_rate_(options.bloom_false_positive_rate) {
+    try {
+      current::FileSystem::ScanDir(path_, [this](std::string const& file) {
+        if (file.compare(0u, sizeof(kStorageTmpFilePrefix) - 1u, kStorageTmpFilePrefix) == 0) {
+          // Left by a crash in the middle of a write, which thus did not happen.
+          current::FileSystem::RmFile(current::FileSystem::JoinPath(path_, file),
+                                      current::FileSystem::RmFileParameters::Silent);
+        }
+      });
+    } catch (current::Exception const&) {
+      // No storage on disk yet.
+    }
+    try {
+      current::FileSystem::RmFile(index_clean_path_);
+    } catch (current::Exception const&) {
+      // Not destroyed cleanly, or a new storage, so the index, if any, may not know of the last writes.
+      current::FileSystem::RmFile(current::FileSystem::JoinPath(path_, kStorageKeysFileName),
+                                  current::FileSystem::RmFileParameters::Silent);
+    }
+    index_ = CreateBTreeIndexInstance(path_, kStorageKeysFileName);
+    index_->DoListKeys("", [this](std::string const& field) { indexed_.insert(field); });
+    std::string journal;
+    bool journaled = true;
+    try {
+      journal = current::FileSystem::ReadFileAsString(journal_path_);
+    } catch (current::Exception const&) {
+      journaled = false;
+    }
+    if (journaled) {
+      std::vector<C5T_STORAGE_WRITE> writes;
+      if (ParseStorageRecords(journal, writes)) {
+        for (auto const& w : writes) {
+          Apply(w);
+        }
+      }
+      current::FileSystem::RmFile(journal_path_, current::FileSystem::RmFileParameters::Silent);
+    }
+    if (bloom_false_positive_rate_ > 0) {
+      bloom_thread_ = std::thread([this]() { BuildBlooms(); });
+    }
+  }
+
+  ~C5T_STORAGE_FilePerKeyInstance() override {
+    if (bloom_thread_.joinable()) {
+      bloom_thread_stop_ = true;
+      bloom_thread_.join();
+    }
+    index_ = nullptr;
+    try {
+      current::FileSystem::WriteStringToFile("", index_clean_path_.c_str());
+    } catch (current::Exception const&) {
+      // Will be rebuilt.
+    }
+    std::unique_lock lock(bloom_mutex_);
+    for (auto const& [field, bloom] : bloom_) {
+      try {
+        current::FileSystem::WriteStringToFile(bloom.Serialize(), BloomPath(field).c_str());
+      } catch (current::Exception const&) {
+        // Will be rebuilt.
+      }
     }
   }
 
@@ -62,55 +713,219 @@ class C5T_STORAGE_Instance : public C5T_STORAGE_Interface {
 #ifdef C5T_DEBUG_STORAGE
     std::cerr << "DoSave(" << path_ << ", " << field << ", " << key << ", " << value << ")\n";
 #endif  // C5T_DEBUG_STORAGE
-    // TODO: do not create the same dir twice
-    current::FileSystem::MkDir(path_ + '/' + field, current::FileSystem::MkDirParameters::Silent);
+    MigrateIfNeeded(field);
+    MkDirs(field, key);
+    std::shared_lock lock(index_mutex_);
     try {
-      current::FileSystem::WriteStringToFile(value, current::FileSystem::JoinPath(path_, field + '/' + key).c_str());
+      WriteKeyFile(field, key, value);
     } catch (current::Exception const&) {
       // TODO: logging, error handling logic
     }
+    BloomAdd(field, key);
+    index_->DoCommit({C5T_STORAGE_WRITE{field, key, std::string()}});
   }
 
   Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
 #ifdef C5T_DEBUG_STORAGE
     std::cerr << "DoLoad(" << path_ << ", " << field << ", " << key << ")\n";
 #endif  // C5T_DEBUG_STORAGE
+    MigrateIfNeeded(field);
+    // Not looked at until it is ready, see `bloom_thread_`.
+    Optional<bool> const bloom = bloom_false_positive_rate_ > 0 ? BloomMayContain(field, key) : nullptr;
+    if (Exists(bloom)) {
+      ++bloom_lookups_;
+      if (!Value(bloom)) {
+        ++bloom_negatives_;
+        return nullptr;
+      }
+    }
     try {
-      std::string s =
-          current::FileSystem::ReadFileAsString(current::FileSystem::JoinPath(path_, field + '/' + key).c_str());
+      std::string s = current::FileSystem::ReadFileAsString(KeyPath(field, key).c_str());
       if (s != kStorageTombstone) {
         return s;
-      } else {
-        return nullptr;
       }
     } catch (current::Exception const&) {
-      return nullptr;
+      // No such key.
+    }
+    if (Exists(bloom)) {
+      ++bloom_false_positives_;
     }
+    return nullptr;
   }
 
   void DoDelete(std::string const& field, std::string const& key) override {
 #ifdef C5T_DEBUG_STORAGE
     std::cerr << "DoDelete(" << path_ << ", " << field << ", " << key << ")\n";
 #endif  // C5T_DEBUG_STORAGE
-    current::FileSystem::MkDir(path_ + '/' + field, current::FileSystem::MkDirParameters::Silent);
+    MigrateIfNeeded(field);
+    MkDirs(field, key);
+    std::shared_lock lock(index_mutex_);
     try {
-      current::FileSystem::WriteStringToFile(kStorageTombstone,
-                                             current::FileSystem::JoinPath(path_, field + '/' + key).c_str());
+      WriteKeyFile(field, key, kStorageTombstone);
     } catch (current::Exception const&) {
       // TODO: logging, error handling logic
     }
+    index_->DoCommit({C5T_STORAGE_WRITE{field, key, nullptr}});
   }
 
-  C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const& name) override {
-    auto const cit = field_inner_impls_.find(name);
-    return cit != std::end(field_inner_impls_) ? cit->second : nullptr;
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    ScanIndex(field, "", "", [&f](std::vector<std::string> const& keys) {
+      for (std::string const& key : keys) {
+        f(key);
+      }
+      return true;
+    });
+  }
+
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    if (!limit) {
+      return;
+    }
+    ScanIndex(field, begin, end, [&](std::vector<std::string> const& keys) {
+      // The keys deleted since they were read from the index are skipped.
+      for (std::string const& key : keys) {
+        Optional<std::string> const value = DoLoad(field, key);
+        if (Exists(value)) {
+          f(key, Value(value));
+          if (!--limit) {
+            return false;
+          }
+        }
+      }
+      return true;
+    });
+  }
+
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override {
+    if (writes.size() == 1u) {
+      Apply(writes.front());
+      return;
+    }
+    std::string journal;
+    for (auto const& w : writes) {
+      AppendStorageRecord(journal, w);
+    }
+    std::lock_guard lock(journal_mutex_);
+    // Written under a temporary name first, so that the journal, if it exists, is always complete.
+    std::string const tmp_path = journal_path_ + ".tmp";
+    current::FileSystem::WriteStringToFile(journal, tmp_path.c_str());
+    current::FileSystem::RenameFile(tmp_path, journal_path_);
+    for (auto const& w : writes) {
+      Apply(w);
+    }
+    current::FileSystem::RmFile(journal_path_, current::FileSystem::RmFileParameters::Silent);
+  }
+
+  void DoCompact() override {}
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats = C5T_STORAGE_Instance::DoGetStats();
+    stats.bloom.lookups = bloom_lookups_.load();
+    stats.bloom.negatives = bloom_negatives_.load();
+    stats.bloom.false_positives = bloom_false_positives_.load();
+    stats.bloom.configured_false_positive_rate = bloom_false_positive_rate_;
+    std::shared_lock lock(bloom_mutex_);
+    stats.bloom.filters = bloom_.size();
+    for (auto const& [_, bloom] : bloom_) {
+      stats.bloom.estimated_false_positive_rate =
+          std::max(stats.bloom.estimated_false_positive_rate, bloom.EstimatedFalsePositiveRate());
+    }
+    return stats;
   }
 };
 
-std::unique_ptr<C5T_STORAGE_Interface> C5T_STORAGE_CREATE_UNIQUE_INSANCE(std::string const& path) {
+size_t C5T_STORAGE_PRELOAD_Impl(std::string const& field,
+                                std::vector<std::string> const& keys,
+                                std::function<bool(std::string const&)> load,
+                                C5T_STORAGE_PRELOAD_OPTIONS const& options) {
+  struct Progress final {
+    size_t done = 0u;
+    size_t found = 0u;
+    // The first exception thrown by `load()`, to be re-thrown from the calling thread, once the threads are joined.
+    std::exception_ptr error;
+  };
+  current::WaitableAtomic<Progress> progress;
+  std::atomic<size_t> next(0u);
+  std::vector<std::thread> threads;
+  size_t const threads_count = std::max(static_cast<size_t>(1u), std::min(options.threads, keys.size()));
+  auto const t0 = std::chrono::steady_clock::now();
+  auto const log = [&](char const* what, Progress const& p) {
+    if (options.logger) {
+      double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+      options.logger(std::string(what) + " `" + field + "`: " + current::ToString(p.done) + " of " +
+                     current::ToString(keys.size()) + " keys, " + current::ToString(p.found) + " found, " +
+                     current::ToString(seconds) + "s.");
+    }
+  };
+  for (size_t t = 0u; t < threads_count; ++t) {
+    threads.emplace_back([&]() {
+      while (true) {
+        size_t const i = next.fetch_add(1u);
+        if (i >= keys.size()) {
+          return;
+        }
+        bool found;
+        try {
+          found = load(keys[i]);
+        } catch (...) {
+          std::exception_ptr e = std::current_exception();
+          progress.MutableUse([&e](Progress& p) {
+            if (!p.error) {
+              p.error = std::move(e);
+            }
+          });
+          next = keys.size();
+          return;
+        }
+        progress.MutableUse([found](Progress& p) {
+          ++p.done;
+          if (found) {
+            ++p.found;
+          }
+        });
+      }
+    });
+  }
+  size_t const total = keys.size();
+  while (!progress.WaitFor([total](Progress const& p) { return p.done == total || p.error; },
+                           options.progress_period)) {
+    log("Preloading", progress.GetValue());
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  Progress const result = progress.GetValue();
+  if (result.error) {
+    std::rethrow_exception(result.error);
+  }
+  log("Preloaded", result);
+  return result.found;
+}
+
+std::unique_ptr<C5T_STORAGE_Interface> C5T_STORAGE_CREATE_UNIQUE_INSANCE(std::string const& path,
+                                                                         C5T_STORAGE_OPTIONS const& options) {
 #ifdef C5T_DEBUG_STORAGE
   std::cerr << "DoInit(" << path << ")\n";
 #endif  // C5T_DEBUG_STORAGE
   current::FileSystem::MkDir(path, current::FileSystem::MkDirParameters::Silent);
-  return std::make_unique<C5T_STORAGE_Instance>(path);
+  std::unique_ptr<C5T_STORAGE_Interface> instance;
+  if (options.backend == C5T_STORAGE_BACKEND::Log) {
+    instance = CreateLogStorageInstance(path, options);
+  } else if (options.backend == C5T_STORAGE_BACKEND::BTree) {
+    instance = CreateBTreeStorageInstance(path, options);
+  } else {
+    instance = std::make_unique<C5T_STORAGE_FilePerKeyInstance>(path, options);
+  }
+  instance = CreateBackupStorageInstance(std::move(instance), options);
+  if (options.write_behind) {
+    instance = CreateWriteBehindStorageInstance(std::move(instance), options);
+  }
+  if (options.ttl_sweep_period.count() > 0) {
+    instance = CreateTTLSweeperStorageInstance(std::move(instance), options);
+  }
+  return instance;
 }
@@ -1,12 +1,33 @@
 #pragma once
 
-// NOTE: NEED THREAD SAFETY AND ATOMIC OPERATIONS!!!
+// NOTE: The storage is thread-safe. The in-memory contents of each field are sharded by key, the reads of the keys
+//       that are already loaded only take the shared lock of their shard, and the writes to a key are persisted under
+//       the exclusive lock of its shard, so that what is on disk is in the same order as what is in memory.
 
 // #define C5T_DEBUG_STORAGE
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
 #include <functional>
+#include <iosfwd>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 #ifdef C5T_DEBUG_STORAGE
 #include <iostream>
@@ -21,6 +42,41 @@ struct StorageKeyNotFoundException final : current::Exception {};
 struct StorageNotInitializedException final : current::Exception {};
 struct StorageFieldDeclaredAndNotDefinedException final : current::Exception {};
 struct StorageInternalErrorException final : current::Exception {};
+struct StorageIndexNotDefinedException final : current::Exception {};
+// The `BTree` backend limits the length of `field` plus `key` to about one kilobyte, see `lib_c5t_storage_btree.cc`.
+struct StorageKeyTooLongException final : current::Exception {};
+// See `C5T_STORAGE_EXPORT()` and `C5T_STORAGE_IMPORT()`.
+struct StorageChangesNotTrackedException final : current::Exception {};
+struct StorageImportFailedException final : current::Exception {};
+
+// The bounds of the in-memory cache of each field. Zero means unbounded.
+struct C5T_STORAGE_CACHE_LIMITS final {
+  // An estimate: the sizes of the keys and of the serialized values, plus a fixed per-entry overhead.
+  size_t max_bytes_per_field = 0u;
+  // The "this key does not exist" entries, cached so that the repeated lookups of missing keys do not hit the disk.
+  size_t max_negative_entries_per_field = 10000u;
+};
+
+struct C5T_STORAGE_CACHE_STATS final {
+  uint64_t hits = 0u;
+  uint64_t misses = 0u;
+  uint64_t evictions = 0u;
+  size_t entries = 0u;
+  size_t negative_entries = 0u;
+  size_t bytes = 0u;
+
+  C5T_STORAGE_CACHE_STATS& operator+=(C5T_STORAGE_CACHE_STATS const& rhs) {
+    hits += rhs.hits;
+    misses += rhs.misses;
+    evictions += rhs.evictions;
+    entries += rhs.entries;
+    negative_entries += rhs.negative_entries;
+    bytes += rhs.bytes;
+    return *this;
+  }
+};
+
+class C5T_STORAGE_Interface;
 
 class C5T_STORAGE_FIELD_Interface {
  protected:
@@ -37,6 +93,71 @@ class C5T_STORAGE_FIELD_Interface {
 
   // TODO: move this into the storage layer?
   virtual void* GetMapAsVoidPtr(C5T_STORAGE_FIELD_Interface const&) = 0;
+
+  virtual C5T_STORAGE_CACHE_STATS CacheStats() = 0;
+
+  // Drops the old versions of the values that no snapshot as of `oldest_snapshot` or newer needs.
+  virtual void ReclaimVersions(uint64_t oldest_snapshot) = 0;
+
+  // Whether some keys of this field may have TTLs in the storage instance in use. Only such fields are swept.
+  virtual bool HasTTLs() const = 0;
+  virtual void SetHasTTLs(bool) = 0;
+  // Deletes up to `max_keys` of the keys of this field that have expired. Returns how many were deleted.
+  virtual size_t SweepExpired(C5T_STORAGE_Interface& impl, size_t max_keys) = 0;
+
+  // The fields of the storage this field keeps what it has in: itself, its TTLs, and its indexes.
+  virtual std::vector<std::string> StoredFieldNames() const = 0;
+};
+
+// A single write, as committed. No value means the key is deleted.
+struct C5T_STORAGE_WRITE final {
+  std::string field;
+  std::string key;
+  Optional<std::string> value;
+};
+
+// The Bloom filters of the file-per-key backend, see `C5T_STORAGE_OPTIONS::bloom_false_positive_rate`.
+struct C5T_STORAGE_BLOOM_STATS final {
+  // The fields whose filters are ready, see `C5T_STORAGE_OPTIONS::bloom_false_positive_rate`.
+  uint64_t filters = 0u;
+  uint64_t lookups = 0u;
+  // The lookups answered with "does not exist" without touching the disk.
+  uint64_t negatives = 0u;
+  // The lookups that passed the filter, and then found nothing on disk. Of the lookups of the keys that do not exist,
+  // `false_positives / (false_positives + negatives)` is the share that was not filtered out.
+  uint64_t false_positives = 0u;
+  double configured_false_positive_rate = 0.0;
+  // The worst one across the fields, per how full their filters are.
+  double estimated_false_positive_rate = 0.0;
+};
+
+// The runtime metrics of the storage. The ones that do not apply to the backend in use stay zero.
+struct C5T_STORAGE_STATS final {
+  // Write-behind: the number of keys not yet written, for how long the oldest of them has been waiting,
+  // the number of keys written by the flusher, and the number of writes that were coalesced into later ones.
+  size_t write_behind_queue_depth = 0u;
+  std::chrono::microseconds write_behind_lag = std::chrono::microseconds(0);
+  uint64_t write_behind_flushed = 0u;
+  uint64_t write_behind_coalesced = 0u;
+
+  // The in-memory caches of the fields: all of them together, and each one by its name.
+  C5T_STORAGE_CACHE_STATS cache;
+  std::map<std::string, C5T_STORAGE_CACHE_STATS> cache_per_field;
+
+  C5T_STORAGE_BLOOM_STATS bloom;
+
+  // The `BTree` backend: the size of its file, in pages, and how many of them are free to be reused.
+  uint64_t btree_pages = 0u;
+  uint64_t btree_free_pages = 0u;
+
+  // The keys deleted by the TTL sweeper as they have expired.
+  uint64_t ttl_swept = 0u;
+
+  // The `Log` backend, as of when it was opened: the records read, the ones skipped since their checksums did not
+  // match, and the size of the partially written record, if any, cut off the end of the log.
+  uint64_t log_recovered_records = 0u;
+  uint64_t log_corrupt_records = 0u;
+  uint64_t log_truncated_bytes = 0u;
 };
 
 class C5T_STORAGE_Interface {
@@ -46,14 +167,45 @@ class C5T_STORAGE_Interface {
 
   // Stateless, effectively static, inner methods.
   virtual size_t FieldsCount() const = 0;
+  virtual C5T_STORAGE_CACHE_LIMITS CacheLimits() const = 0;
   virtual void ListFields(std::function<void(std::string const&)> cb) = 0;
 
   virtual void DoSave(std::string const& field, std::string const& key, std::string const& value) = 0;
   virtual Optional<std::string> DoLoad(std::string const& field, std::string const& key) = 0;
   virtual void DoDelete(std::string const& field, std::string const& key) = 0;
 
+  // Calls `f(key, value)` for up to `limit` keys of `field` that are within `[begin, end)`, in the lexicographical
+  // order of the keys. An empty `end` means no upper bound. Sees what is committed, not the in-flight transactions.
+  virtual void DoScan(std::string const& field,
+                      std::string const& begin,
+                      std::string const& end,
+                      size_t limit,
+                      std::function<void(std::string const& key, std::string const& value)> f) = 0;
+
+  // Calls `f(key)` for all the keys of `field`, in order.
+  virtual void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) = 0;
+
+  // Applies all the writes atomically: if the process crashes, either all of them or none of them are there. If the OS
+  // crashes, this only holds with `FsyncEveryWrite()`, and only for the `Log` and `BTree` backends, as the file-per-key
+  // one never `fsync`-s. With the `Log` and `BTree` backends, the commits made concurrently from different threads are
+  // written together, as a group, and, with `FsyncEveryWrite()`, are `fsync`-ed together too. The file-per-key backend
+  // writes them one at a time, each with its own journal.
+  virtual void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) = 0;
+
+  // Reclaims the disk space taken by the overwritten and deleted values, if the backend has any to reclaim.
+  virtual void DoCompact() = 0;
+
+  virtual C5T_STORAGE_STATS DoGetStats() = 0;
+
   // Returns `C5T_STORAGE_FIELD<T>*` of the respective type.
   virtual C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const&) = 0;
+
+  // Unique per storage instance, and the same for its decorators, such as write-behind. See `C5T_STORAGE_HANDLE()`.
+  virtual uint64_t InstanceID() const = 0;
+
+  // See `C5T_STORAGE_EXPORT()` and `C5T_STORAGE_IMPORT()`. Both return the change sequence number the export is as of.
+  virtual uint64_t DoExport(uint64_t since, std::function<void(std::string const& chunk)> f) = 0;
+  virtual uint64_t DoImport(std::istream& in) = 0;
 };
 
 class C5T_STORAGE_META_SINGLETON_Impl final {
@@ -84,80 +236,1060 @@ inline C5T_STORAGE_META_SINGLETON_Impl& C5T_STORAGE_META_SINGLETON() {
   return impl;
 }
 
+// What a transaction has written to one field, see `C5T_STORAGE_TXN_FIELD`.
+class C5T_STORAGE_TXN_FIELD_Interface {
+ public:
+  virtual ~C5T_STORAGE_TXN_FIELD_Interface() = default;
+  // Adds the mutexes of the shards of the keys written, to be locked while the transaction is committed.
+  virtual void AddMutexes(std::vector<std::shared_mutex*>& mutexes) const = 0;
+  // Called with these mutexes locked: `Prepare()` before the writes are committed, with the version of the commit and
+  // the oldest snapshot, see `C5T_STORAGE_VERSIONS_Impl::BeginCommit()`, `Apply()` once they are, and `Publish()`
+  // once the snapshots may see them.
+  virtual void Prepare(uint64_t version, uint64_t oldest_snapshot) = 0;
+  virtual void Apply() = 0;
+  virtual void Publish() = 0;
+};
+
+// The transaction of this thread, if it is within `C5T_STORAGE_TXN()`.
+struct C5T_STORAGE_TXN_Impl final {
+  std::vector<C5T_STORAGE_WRITE> writes;
+  // What is written to each field, kept aside until committed, and only then applied to its in-memory contents.
+  std::map<C5T_STORAGE_FIELD_Interface const*, std::unique_ptr<C5T_STORAGE_TXN_FIELD_Interface>> fields;
+};
+
+inline C5T_STORAGE_TXN_Impl*& C5T_STORAGE_TXN_OF_THIS_THREAD() {
+  thread_local C5T_STORAGE_TXN_Impl* txn = nullptr;
+  return txn;
+}
+
+// The versions of the in-memory values, for `C5T_STORAGE_SNAPSHOT()`. Each write, or each transaction as a whole, gets
+// the next version, and, while there are snapshots older than it, the value it overwrites is kept, along with its
+// version, for them to read.
+constexpr static uint64_t kStorageNoSnapshot = std::numeric_limits<uint64_t>::max();
+
+class C5T_STORAGE_VERSIONS_Impl final {
+ private:
+  std::mutex mutex_;
+  uint64_t current_ = 0u;
+  std::multiset<uint64_t> snapshots_;
+  // The versions of the transactions being committed, see `BeginCommit()`.
+  std::set<uint64_t> committing_;
+  std::condition_variable committed_;
+
+ public:
+  // Returns the version of this write, and the oldest snapshot, `kStorageNoSnapshot` if there are none.
+  // Must be called with the lock of the shard of the key held, so that no snapshot sees this version half-written.
+  std::pair<uint64_t, uint64_t> BeginWrite() {
+    std::lock_guard lock(mutex_);
+    return {++current_, snapshots_.empty() ? kStorageNoSnapshot : *snapshots_.begin()};
+  }
+
+  // Same as `BeginWrite()`, for a transaction: all of its keys get this one version. Must be called with the locks of
+  // the shards of all of them held. Until `EndCommit()`, the snapshots that would see this version wait for it in
+  // `Pin()`, so that none of them sees a part of the transaction.
+  std::pair<uint64_t, uint64_t> BeginCommit() {
+    std::lock_guard lock(mutex_);
+    committing_.insert(++current_);
+    return {current_, snapshots_.empty() ? kStorageNoSnapshot : *snapshots_.begin()};
+  }
+
+  void EndCommit(uint64_t version) {
+    {
+      std::lock_guard lock(mutex_);
+      committing_.erase(version);
+    }
+    committed_.notify_all();
+  }
+
+  uint64_t OldestSnapshot() {
+    std::lock_guard lock(mutex_);
+    return snapshots_.empty() ? kStorageNoSnapshot : *snapshots_.begin();
+  }
+
+  // NOTE: The snapshot is added before waiting for the transactions it would see, so that the writes made meanwhile
+  // keep the values it needs.
+  uint64_t Pin() {
+    std::unique_lock lock(mutex_);
+    uint64_t const version = current_;
+    snapshots_.insert(version);
+    committed_.wait(lock, [&]() { return committing_.empty() || *committing_.begin() > version; });
+    return version;
+  }
+
+  // Returns the oldest snapshot if it is now newer than it was, or `0` if it has not changed.
+  uint64_t Unpin(uint64_t version) {
+    std::lock_guard lock(mutex_);
+    uint64_t const oldest_before = *snapshots_.begin();
+    snapshots_.erase(snapshots_.find(version));
+    uint64_t const oldest = snapshots_.empty() ? kStorageNoSnapshot : *snapshots_.begin();
+    return oldest != oldest_before ? oldest : 0u;
+  }
+};
+
+inline C5T_STORAGE_VERSIONS_Impl& C5T_STORAGE_VERSIONS() {
+  static C5T_STORAGE_VERSIONS_Impl impl;
+  return impl;
+}
+
+// The clock of the TTLs. The wall clock, since the expiration times are persisted.
+inline uint64_t C5T_STORAGE_TTL_NOW() {
+  return static_cast<uint64_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch())
+          .count());
+}
+
+// The version the reads of this thread see, if it is within `C5T_STORAGE_SNAPSHOT()`.
+inline uint64_t& C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD() {
+  thread_local uint64_t version = kStorageNoSnapshot;
+  return version;
+}
+
+// The in-memory contents of a field. Sharded by the hash of the key, so that the threads that access different keys
+// rarely contend for the same lock. The values are immutable once created, and are replaced as a whole on `Set`,
+// so that a value obtained under the shared lock remains valid after the lock is released.
+//
+// The contents are a cache of what is on disk, bounded by `C5T_STORAGE_CACHE_LIMITS`, split evenly across the shards.
+// Each shard evicts with CLOCK: the accesses set the "referenced" bit of the entry, which is cheap to do under the
+// shared lock, and, once the shard is over its budget, the hand sweeps the entries, clearing these bits, and evicts
+// the first one that was not referenced since the hand last passed it. What is written within a transaction only gets
+// here once the transaction is committed, see `C5T_STORAGE_TXN_FIELD`, so all that is here is on disk.
+//
+// The entries that have older versions kept for the snapshots are not evicted either: once evicted, the key would be
+// re-loaded with the latest value only. As the snapshots end, the versions they needed are dropped by `Reclaim()`.
+//
+// The keys read through the views, see `C5T_STORAGE_VIEW`, are kept as their serialized bytes, not decoded, until
+// they are read as a whole, or written.
+template <class T>
+class C5T_STORAGE_FIELD_CONTENTS final {
+ public:
+  using value_t = std::shared_ptr<T const>;
+  using raw_t = std::shared_ptr<std::string const>;
+
+  struct Entry final {
+    bool loaded = false;
+    value_t value;
+    std::atomic_bool referenced = true;
+    size_t bytes = 0u;
+    size_t ring_index = 0u;
+    // The version of `value`, zero if loaded from disk, and the previous values with their versions, oldest first.
+    uint64_t version = 0u;
+    std::vector<std::pair<uint64_t, value_t>> history;
+    // When `value` expires, in microseconds since the epoch, zero if never. Reads as "does not exist" once expired.
+    uint64_t expires_at = 0u;
+    // The serialized value, as loaded for the views, while the entry is not `loaded`. Decoded into `value` once needed.
+    raw_t raw;
+  };
+
+  using map_t = std::unordered_map<std::string, Entry>;
+
+  struct alignas(64) Shard final {
+    std::shared_mutex mutex;
+    map_t map;
+    // The entries in the order the hand of the CLOCK visits them. The nodes of `std::unordered_map` are stable.
+    std::vector<typename map_t::value_type*> ring;
+    size_t hand = 0u;
+    size_t bytes = 0u;
+    size_t negative_entries = 0u;
+    // The keys of the entries with a non-empty `history`.
+    std::unordered_set<std::string> versioned;
+  };
+
+  // Rough, but good enough for the budget to be meaningful: the node, the control block, and the object itself.
+  constexpr static size_t kEntryOverheadBytes = 64u + sizeof(T);
+  constexpr static size_t kRawEntryOverheadBytes = 64u + sizeof(std::string);
+
+ private:
+  constexpr static size_t kShards = 16u;
+  std::array<Shard, kShards> shards_;
+
+  size_t max_bytes_per_shard_ = 0u;
+  size_t max_negative_entries_per_shard_ = 0u;
+
+  std::atomic<uint64_t> hits_ = 0u;
+  std::atomic<uint64_t> misses_ = 0u;
+  std::atomic<uint64_t> evictions_ = 0u;
+
+  void RemoveFromRing(Shard& shard, Entry& e) {
+    shard.bytes -= e.bytes;
+    if (e.loaded && !e.value) {
+      --shard.negative_entries;
+    }
+    size_t const i = e.ring_index;
+    shard.ring[i] = shard.ring.back();
+    shard.ring[i]->second.ring_index = i;
+    shard.ring.pop_back();
+  }
+
+  // Drops the versions that end before `oldest_snapshot`: the snapshots that are as old or newer do not see them.
+  static void TrimHistory(Entry& e, uint64_t oldest_snapshot) {
+    size_t n = 0u;
+    while (n < e.history.size() &&
+           (n + 1u < e.history.size() ? e.history[n + 1u].first : e.version) <= oldest_snapshot) {
+      ++n;
+    }
+    e.history.erase(e.history.begin(), e.history.begin() + n);
+  }
+
+  // NOTE: The maps are keyed by `std::string`, and, before C++20, `std::unordered_map::find()` only takes the key
+  // type. So the lookups by `std::string_view` copy the key into the buffer of this thread, which does not allocate
+  // once it is as long as the keys looked up, instead of constructing an `std::string` every time.
+  static typename map_t::iterator Find(Shard& shard, std::string_view key) {
+    thread_local std::string buffer;
+    buffer.assign(key.data(), key.length());
+    return shard.map.find(buffer);
+  }
+
+  // Sets `value` to what the snapshot of version `snapshot` sees, if it is known without loading the key.
+  static bool Resolve(Entry const& e, uint64_t snapshot, value_t& value) {
+    if (e.version <= snapshot) {
+      if (e.loaded) {
+        value = Current(e);
+        return true;
+      }
+      return false;
+    }
+    for (auto it = e.history.rbegin(); it != e.history.rend(); ++it) {
+      if (it->first <= snapshot) {
+        value = it->second;
+        return true;
+      }
+    }
+    // NOTE: Can not happen: the value of a version newer than a snapshot always comes with the history.
+    value = e.value;
+    return true;
+  }
+
+ public:
+  // NOTE: `std::hash<std::string_view>` is the same as `std::hash<std::string>` of the same characters.
+  Shard& ShardOf(std::string_view key) { return shards_[std::hash<std::string_view>()(key) % kShards]; }
+
+  static bool Expired(uint64_t expires_at) { return expires_at && expires_at <= C5T_STORAGE_TTL_NOW(); }
+  static bool Expired(Entry const& e) { return Expired(e.expires_at); }
+
+  // The value of `e` as it reads now: null if it has expired.
+  static value_t Current(Entry const& e) { return Expired(e) ? nullptr : e.value; }
+
+  // Returns `true` and sets `value` if `key` is loaded. Only takes the shared lock.
+  bool GetIfLoaded(std::string_view key, value_t& value) {
+    Shard& shard = ShardOf(key);
+    std::shared_lock lock(shard.mutex);
+    auto const cit = Find(shard, key);
+    if (cit != std::end(shard.map) && cit->second.loaded) {
+      cit->second.referenced.store(true, std::memory_order_relaxed);
+      value = Current(cit->second);
+      hits_.fetch_add(1u, std::memory_order_relaxed);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // Same as `GetIfLoaded()`, but also returns `true` if only the serialized value is loaded, setting `raw` then.
+  bool GetIfLoadedOrRaw(std::string_view key, value_t& value, raw_t& raw) {
+    Shard& shard = ShardOf(key);
+    std::shared_lock lock(shard.mutex);
+    auto const cit = Find(shard, key);
+    if (cit != std::end(shard.map) && (cit->second.loaded || cit->second.raw)) {
+      cit->second.referenced.store(true, std::memory_order_relaxed);
+      if (cit->second.loaded) {
+        value = Current(cit->second);
+      } else if (!Expired(cit->second)) {
+        raw = cit->second.raw;
+      }
+      hits_.fetch_add(1u, std::memory_order_relaxed);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // Same as `GetIfLoaded()`, but as of the snapshot of version `snapshot`.
+  bool GetIfLoadedAsOf(std::string_view key, uint64_t snapshot, value_t& value) {
+    Shard& shard = ShardOf(key);
+    std::shared_lock lock(shard.mutex);
+    auto const cit = Find(shard, key);
+    if (cit != std::end(shard.map) && Resolve(cit->second, snapshot, value)) {
+      cit->second.referenced.store(true, std::memory_order_relaxed);
+      hits_.fetch_add(1u, std::memory_order_relaxed);
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  // These below must be called with the exclusive lock of `shard` held.
+
+  // Must be called before the value of `e` is replaced by the one of `version`. Keeps the value being replaced if
+  // there are snapshots older than `version`. Then `e` should be loaded, so that what is kept is what they see.
+  void Supersede(Shard& shard, std::string const& key, Entry& e, uint64_t version, uint64_t oldest_snapshot) {
+    bool const keep = oldest_snapshot < version;
+    if (keep) {
+      e.history.emplace_back(e.version, e.value);
+    }
+    e.version = version;
+    if (keep) {
+      TrimHistory(e, oldest_snapshot);
+      shard.versioned.insert(key);
+    }
+  }
+
+  // Same as `Resolve()`, for when the key is loaded as needed.
+  static value_t ValueAsOf(Entry const& e, uint64_t snapshot) {
+    value_t value;
+    Resolve(e, snapshot, value);
+    return value;
+  }
+
+  Entry& Emplace(Shard& shard, std::string const& key) {
+    auto const [it, inserted] = shard.map.try_emplace(key);
+    if (inserted) {
+      it->second.ring_index = shard.ring.size();
+      shard.ring.push_back(&*it);
+    }
+    return it->second;
+  }
+
+  // Sets the value of the entry, `nullptr` for "does not exist", with `bytes` being the size of its serialized form.
+  void Assign(Shard& shard, std::string const& key, Entry& e, value_t value, size_t bytes, bool is_miss = false) {
+    shard.bytes -= e.bytes;
+    if (e.loaded && !e.value) {
+      --shard.negative_entries;
+    }
+    e.loaded = true;
+    e.value = std::move(value);
+    e.raw = nullptr;
+    e.referenced.store(true, std::memory_order_relaxed);
+    e.bytes = e.value ? key.length() + bytes + kEntryOverheadBytes : 0u;
+    shard.bytes += e.bytes;
+    if (!e.value) {
+      ++shard.negative_entries;
+    }
+    if (is_miss) {
+      misses_.fetch_add(1u, std::memory_order_relaxed);
+    }
+  }
+
+  // Sets the serialized value of the entry that is not loaded, for it to be decoded once needed.
+  void AssignRaw(Shard& shard, std::string const& key, Entry& e, raw_t raw) {
+    shard.bytes -= e.bytes;
+    e.raw = std::move(raw);
+    e.referenced.store(true, std::memory_order_relaxed);
+    e.bytes = key.length() + e.raw->length() + kRawEntryOverheadBytes;
+    shard.bytes += e.bytes;
+    misses_.fetch_add(1u, std::memory_order_relaxed);
+  }
+
+  // May evict any entry, including the one just assigned, so its value should be copied out before.
+  void EvictIfNeeded(Shard& shard) {
+    auto const over_bytes = [&]() { return max_bytes_per_shard_ && shard.bytes > max_bytes_per_shard_; };
+    auto const over_negative = [&]() {
+      return max_negative_entries_per_shard_ && shard.negative_entries > max_negative_entries_per_shard_;
+    };
+    // Two full turns of the hand clear all the referenced bits, so if nothing could be evicted by then, nothing can.
+    size_t steps = 2u * shard.ring.size();
+    while (steps && (over_bytes() || over_negative())) {
+      --steps;
+      if (shard.hand >= shard.ring.size()) {
+        shard.hand = 0u;
+      }
+      auto* node = shard.ring[shard.hand];
+      Entry& e = node->second;
+      // When only the negative entries are over their limit, only the negative entries are evicted.
+      bool const eligible =
+          (e.loaded || e.raw) && e.history.empty() && (over_bytes() || (e.loaded && !e.value));
+      if (!eligible || e.referenced.exchange(false, std::memory_order_relaxed)) {
+        ++shard.hand;
+      } else {
+        // By the iterator, since the key lives in the node being erased.
+        auto const it = shard.map.find(node->first);
+        RemoveFromRing(shard, e);
+        shard.map.erase(it);
+        evictions_.fetch_add(1u, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Blocks all the accesses to this field while the returned locks are held.
+  std::vector<std::unique_lock<std::shared_mutex>> LockAll() {
+    std::vector<std::unique_lock<std::shared_mutex>> locks;
+    for (Shard& shard : shards_) {
+      locks.emplace_back(shard.mutex);
+    }
+    return locks;
+  }
+
+  // Takes the locks.
+  void Reclaim(uint64_t oldest_snapshot) {
+    for (Shard& shard : shards_) {
+      std::unique_lock lock(shard.mutex);
+      // NOTE: The snapshots taken since `oldest_snapshot` was found may be older than it, if it was the last one, and
+      // the writes made since then keep the versions they need. The snapshots taken from now on see the latest values
+      // of this shard, as the writes to it that are not complete yet hold its lock.
+      uint64_t const oldest = std::min(oldest_snapshot, C5T_STORAGE_VERSIONS().OldestSnapshot());
+      for (auto it = std::begin(shard.versioned); it != std::end(shard.versioned);) {
+        auto const cit = shard.map.find(*it);
+        if (cit != std::end(shard.map)) {
+          TrimHistory(cit->second, oldest);
+          if (!cit->second.history.empty()) {
+            ++it;
+            continue;
+          }
+          if (!cit->second.loaded) {
+            RemoveFromRing(shard, cit->second);
+            shard.map.erase(cit);
+          }
+        }
+        it = shard.versioned.erase(it);
+      }
+      EvictIfNeeded(shard);
+    }
+  }
+
+  // Takes the locks. Only called when there are no other accesses to this field, as the storage instance changes.
+  void Clear(C5T_STORAGE_CACHE_LIMITS const& limits) {
+    for (Shard& shard : shards_) {
+      std::unique_lock lock(shard.mutex);
+      shard.map.clear();
+      shard.ring.clear();
+      shard.hand = 0u;
+      shard.bytes = 0u;
+      shard.negative_entries = 0u;
+      shard.versioned.clear();
+    }
+    max_bytes_per_shard_ = (limits.max_bytes_per_field + kShards - 1u) / kShards;
+    max_negative_entries_per_shard_ = (limits.max_negative_entries_per_field + kShards - 1u) / kShards;
+    hits_ = 0u;
+    misses_ = 0u;
+    evictions_ = 0u;
+  }
+
+  C5T_STORAGE_CACHE_STATS Stats() {
+    C5T_STORAGE_CACHE_STATS stats;
+    stats.hits = hits_.load();
+    stats.misses = misses_.load();
+    stats.evictions = evictions_.load();
+    for (Shard& shard : shards_) {
+      std::shared_lock lock(shard.mutex);
+      stats.entries += shard.map.size();
+      stats.negative_entries += shard.negative_entries;
+      stats.bytes += shard.bytes;
+    }
+    return stats;
+  }
+};
+
 template <class T>
 struct C5T_STORAGE_FIELD_TYPES {
-  using rhs_t = std::pair<bool, std::unique_ptr<T>>;  // { loaded, value }
-  using map_t = std::unordered_map<std::string, rhs_t>;
+  using value_t = typename C5T_STORAGE_FIELD_CONTENTS<T>::value_t;
+  using map_t = C5T_STORAGE_FIELD_CONTENTS<T>;
+};
+
+// The keys of a field in order, with their values, fetched from the storage one page at a time. Usage:
+//   for (auto it = C5T_STORAGE(kv).Prefix("user:"); it.Next();) { ... it.Key() ... it.Value() ... }
+// The pages are read from the backend, bypassing the in-memory cache, so that a full scan does not evict what is hot.
+template <class T>
+class C5T_STORAGE_CURSOR final {
+ private:
+  C5T_STORAGE_FIELD_Interface const& self;
+  C5T_STORAGE_Interface& impl;
+  std::string next_begin_;
+  std::string const end_;
+  size_t const page_size_;
+
+  std::vector<std::pair<std::string, std::string>> page_;
+  size_t page_index_ = 0u;
+  bool last_page_ = false;
+
+  std::string key_;
+  T value_;
+
+ public:
+  C5T_STORAGE_CURSOR(C5T_STORAGE_FIELD_Interface const& self,
+                     C5T_STORAGE_Interface& impl,
+                     std::string begin,
+                     std::string end,
+                     size_t page_size)
+      : self(self),
+        impl(impl),
+        next_begin_(std::move(begin)),
+        end_(std::move(end)),
+        page_size_(std::max(page_size, static_cast<size_t>(1u))) {}
+
+  // Moves to the next key. Must be called before the first key is accessed. Returns `false` once done.
+  bool Next() {
+    while (true) {
+      if (page_index_ == page_.size()) {
+        if (last_page_) {
+          return false;
+        }
+        page_.clear();
+        page_index_ = 0u;
+        impl.DoScan(self.Name(), next_begin_, end_, page_size_, [this](std::string const& k, std::string const& v) {
+          page_.emplace_back(k, v);
+        });
+        if (page_.size() < page_size_) {
+          last_page_ = true;
+        } else {
+          // The smallest key greater than the last one of this page.
+          next_begin_ = page_.back().first + '\0';
+        }
+        continue;
+      }
+      auto& kv = page_[page_index_++];
+      T value;
+      // NOTE: The values that can not be decoded are skipped, same as `Has()` would return `false` for them.
+      if (self.DoDeserializeImpl(kv.second, &value)) {
+        key_ = std::move(kv.first);
+        value_ = std::move(value);
+        return true;
+      }
+    }
+  }
+
+  std::string const& Key() const { return key_; }
+  T const& Value() const { return value_; }
+};
+
+// The smallest key greater than all the keys that start with `prefix`, or an empty string if there is no such key.
+inline std::string C5T_STORAGE_PREFIX_END(std::string prefix) {
+  while (!prefix.empty() && static_cast<unsigned char>(prefix.back()) == 0xff) {
+    prefix.pop_back();
+  }
+  if (!prefix.empty()) {
+    prefix.back() = static_cast<char>(static_cast<unsigned char>(prefix.back()) + 1u);
+  }
+  return prefix;
+}
+
+// The secondary indexes, see `C5T_STORAGE_DEFINE_INDEX()`. The entries of the index `index` of the field `field` are
+// the keys of the `field@index` field in the storage, each being the indexed value, encoded, then '.', then the primary
+// key. The encoding preserves the order and is safe for file names, it is the hex of:
+// * for the integers, signed or not, a zero byte for the negative ones and a one byte for the rest, then the eight
+//   big-endian bytes of the value, so that the values of any integer types compare as numbers and match each other, and
+// * for the strings, the bytes with zeroes escaped as "\0\1", then "\0\0". The strings longer than
+//   `kStorageIndexMaxStringBytes` are cut to that many bytes, followed by "\0\2" and the eight bytes of the FNV-1a hash
+//   of the whole string, to keep the entries short enough to be file names. Such strings are thus only ordered by their
+//   first bytes, and among the ones with the same first bytes the order is arbitrary.
+// Thus the lookups are the range scans of this field, and the values of the field itself are not read.
+constexpr static size_t kStorageIndexMaxStringBytes = 32u;
+
+template <class V, bool = std::is_enum_v<V>>
+struct C5T_STORAGE_INDEX_INTEGER final {
+  using type = V;
+};
+
+template <class V>
+struct C5T_STORAGE_INDEX_INTEGER<V, true> final {
+  using type = std::underlying_type_t<V>;
+};
+
+template <class V>
+std::string C5T_STORAGE_INDEX_VALUE(V const& v) {
+  std::string bytes;
+  auto const append_uint64 = [&bytes](uint64_t u) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      bytes += static_cast<char>((u >> shift) & 0xff);
+    }
+  };
+  if constexpr (std::is_integral_v<V> || std::is_enum_v<V>) {
+    using I = typename C5T_STORAGE_INDEX_INTEGER<V>::type;
+    I const i = static_cast<I>(v);
+    bool negative = false;
+    if constexpr (std::is_signed_v<I>) {
+      negative = (i < 0);
+    }
+    bytes += negative ? '\0' : '\1';
+    append_uint64(static_cast<uint64_t>(i));
+  } else {
+    static_assert(std::is_convertible_v<V, std::string>, "The indexed values should be integers or strings.");
+    std::string const s(v);
+    for (size_t i = 0u; i < s.length() && i < kStorageIndexMaxStringBytes; ++i) {
+      bytes += s[i];
+      if (s[i] == '\0') {
+        bytes += '\1';
+      }
+    }
+    if (s.length() <= kStorageIndexMaxStringBytes) {
+      bytes += std::string(2u, '\0');
+    } else {
+      bytes += '\0';
+      bytes += '\2';
+      uint64_t hash = 14695981039346656037ull;
+      for (char const c : s) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+      }
+      append_uint64(hash);
+    }
+  }
+  std::string result;
+  for (char const c : bytes) {
+    result += "0123456789abcdef"[static_cast<unsigned char>(c) >> 4];
+    result += "0123456789abcdef"[static_cast<unsigned char>(c) & 0xf];
+  }
+  return result;
+}
+
+inline std::string C5T_STORAGE_INDEX_FIELD(std::string const& field, std::string const& index) {
+  return field + '@' + index;
+}
+
+// Written once the index has all the entries for what was stored before the index was defined. Sorts after them.
+// Versioned, so that the indexes built with an older encoding of the values are built anew.
+constexpr static char const* kStorageIndexBuiltMarker = "~built2";
+
+// The expiration times of the keys of the field `field` that are set with a TTL are kept in the `field~ttl` field:
+// "k" + key -> when the key expires, in microseconds since the epoch, in decimal, to be loaded along with the value,
+// and "t" + `C5T_STORAGE_INDEX_VALUE()` of when it expires + '.' + key, empty, for the sweeper to scan in time order.
+inline std::string C5T_STORAGE_TTL_FIELD(std::string const& field) { return field + "~ttl"; }
+
+inline std::string C5T_STORAGE_TTL_KEY(std::string const& key) { return 'k' + key; }
+
+inline std::string C5T_STORAGE_TTL_DEADLINE(uint64_t expires_at, std::string const& key) {
+  return 't' + C5T_STORAGE_INDEX_VALUE(expires_at) + '.' + key;
+}
+
+// A committed change of a key of a field, see `lib_c5t_storage_cdc.h`. Null means the key did not or does not exist.
+template <class T>
+struct C5T_STORAGE_CHANGE final {
+  std::string key;
+  std::shared_ptr<T const> before;
+  std::shared_ptr<T const> after;
 };
 
+template <class T>
+using C5T_STORAGE_CHANGES_LISTENER = std::function<void(std::vector<C5T_STORAGE_CHANGE<T>> const&)>;
+
+template <class T>
+using C5T_STORAGE_CHANGES_LISTENERS = std::shared_ptr<std::map<uint64_t, C5T_STORAGE_CHANGES_LISTENER<T>> const>;
+
+template <class T>
+struct C5T_STORAGE_FIELD_INDEX final {
+  std::string name;
+  // Returns `C5T_STORAGE_INDEX_VALUE()` of the indexed value.
+  std::function<std::string(T const&)> value;
+};
+
+// Defined below, see `C5T_STORAGE_TXN()`. Commits into `impl`, or into `C5T_STORAGE_INSTANCE()` if it is null.
+template <class F>
+void C5T_STORAGE_TXN_Run(C5T_STORAGE_Interface* impl, F&& f);
+
+// How to warm up the in-memory cache of a field, see `C5T_STORAGE_FIELD_ACCESSOR::Preload()`.
+struct C5T_STORAGE_PRELOAD_OPTIONS final {
+  size_t threads = 8u;
+  // The progress is reported every `progress_period`, and once done, if the logger is set.
+  std::chrono::milliseconds progress_period = std::chrono::seconds(1);
+  std::function<void(std::string const&)> logger = nullptr;
+
+  C5T_STORAGE_PRELOAD_OPTIONS& Threads(size_t n) {
+    threads = n;
+    return *this;
+  }
+  C5T_STORAGE_PRELOAD_OPTIONS& ProgressPeriod(std::chrono::milliseconds dt) {
+    progress_period = dt;
+    return *this;
+  }
+  C5T_STORAGE_PRELOAD_OPTIONS& Logger(std::function<void(std::string const&)> f) {
+    logger = std::move(f);
+    return *this;
+  }
+};
+
+// Calls `load(key)`, which returns whether the key exists, for each of the `keys`, from `options.threads` threads.
+// Returns the number of the keys that exist. Not header-only, requires the `.cc` library to be linked against!
+size_t C5T_STORAGE_PRELOAD_Impl(std::string const& field,
+                                std::vector<std::string> const& keys,
+                                std::function<bool(std::string const&)> load,
+                                C5T_STORAGE_PRELOAD_OPTIONS const& options);
+
+template <typename T>
+class C5T_STORAGE_FIELD;
+
+// Defined in `lib_c5t_storage_codec.h`, which is to be included to use the views.
+template <class T>
+class C5T_STORAGE_VIEW;
+
+// Defined below, right after `C5T_STORAGE_FIELD_ACCESSOR`.
+template <class T>
+class C5T_STORAGE_TXN_FIELD;
+
 // TODO: maybe make the template type inner, so that `C5T_STORAGE_FIELD` can be passed around?
 template <class T>
 class C5T_STORAGE_FIELD_ACCESSOR final {
  private:
+  friend class C5T_STORAGE_TXN_FIELD<T>;
+
   C5T_STORAGE_FIELD_Interface& self;
+  C5T_STORAGE_FIELD<T>& field;
   typename C5T_STORAGE_FIELD_TYPES<T>::map_t& contents;
+  std::vector<C5T_STORAGE_FIELD_INDEX<T>> const& indexes;
   C5T_STORAGE_Interface& impl;
 
-  std::unique_ptr<T>& InnerGet(std::string key) const {
-    auto& p = contents[key];
-    if (!p.first) {
-      p.first = true;
-      Optional<std::string> s = impl.DoLoad(self.Name(), std::move(key));
-      if (Exists(s)) {
+  using value_t = typename C5T_STORAGE_FIELD_TYPES<T>::value_t;
+  using entry_t = typename C5T_STORAGE_FIELD_CONTENTS<T>::Entry;
+
+  using shard_t = typename C5T_STORAGE_FIELD_CONTENTS<T>::Shard;
+
+  using raw_t = typename C5T_STORAGE_FIELD_CONTENTS<T>::raw_t;
+
+  // Must be called with the exclusive lock of `shard` held. Decodes what is loaded for the views, if anything.
+  void LoadIfNeeded(shard_t& shard, std::string const& key, entry_t& e) const {
+    if (!e.loaded) {
+      value_t value;
+      bool const from_raw = static_cast<bool>(e.raw);
+      raw_t const s = from_raw ? e.raw : LoadRaw(key);
+      if (s) {
         try {
           // TODO: evolve
-          if (p.second) {
-            if (!self.DoDeserializeImpl(Value(s), p.second.get())) {
-              p.second = nullptr;
-            }
-          } else {
-            T instance;
-            if (self.DoDeserializeImpl(Value(s), &instance)) {
-              p.second = std::make_unique<T>(std::move(instance));
-            }
+          auto instance = std::make_shared<T>();
+          if (self.DoDeserializeImpl(*s, instance.get())) {
+            value = std::move(instance);
           }
         } catch (current::Exception const&) {
           // TODO: log the error, test it
         }
+      }
+      if (!from_raw || !value) {
+        e.expires_at = (value && field.HasTTLs()) ? LoadExpiration(key) : 0u;
+      }
+      contents.Assign(shard, key, e, std::move(value), s ? s->length() : 0u, !from_raw);
+    }
+  }
+
+  // The serialized value of `key`, null if it does not exist.
+  raw_t LoadRaw(std::string const& key) const {
+    Optional<std::string> s = impl.DoLoad(self.Name(), key);
+    return Exists(s) ? std::make_shared<std::string const>(std::move(Value(s))) : nullptr;
+  }
+
+  uint64_t LoadExpiration(std::string const& key) const {
+    Optional<std::string> const s = impl.DoLoad(C5T_STORAGE_TTL_FIELD(self.Name()), C5T_STORAGE_TTL_KEY(key));
+    return Exists(s) ? std::strtoull(Value(s).c_str(), nullptr, 10) : 0u;
+  }
+
+  // What the transaction of this thread has written to this field, null if nothing, or if not within a transaction.
+  C5T_STORAGE_TXN_FIELD<T>* TxnField(bool create) const {
+    C5T_STORAGE_TXN_Impl* txn = C5T_STORAGE_TXN_OF_THIS_THREAD();
+    if (!txn) {
+      return nullptr;
+    }
+    if (!create) {
+      auto const it = txn->fields.find(&self);
+      return it != std::end(txn->fields) ? static_cast<C5T_STORAGE_TXN_FIELD<T>*>(it->second.get()) : nullptr;
+    }
+    auto& p = txn->fields[&self];
+    if (!p) {
+      p = std::make_unique<C5T_STORAGE_TXN_FIELD<T>>(*this);
+    }
+    return static_cast<C5T_STORAGE_TXN_FIELD<T>*>(p.get());
+  }
+
+  // Sets `value` to what the transaction of this thread has written to `key`, if it has, outside the snapshots.
+  bool GetIfWrittenInTxn(std::string_view key, value_t& value) const {
+    if (C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD() == kStorageNoSnapshot) {
+      if (C5T_STORAGE_TXN_FIELD<T> const* txn = TxnField(false)) {
+        auto const it = txn->written.find(std::string(key));
+        if (it != std::end(txn->written)) {
+          value = C5T_STORAGE_FIELD_CONTENTS<T>::Expired(it->second.expires_at) ? nullptr : it->second.value;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Does not allocate if the key is loaded, so it does not take the key as `std::string`.
+  value_t InnerGet(std::string_view key_view) const {
+    uint64_t const snapshot = C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD();
+    value_t value;
+    if (GetIfWrittenInTxn(key_view, value)) {
+      return value;
+    }
+    if (snapshot == kStorageNoSnapshot ? contents.GetIfLoaded(key_view, value)
+                                       : contents.GetIfLoadedAsOf(key_view, snapshot, value)) {
+      return value;
+    }
+    std::string const key(key_view);
+    auto& shard = contents.ShardOf(key);
+    std::unique_lock lock(shard.mutex);
+    entry_t& e = contents.Emplace(shard, key);
+    LoadIfNeeded(shard, key, e);
+    value = snapshot == kStorageNoSnapshot ? C5T_STORAGE_FIELD_CONTENTS<T>::Current(e)
+                                           : C5T_STORAGE_FIELD_CONTENTS<T>::ValueAsOf(e, snapshot);
+    contents.EvictIfNeeded(shard);
+    return value;
+  }
+
+  // Adds to `writes` what changes in the indexes as the value of `key` changes from `before` to `after`.
+  void IndexWrites(std::string const& key,
+                   T const* before,
+                   T const* after,
+                   std::vector<C5T_STORAGE_WRITE>& writes) const {
+    for (auto const& index : indexes) {
+      std::string const old_entry = before ? index.value(*before) + '.' + key : "";
+      std::string const new_entry = after ? index.value(*after) + '.' + key : "";
+      if (old_entry != new_entry) {
+        std::string const index_field = C5T_STORAGE_INDEX_FIELD(self.Name(), index.name);
+        if (before) {
+          writes.push_back(C5T_STORAGE_WRITE{index_field, old_entry, nullptr});
+        }
+        if (after) {
+          writes.push_back(C5T_STORAGE_WRITE{index_field, new_entry, std::string()});
+        }
+      }
+    }
+  }
+
+  // Adds to `writes` what changes as the expiration of `key` changes from `before` to `after`, zero meaning never.
+  void TTLWrites(std::string const& key,
+                 uint64_t before,
+                 uint64_t after,
+                 std::vector<C5T_STORAGE_WRITE>& writes) const {
+    if (before != after) {
+      std::string const ttl_field = C5T_STORAGE_TTL_FIELD(self.Name());
+      if (before) {
+        writes.push_back(C5T_STORAGE_WRITE{ttl_field, C5T_STORAGE_TTL_DEADLINE(before, key), nullptr});
+      }
+      if (after) {
+        writes.push_back(C5T_STORAGE_WRITE{ttl_field, C5T_STORAGE_TTL_DEADLINE(after, key), std::string()});
+        writes.push_back(C5T_STORAGE_WRITE{ttl_field, C5T_STORAGE_TTL_KEY(key), std::to_string(after)});
       } else {
-        p.second = nullptr;
+        writes.push_back(C5T_STORAGE_WRITE{ttl_field, C5T_STORAGE_TTL_KEY(key), nullptr});
       }
     }
-    return p.second;
   }
 
-  void InnerSet(std::string key, T const& value) const {
-    impl.DoSave(self.Name(), key, self.DoSerializeImpl(&value));
-    typename C5T_STORAGE_FIELD_TYPES<T>::rhs_t& p = contents[key];
-    p.first = true;
-    if (p.second) {
-      *p.second = value;
+  // Writes out the change of `key`, along with what it changes in the indexes. Must be called with the exclusive lock
+  // held. If there are `listeners`, they are told about the change; `before` must then be the value loaded before it.
+  void Persist(std::string const& key,
+               std::vector<C5T_STORAGE_WRITE> const& writes,
+               C5T_STORAGE_CHANGES_LISTENERS<T> const& listeners,
+               value_t before,
+               value_t after) const {
+    if (writes.size() == 1u) {
+      if (Exists(writes.front().value)) {
+        impl.DoSave(self.Name(), key, Value(writes.front().value));
+      } else {
+        impl.DoDelete(self.Name(), key);
+      }
     } else {
-      p.second = std::make_unique<T>(value);
+      impl.DoCommit(writes);
+    }
+    if (listeners) {
+      // Under the lock of the shard, so that the changes of each key are published in the order they are made.
+      std::vector<C5T_STORAGE_CHANGE<T>> const changes{C5T_STORAGE_CHANGE<T>{key, std::move(before), std::move(after)}};
+      for (auto const& [_, f] : *listeners) {
+        f(changes);
+      }
+    }
+  }
+
+  // Within a transaction: adds the write of `key`, from `before` to `after`, to it, along with what it changes in the
+  // indexes and in the TTLs, as `writes`. The in-memory contents are only updated once the transaction is committed.
+  void WriteInTxn(C5T_STORAGE_TXN_FIELD<T>& txn,
+                  std::string const& key,
+                  std::vector<C5T_STORAGE_WRITE>& writes,
+                  std::pair<value_t, uint64_t> const& before,
+                  value_t after,
+                  size_t bytes,
+                  uint64_t expires_at) const {
+    IndexWrites(key, before.first.get(), after.get(), writes);
+    if (field.HasTTLs()) {
+      TTLWrites(key, before.second, expires_at, writes);
+    }
+    std::vector<C5T_STORAGE_WRITE>& txn_writes = C5T_STORAGE_TXN_OF_THIS_THREAD()->writes;
+    std::move(std::begin(writes), std::end(writes), std::back_inserter(txn_writes));
+    if (field.ChangesListeners()) {
+      value_t value = C5T_STORAGE_FIELD_CONTENTS<T>::Expired(before.second) ? nullptr : before.first;
+      txn.changes.push_back(C5T_STORAGE_CHANGE<T>{key, std::move(value), after});
     }
+    auto& w = txn.written[key];
+    w.value = std::move(after);
+    w.bytes = bytes;
+    w.expires_at = expires_at;
   }
 
-  void InnerDel(std::string const& key) const {
-    if (InnerGet(key)) {
-      contents[key].second = nullptr;
-      impl.DoDelete(self.Name(), key);
+  // Within a transaction: the value of `key`, even if expired, and its expiration, as the transaction sees them.
+  std::pair<value_t, uint64_t> ValueInTxn(C5T_STORAGE_TXN_FIELD<T> const& txn, std::string const& key) const {
+    auto const it = txn.written.find(key);
+    if (it != std::end(txn.written)) {
+      return {it->second.value, it->second.expires_at};
     }
+    auto& shard = contents.ShardOf(key);
+    std::unique_lock lock(shard.mutex);
+    entry_t& e = contents.Emplace(shard, key);
+    LoadIfNeeded(shard, key, e);
+    std::pair<value_t, uint64_t> result(e.value, e.expires_at);
+    contents.EvictIfNeeded(shard);
+    return result;
+  }
+
+  // `expires_at` is in microseconds since the epoch, zero for never.
+  void InnerSet(std::string key, T const& value, uint64_t expires_at = 0u) const {
+    auto v = std::make_shared<T const>(value);
+    std::vector<C5T_STORAGE_WRITE> writes{C5T_STORAGE_WRITE{self.Name(), key, self.DoSerializeImpl(v.get())}};
+    size_t const serialized_length = Value(writes.front().value).length();
+    if (expires_at) {
+      field.SetHasTTLs(true);
+    }
+    if (C5T_STORAGE_TXN_FIELD<T>* txn = TxnField(true)) {
+      WriteInTxn(*txn, key, writes, ValueInTxn(*txn, key), std::move(v), serialized_length, expires_at);
+      return;
+    }
+    auto& shard = contents.ShardOf(key);
+    std::unique_lock lock(shard.mutex);
+    entry_t& e = contents.Emplace(shard, key);
+    auto const [version, oldest_snapshot] = C5T_STORAGE_VERSIONS().BeginWrite();
+    C5T_STORAGE_CHANGES_LISTENERS<T> const listeners = field.ChangesListeners();
+    bool const ttls = field.HasTTLs();
+    if (!indexes.empty() || listeners || oldest_snapshot < version || ttls) {
+      // The previous value is needed to remove its entries from the indexes, to publish the change,
+      // and to keep it for the snapshots. The previous expiration is needed to remove its entries too.
+      LoadIfNeeded(shard, key, e);
+      IndexWrites(key, e.value.get(), v.get(), writes);
+    }
+    if (ttls) {
+      TTLWrites(key, e.expires_at, expires_at, writes);
+    }
+    Persist(key, writes, listeners, C5T_STORAGE_FIELD_CONTENTS<T>::Current(e), v);
+    contents.Supersede(shard, key, e, version, oldest_snapshot);
+    contents.Assign(shard, key, e, std::move(v), serialized_length);
+    e.expires_at = expires_at;
+    contents.EvictIfNeeded(shard);
+  }
+
+  // Returns whether the key was deleted. With `only_if_expired`, the keys that have not expired are left as is.
+  bool InnerDel(std::string const& key, bool only_if_expired = false) const {
+    if (C5T_STORAGE_TXN_FIELD<T>* txn = TxnField(true)) {
+      auto const before = ValueInTxn(*txn, key);
+      bool const deleted =
+          before.first && (!only_if_expired || C5T_STORAGE_FIELD_CONTENTS<T>::Expired(before.second));
+      if (deleted) {
+        std::vector<C5T_STORAGE_WRITE> writes{C5T_STORAGE_WRITE{self.Name(), key, nullptr}};
+        WriteInTxn(*txn, key, writes, before, nullptr, 0u, 0u);
+      }
+      return deleted;
+    }
+    auto& shard = contents.ShardOf(key);
+    std::unique_lock lock(shard.mutex);
+    entry_t& e = contents.Emplace(shard, key);
+    LoadIfNeeded(shard, key, e);
+    bool const deleted = e.value && (!only_if_expired || C5T_STORAGE_FIELD_CONTENTS<T>::Expired(e));
+    if (deleted) {
+      std::vector<C5T_STORAGE_WRITE> writes{C5T_STORAGE_WRITE{self.Name(), key, nullptr}};
+      IndexWrites(key, e.value.get(), nullptr, writes);
+      TTLWrites(key, e.expires_at, 0u, writes);
+      // NOTE: The expired value is published as the one deleted, so that the listeners learn it is gone.
+      value_t before = e.value;
+      auto const [version, oldest_snapshot] = C5T_STORAGE_VERSIONS().BeginWrite();
+      contents.Supersede(shard, key, e, version, oldest_snapshot);
+      contents.Assign(shard, key, e, nullptr, 0u);
+      e.expires_at = 0u;
+      Persist(key, writes, field.ChangesListeners(), std::move(before), nullptr);
+    }
+    contents.EvictIfNeeded(shard);
+    return deleted;
+  }
+
+  // Adds the entries for what was stored before the index was defined, once per index. Blocks the writes to this field
+  // while doing so, so that none of them is missed. The stale entries, if any, are removed in the same commit.
+  void BuildIndexesIfNeeded() const {
+    for (auto const& index : indexes) {
+      std::string const index_field = C5T_STORAGE_INDEX_FIELD(self.Name(), index.name);
+      if (Exists(impl.DoLoad(index_field, kStorageIndexBuiltMarker))) {
+        continue;
+      }
+      auto const locks = contents.LockAll();
+      std::vector<C5T_STORAGE_WRITE> writes;
+      impl.DoListKeys(index_field, [&](std::string const& entry) {
+        writes.push_back(C5T_STORAGE_WRITE{index_field, entry, nullptr});
+      });
+      for (auto it = Range(); it.Next();) {
+        writes.push_back(C5T_STORAGE_WRITE{index_field, index.value(it.Value()) + '.' + it.Key(), std::string()});
+      }
+      writes.push_back(C5T_STORAGE_WRITE{index_field, kStorageIndexBuiltMarker, std::string()});
+      impl.DoCommit(writes);
+    }
+  }
+
+  std::vector<std::string> ScanIndex(std::string const& index, std::string const& begin, std::string const& end) const {
+    if (std::none_of(std::begin(indexes), std::end(indexes), [&index](auto const& i) { return i.name == index; })) {
+      throw StorageIndexNotDefinedException();
+    }
+    std::vector<std::string> keys;
+    impl.DoScan(C5T_STORAGE_INDEX_FIELD(self.Name(), index),
+                begin,
+                end,
+                std::numeric_limits<size_t>::max(),
+                [&keys](std::string const& entry, std::string const&) {
+                  keys.push_back(entry.substr(entry.find('.') + 1u));
+                });
+    return keys;
   }
 
  public:
-  C5T_STORAGE_FIELD_ACCESSOR(C5T_STORAGE_FIELD_Interface& self, C5T_STORAGE_Interface& impl)
-      : self(self),
+  C5T_STORAGE_FIELD_ACCESSOR(C5T_STORAGE_FIELD<T>& field, C5T_STORAGE_Interface& impl)
+      : self(field),
+        field(field),
         contents(*reinterpret_cast<typename C5T_STORAGE_FIELD_TYPES<T>::map_t*>(self.GetMapAsVoidPtr(self))),
+        indexes(field.Indexes()),
         impl(impl) {
     if (impl.NeedToStartFresh(self)) {
-      contents.clear();
+      contents.Clear(impl.CacheLimits());
+      BuildIndexesIfNeeded();
+      bool ttls = false;
+      impl.DoScan(C5T_STORAGE_TTL_FIELD(self.Name()), "", "", 1u, [&ttls](std::string const&, std::string const&) {
+        ttls = true;
+      });
+      field.SetHasTTLs(ttls);
     }
   }
 
-  bool Has(std::string key) const { return InnerGet(std::move(key)) != nullptr; }
+  bool Has(std::string_view key) const { return InnerGet(key) != nullptr; }
 
-  T GetOrDefault(std::string key, T def = T()) const {
-    auto const& p = InnerGet(std::move(key));
+  // The value itself, as stored in memory, null if the key does not exist. Neither copies the value nor allocates if
+  // the key is loaded. The value is immutable and stays valid while the returned pointer is held: a `Set()` of this
+  // key by another thread replaces the value in the storage, not the one pointed to. Use it for the large values.
+  std::shared_ptr<T const> GetShared(std::string_view key) const { return InnerGet(key); }
+
+  // The value as it is stored, to only decode the members that are read, see `C5T_STORAGE_VIEW`. Unless the value is
+  // in memory already, its serialized bytes are loaded and kept in memory instead, and are decoded as a whole only
+  // once the key is read otherwise. Within a snapshot, the value is read and decoded as of the snapshot.
+  C5T_STORAGE_VIEW<T> View(std::string_view key_view) const {
+    value_t value;
+    if (GetIfWrittenInTxn(key_view, value)) {
+      return C5T_STORAGE_VIEW<T>(self, std::move(value), nullptr);
+    }
+    if (C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD() != kStorageNoSnapshot) {
+      return C5T_STORAGE_VIEW<T>(self, InnerGet(key_view), nullptr);
+    }
+    raw_t raw;
+    if (contents.GetIfLoadedOrRaw(key_view, value, raw)) {
+      return C5T_STORAGE_VIEW<T>(self, std::move(value), std::move(raw));
+    }
+    std::string const key(key_view);
+    auto& shard = contents.ShardOf(key);
+    std::unique_lock lock(shard.mutex);
+    entry_t& e = contents.Emplace(shard, key);
+    if (!e.loaded && !e.raw) {
+      if (raw_t s = LoadRaw(key)) {
+        e.expires_at = field.HasTTLs() ? LoadExpiration(key) : 0u;
+        contents.AssignRaw(shard, key, e, std::move(s));
+      } else {
+        e.expires_at = 0u;
+        contents.Assign(shard, key, e, nullptr, 0u, true);
+      }
+    }
+    if (e.loaded) {
+      value = C5T_STORAGE_FIELD_CONTENTS<T>::Current(e);
+    } else if (!C5T_STORAGE_FIELD_CONTENTS<T>::Expired(e)) {
+      raw = e.raw;
+    }
+    contents.EvictIfNeeded(shard);
+    return C5T_STORAGE_VIEW<T>(self, std::move(value), std::move(raw));
+  }
+
+  T GetOrDefault(std::string_view key, T def = T()) const {
+    auto const p = InnerGet(key);
     if (p != nullptr) {
       return *p;
     } else {
@@ -165,9 +1297,11 @@ class C5T_STORAGE_FIELD_ACCESSOR final {
     }
   }
 
+  // NOTE: Returns a copy, not a reference, since another thread may `Set` this key at any time.
+  // See `GetShared()` for the reads that do not copy.
   template <class E = StorageKeyNotFoundException, typename... ARGS>
-  T const& GetOrThrow(std::string key, ARGS&&... args) const {
-    auto const& p = InnerGet(std::move(key));
+  T GetOrThrow(std::string_view key, ARGS&&... args) const {
+    auto const p = InnerGet(key);
     if (p != nullptr) {
       return *p;
     } else {
@@ -175,8 +1309,8 @@ class C5T_STORAGE_FIELD_ACCESSOR final {
     }
   }
 
-  Optional<T> Get(std::string key) const {
-    auto const& p = InnerGet(std::move(key));
+  Optional<T> Get(std::string_view key) const {
+    auto const p = InnerGet(key);
     if (p != nullptr) {
       return *p;
     } else {
@@ -189,7 +1323,176 @@ class C5T_STORAGE_FIELD_ACCESSOR final {
     InnerSet(std::move(key), std::forward<TT>(value));
   }
 
+  // Same as `Set()`, and the key expires in `ttl`: from then on it reads as if it does not exist, and the sweeper,
+  // if enabled, deletes it, see `C5T_STORAGE_OPTIONS::ttl_sweep_period`. Until it is deleted, the scans and the index
+  // lookups, which read what is on disk, still see it. A `Set()` without a TTL makes the key not expire.
+  template <class TT = T>
+  void Set(std::string key, TT&& value, std::chrono::microseconds ttl) {
+    uint64_t const dt = static_cast<uint64_t>(std::max(ttl.count(), static_cast<decltype(ttl.count())>(1)));
+    InnerSet(std::move(key), std::forward<TT>(value), C5T_STORAGE_TTL_NOW() + dt);
+  }
+
   void Del(std::string const& key) { InnerDel(key); }
+
+  // The values of `keys`, in the same order, null for the keys that do not exist.
+  std::vector<Optional<T>> MultiGet(std::vector<std::string> const& keys) const {
+    std::vector<Optional<T>> result;
+    result.reserve(keys.size());
+    for (std::string const& key : keys) {
+      auto const p = InnerGet(key);
+      if (p != nullptr) {
+        result.push_back(*p);
+      } else {
+        result.push_back(nullptr);
+      }
+    }
+    return result;
+  }
+
+  // Sets all the key-value pairs of `kvs` as a single transaction, written out with a single commit.
+  template <class KVS>
+  void MultiSet(KVS const& kvs) {
+    C5T_STORAGE_TXN_Run(&impl, [&]() {
+      for (auto const& [key, value] : kvs) {
+        InnerSet(key, value);
+      }
+    });
+  }
+
+  // Deletes all of `keys` as a single transaction.
+  void MultiDel(std::vector<std::string> const& keys) {
+    C5T_STORAGE_TXN_Run(&impl, [&]() {
+      for (std::string const& key : keys) {
+        InnerDel(key);
+      }
+    });
+  }
+
+  // Deletes up to `max_keys` of the keys that have expired, the ones that expired first first. Returns how many.
+  // The entries of the keys that are not deleted are stale, as the key no longer exists, can not be read, or no longer
+  // expires then, and are deleted too, so that they do not hold up the next sweeps.
+  size_t SweepExpired(size_t max_keys) const {
+    std::string const ttl_field = C5T_STORAGE_TTL_FIELD(self.Name());
+    std::vector<std::string> entries;
+    impl.DoScan(ttl_field,
+                "t",
+                C5T_STORAGE_TTL_DEADLINE(C5T_STORAGE_TTL_NOW() + 1u, ""),
+                max_keys,
+                [&entries](std::string const& entry, std::string const&) { entries.push_back(entry); });
+    size_t deleted = 0u;
+    std::vector<C5T_STORAGE_WRITE> stale;
+    for (std::string const& entry : entries) {
+      if (InnerDel(entry.substr(entry.find('.') + 1u), true)) {
+        ++deleted;
+      } else {
+        stale.push_back(C5T_STORAGE_WRITE{ttl_field, entry, nullptr});
+      }
+    }
+    if (!stale.empty()) {
+      impl.DoCommit(stale);
+    }
+    return deleted;
+  }
+
+  // Loads the `keys` into memory ahead of time, in parallel, so that the first reads of them do not hit the disk.
+  // Returns the number of the keys that exist. As usual, only as much as the cache limits allow is kept in memory.
+  size_t Preload(std::vector<std::string> const& keys,
+                 C5T_STORAGE_PRELOAD_OPTIONS const& options = C5T_STORAGE_PRELOAD_OPTIONS()) const {
+    return C5T_STORAGE_PRELOAD_Impl(
+        self.Name(), keys, [this](std::string const& key) { return InnerGet(key) != nullptr; }, options);
+  }
+
+  // Loads all the keys of this field into memory ahead of time.
+  size_t Preload(C5T_STORAGE_PRELOAD_OPTIONS const& options = C5T_STORAGE_PRELOAD_OPTIONS()) const {
+    std::vector<std::string> keys;
+    impl.DoListKeys(self.Name(), [&keys](std::string const& key) { keys.push_back(key); });
+    return Preload(keys, options);
+  }
+
+  // The keys within `[begin, end)`, in order. An empty `end` means no upper bound.
+  C5T_STORAGE_CURSOR<T> Range(std::string begin = "", std::string end = "", size_t page_size = 1000u) const {
+    return C5T_STORAGE_CURSOR<T>(self, impl, std::move(begin), std::move(end), page_size);
+  }
+
+  // The keys that start with `prefix`, in order.
+  C5T_STORAGE_CURSOR<T> Prefix(std::string const& prefix, size_t page_size = 1000u) const {
+    return C5T_STORAGE_CURSOR<T>(self, impl, prefix, C5T_STORAGE_PREFIX_END(prefix), page_size);
+  }
+
+  // The keys of the values for which the index `index` is `value`, in order. Only the index is read, not the values.
+  // Sees what is committed, not the in-flight transactions. Throws `StorageIndexNotDefinedException` if no such index.
+  template <class V>
+  std::vector<std::string> FindByIndex(std::string const& index, V const& value) const {
+    std::string const prefix = C5T_STORAGE_INDEX_VALUE(value) + '.';
+    return ScanIndex(index, prefix, C5T_STORAGE_PREFIX_END(prefix));
+  }
+
+  // The keys of the values for which the index `index` is within `[begin, end)`, in the order of the indexed values.
+  template <class V>
+  std::vector<std::string> FindByIndexRange(std::string const& index, V const& begin, V const& end) const {
+    return ScanIndex(index, C5T_STORAGE_INDEX_VALUE(begin), C5T_STORAGE_INDEX_VALUE(end));
+  }
+};
+
+// What the transaction of this thread has written to the field, seen by this thread only, and applied to the in-memory
+// contents of the field once the transaction is committed, under the locks of the shards of the keys written, so that
+// the other threads never see what is not committed, and what is in memory is in the same order as what is on disk.
+template <class T>
+class C5T_STORAGE_TXN_FIELD final : public C5T_STORAGE_TXN_FIELD_Interface {
+ public:
+  struct Write final {
+    std::shared_ptr<T const> value;  // Null if deleted.
+    size_t bytes = 0u;
+    uint64_t expires_at = 0u;
+  };
+
+  C5T_STORAGE_FIELD_ACCESSOR<T> const accessor;
+  std::unordered_map<std::string, Write> written;
+  // The changes to publish once committed, if there are listeners.
+  std::vector<C5T_STORAGE_CHANGE<T>> changes;
+  // Set by `Prepare()`: the version of the transaction, and the oldest snapshot as of then, see `Supersede()`.
+  uint64_t version = 0u;
+  uint64_t oldest_snapshot = kStorageNoSnapshot;
+
+  explicit C5T_STORAGE_TXN_FIELD(C5T_STORAGE_FIELD_ACCESSOR<T> const& accessor) : accessor(accessor) {}
+
+  void AddMutexes(std::vector<std::shared_mutex*>& mutexes) const override {
+    for (auto const& [key, _] : written) {
+      mutexes.push_back(&accessor.contents.ShardOf(key).mutex);
+    }
+  }
+
+  void Prepare(uint64_t txn_version, uint64_t txn_oldest_snapshot) override {
+    version = txn_version;
+    oldest_snapshot = txn_oldest_snapshot;
+    if (oldest_snapshot < version) {
+      // The values being replaced are kept for the snapshots, so they are loaded while they are still what is on disk.
+      for (auto const& [key, _] : written) {
+        auto& shard = accessor.contents.ShardOf(key);
+        accessor.LoadIfNeeded(shard, key, accessor.contents.Emplace(shard, key));
+      }
+    }
+  }
+
+  void Apply() override {
+    for (auto& [key, w] : written) {
+      auto& shard = accessor.contents.ShardOf(key);
+      auto& e = accessor.contents.Emplace(shard, key);
+      accessor.contents.Supersede(shard, key, e, version, oldest_snapshot);
+      accessor.contents.Assign(shard, key, e, std::move(w.value), w.bytes);
+      e.expires_at = w.expires_at;
+    }
+    // NOTE: Only once all the keys are applied, as what `Prepare()` has loaded for the snapshots must not be evicted.
+    for (auto const& [key, _] : written) {
+      accessor.contents.EvictIfNeeded(accessor.contents.ShardOf(key));
+    }
+  }
+
+  void Publish() override {
+    if (!changes.empty()) {
+      accessor.field.PublishChanges(changes);
+    }
+  }
 };
 
 inline C5T_STORAGE_Interface& C5T_STORAGE_INSTANCE();
@@ -204,14 +1507,82 @@ class C5T_STORAGE_FIELD : public C5T_STORAGE_FIELD_Interface {
   C5T_STORAGE_FIELD() = delete;
   std::string name_;
   mutable typename C5T_STORAGE_FIELD_TYPES<T>::map_t contents_;
+  // Defined at startup, along with the field, and not changed afterwards.
+  std::vector<C5T_STORAGE_FIELD_INDEX<T>> indexes_;
+  // Replaced as a whole as the listeners come and go, so that the writes only take the mutex for a moment.
+  std::mutex listeners_mutex_;
+  C5T_STORAGE_CHANGES_LISTENERS<T> listeners_;
+  uint64_t next_listener_id_ = 0u;
+  std::atomic_bool has_ttls_ = false;
 
  protected:
   C5T_STORAGE_FIELD(char const* name) : name_(name) { C5T_STORAGE_META_SINGLETON().DeclareField(this); }
 
   std::string const& Name() const override { return name_; }
   void* GetMapAsVoidPtr(C5T_STORAGE_FIELD_Interface const&) override { return &contents_; }
+  C5T_STORAGE_CACHE_STATS CacheStats() override { return contents_.Stats(); }
+  void ReclaimVersions(uint64_t oldest_snapshot) override { contents_.Reclaim(oldest_snapshot); }
 
  public:
+  void AddIndex(C5T_STORAGE_FIELD_INDEX<T> index) {
+    for (auto const& i : indexes_) {
+      if (i.name == index.name) {
+        std::cerr << "FATAL: Index '" << index.name << "' of '" << name_ << "' defined more than once." << std::endl;
+        ::abort();
+      }
+    }
+    indexes_.push_back(std::move(index));
+  }
+  std::vector<C5T_STORAGE_FIELD_INDEX<T>> const& Indexes() const { return indexes_; }
+
+  bool HasTTLs() const override { return has_ttls_.load(); }
+  void SetHasTTLs(bool b) override { has_ttls_.store(b); }
+  size_t SweepExpired(C5T_STORAGE_Interface& impl, size_t max_keys) override {
+    return C5T_STORAGE_FIELD_ACCESSOR<T>(*this, impl).SweepExpired(max_keys);
+  }
+
+  std::vector<std::string> StoredFieldNames() const override {
+    std::vector<std::string> result = {name_, C5T_STORAGE_TTL_FIELD(name_)};
+    for (auto const& index : indexes_) {
+      result.push_back(C5T_STORAGE_INDEX_FIELD(name_, index.name));
+    }
+    return result;
+  }
+
+  // Null if there are no listeners.
+  C5T_STORAGE_CHANGES_LISTENERS<T> ChangesListeners() {
+    std::lock_guard lock(listeners_mutex_);
+    return listeners_;
+  }
+
+  void PublishChanges(std::vector<C5T_STORAGE_CHANGE<T>> const& changes) {
+    if (auto const listeners = ChangesListeners()) {
+      for (auto const& [_, f] : *listeners) {
+        f(changes);
+      }
+    }
+  }
+
+  // The listeners are called synchronously, from the thread that commits, so they should be quick.
+  uint64_t AddChangesListener(C5T_STORAGE_CHANGES_LISTENER<T> f) {
+    std::lock_guard lock(listeners_mutex_);
+    auto listeners = listeners_ ? std::make_shared<std::map<uint64_t, C5T_STORAGE_CHANGES_LISTENER<T>>>(*listeners_)
+                                : std::make_shared<std::map<uint64_t, C5T_STORAGE_CHANGES_LISTENER<T>>>();
+    uint64_t const id = next_listener_id_++;
+    (*listeners)[id] = std::move(f);
+    listeners_ = std::move(listeners);
+    return id;
+  }
+
+  void RemoveChangesListener(uint64_t id) {
+    std::lock_guard lock(listeners_mutex_);
+    if (listeners_) {
+      auto listeners = std::make_shared<std::map<uint64_t, C5T_STORAGE_CHANGES_LISTENER<T>>>(*listeners_);
+      listeners->erase(id);
+      listeners_ = listeners->empty() ? nullptr : std::move(listeners);
+    }
+  }
+
   // TODO: test `const`-ness.
   C5T_STORAGE_FIELD_ACCESSOR<T> operator()() { return C5T_STORAGE_FIELD_ACCESSOR<T>(*this, C5T_STORAGE_INSTANCE()); }
   C5T_STORAGE_FIELD_ACCESSOR<T> operator()() const {
@@ -225,26 +1596,58 @@ class C5T_STORAGE_FIELD : public C5T_STORAGE_FIELD_Interface {
 
 // NOTE: This should be "called" from some "singleton function", not defined at global scope.
 // TODO: There may be a cleaner way, but not now.
-#define C5T_STORAGE_DEFINE_FIELD(name, T, meta)                                \
-  ([]() {                                                                      \
-    class C5T_STORAGE_FIELD_##name final : public C5T_STORAGE_FIELD<T> {       \
-     protected:                                                                \
-      std::string DoSerializeImpl(void const* p) const {                       \
-        return JSON<JSONFormat::Minimalistic>(*reinterpret_cast<T const*>(p)); \
-      }                                                                        \
-      bool DoDeserializeImpl(std::string const& s, void* p) const {            \
-        try {                                                                  \
-          ParseJSON<T, JSONFormat::Minimalistic>(s, *reinterpret_cast<T*>(p)); \
-          return true;                                                         \
-        } catch (current::Exception const&) {                                  \
-          return false;                                                        \
-        }                                                                      \
-      }                                                                        \
-                                                                               \
-     public:                                                                   \
-      C5T_STORAGE_FIELD_##name() : C5T_STORAGE_FIELD(#name) {}                 \
-    };                                                                         \
-    static C5T_STORAGE_FIELD_##name C5T_STORAGE_FIELD_INSTANCE_##name;         \
+// NOTE: `codec` is one of `C5T_STORAGE_CODEC`, and `lib_c5t_storage_codec.h` should be included to define fields.
+#define C5T_STORAGE_DEFINE_FIELD_WITH_CODEC(name, T, meta, codec)                            \
+  ([]() {                                                                                    \
+    class C5T_STORAGE_FIELD_##name final : public C5T_STORAGE_FIELD<T> {                     \
+     protected:                                                                              \
+      std::string DoSerializeImpl(void const* p) const {                                     \
+        return C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::codec>(*reinterpret_cast<T const*>(p)); \
+      }                                                                                      \
+      bool DoDeserializeImpl(std::string const& s, void* p) const {                          \
+        return C5T_STORAGE_DECODE(s, *reinterpret_cast<T*>(p));                              \
+      }                                                                                      \
+                                                                                             \
+     public:                                                                                 \
+      C5T_STORAGE_FIELD_##name() : C5T_STORAGE_FIELD(#name) {}                               \
+    };                                                                                       \
+    static C5T_STORAGE_FIELD_##name C5T_STORAGE_FIELD_INSTANCE_##name;                       \
+  })()
+
+#define C5T_STORAGE_DEFINE_FIELD(name, T, meta) C5T_STORAGE_DEFINE_FIELD_WITH_CODEC(name, T, meta, JSON)
+
+// The field as defined, regardless of the storage instance. Null if not defined, or if not of type `T`.
+template <class T>
+C5T_STORAGE_FIELD<T>* C5T_STORAGE_FIND_FIELD(std::string const& name) {
+  C5T_STORAGE_FIELD<T>* typed = nullptr;
+  C5T_STORAGE_META_SINGLETON().VisitAllFields([&](C5T_STORAGE_FIELD_Interface* p) {
+    if (p->Name() == name) {
+      typed = dynamic_cast<C5T_STORAGE_FIELD<T>*>(p);
+    }
+  });
+  return typed;
+}
+
+template <class T, class F>
+bool C5T_STORAGE_DEFINE_INDEX_Impl(char const* field, char const* index, F f) {
+  C5T_STORAGE_FIELD<T>* typed = C5T_STORAGE_FIND_FIELD<T>(field);
+  if (!typed) {
+    std::cerr << "FATAL: Index '" << index << "' defined before the field '" << field << "'." << std::endl;
+    ::abort();
+  }
+  typed->AddIndex(C5T_STORAGE_FIELD_INDEX<T>{index, [f](T const& value) { return C5T_STORAGE_INDEX_VALUE(f(value)); }});
+  return true;
+}
+
+// The secondary index `index` of the field `name`, by what the function, `T const&` -> an integer or a string, returns.
+// Kept up to date by `Set()` and `Del()`, persisted, and built from what is stored on the first use if it is new.
+// Usage, right after the field is defined: `C5T_STORAGE_DEFINE_INDEX(kv, foo, [](T const& x) { return x.foo; });`.
+// The lookups are `C5T_STORAGE(kv).FindByIndex("foo", 42)` and `C5T_STORAGE(kv).FindByIndexRange("foo", 1, 10)`.
+#define C5T_STORAGE_DEFINE_INDEX(name, index, ...)                                          \
+  ([]() {                                                                                   \
+    static bool const C5T_STORAGE_INDEX_DEFINED_##name##_##index =                          \
+        C5T_STORAGE_DEFINE_INDEX_Impl<C5T_STORAGE_TYPE_##name>(#name, #index, __VA_ARGS__); \
+    static_cast<void>(C5T_STORAGE_INDEX_DEFINED_##name##_##index);                          \
   })()
 
 // TODO: rename
@@ -253,9 +1656,138 @@ struct C5T_Storage_Fields_Singleton final {
   C5T_STORAGE_Interface* pimpl = nullptr;
 };
 
+// How the storage is laid out on disk. Chosen once, when the storage instance is created.
+enum class C5T_STORAGE_BACKEND : int {
+  FilePerKey = 0,  // One file per key, human-readable, see `C5T_STORAGE_FILE_PER_KEY_PATH()`. The default.
+  Log = 1,         // A single append-only log with an in-memory index, see `lib_c5t_storage_log.cc`.
+  BTree = 2,       // A single file with a copy-on-write B+tree of pages, see `lib_c5t_storage_btree.cc`.
+};
+
+// Where the `FilePerKey` backend keeps the value of `key` of `field`, relative to the directory of the storage:
+// `field/ab/cd/key`, where "abcd" is the hex of the lower 16 bits of the FNV-1a hash of the key. The two levels
+// of fan-out keep the directories small, a few dozen files each even for millions of keys, as the lookups in the
+// large directories are slow. The fields stored as `field/key` by the earlier versions are migrated on first use.
+inline std::string C5T_STORAGE_FILE_PER_KEY_DIR(std::string const& field, std::string const& key) {
+  uint32_t h = 2166136261u;
+  for (char const c : key) {
+    h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+  }
+  char const* hex = "0123456789abcdef";
+  std::string result = field;
+  result += '/';
+  result += hex[(h >> 12) & 0xf];
+  result += hex[(h >> 8) & 0xf];
+  result += '/';
+  result += hex[(h >> 4) & 0xf];
+  result += hex[h & 0xf];
+  return result;
+}
+
+inline std::string C5T_STORAGE_FILE_PER_KEY_PATH(std::string const& field, std::string const& key) {
+  return C5T_STORAGE_FILE_PER_KEY_DIR(field, key) + '/' + key;
+}
+
+struct C5T_STORAGE_OPTIONS final {
+  C5T_STORAGE_BACKEND backend = C5T_STORAGE_BACKEND::FilePerKey;
+
+  // For the `Log` and `BTree` backends: whether to `fdatasync()` after every write.
+  // For the `Log` backend: when to compact the log in the background, and how many threads recover the log as it
+  // is opened, zero for as many as there are cores.
+  bool fsync_every_write = false;
+  std::chrono::milliseconds compaction_check_period = std::chrono::seconds(10);
+  uint64_t compaction_min_log_size = 1ull << 20;
+  double compaction_min_garbage_ratio = 0.5;
+  size_t recovery_threads = 0u;
+
+  // What the storage has to report, such as the corrupt records found on startup, if set.
+  std::function<void(std::string const&)> logger = nullptr;
+
+  // Write-behind: `Set`-s and `Del`-s return right away, and the background flusher writes them out in batches,
+  // coalescing the repeated writes to the same key. Flushes every `write_behind_flush_period`, or sooner, once
+  // `write_behind_max_pending` keys are waiting. Trades durability for latency: what is not flushed yet is lost
+  // if the process crashes. It is flushed fully on `C5T_LIFETIME_MANAGER_EXIT()` and when the storage is destroyed.
+  bool write_behind = false;
+  std::chrono::milliseconds write_behind_flush_period = std::chrono::milliseconds(10);
+  size_t write_behind_max_pending = 10000u;
+
+  // How much of what is on disk to keep in memory, see `C5T_STORAGE_FIELD_CONTENTS`.
+  C5T_STORAGE_CACHE_LIMITS cache_limits;
+
+  // For the `FilePerKey` backend: the false positive rate of the Bloom filters that spare the lookups of the keys
+  // that do not exist from touching the disk. Zero disables the filters. The `Log` backend has all the keys in memory.
+  // The filters are loaded, or built by listing the fields, in the background as the storage is opened, and the
+  // lookups go to the disk until the filter of their field is ready.
+  double bloom_false_positive_rate = 0.01;
+
+  // The keys set with a TTL can be deleted once expired by the background sweeper, which wakes up every
+  // `ttl_sweep_period` and deletes up to `ttl_sweep_max_keys` keys of each field, so that each sweep is short.
+  // Each sweep scans the expiration times of each field that has keys with a TTL, so it is off by default, with a
+  // zero period. Without it, the expired keys still read as if they do not exist, but stay on disk until deleted.
+  std::chrono::milliseconds ttl_sweep_period = std::chrono::milliseconds(0);
+  size_t ttl_sweep_max_keys = 1000u;
+
+  // Whether to keep the log of what has changed, for the incremental exports, see `C5T_STORAGE_EXPORT()`.
+  // Costs a read and a few more writes per commit.
+  bool track_changes = false;
+
+  C5T_STORAGE_OPTIONS& Backend(C5T_STORAGE_BACKEND b) {
+    backend = b;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& FsyncEveryWrite(bool b = true) {
+    fsync_every_write = b;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& CompactionCheckPeriod(std::chrono::milliseconds dt) {
+    compaction_check_period = dt;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& RecoveryThreads(size_t n) {
+    recovery_threads = n;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& Logger(std::function<void(std::string const&)> f) {
+    logger = std::move(f);
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& WriteBehind(bool b = true) {
+    write_behind = b;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& WriteBehindFlushPeriod(std::chrono::milliseconds dt) {
+    write_behind_flush_period = dt;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& CacheMaxBytesPerField(size_t n) {
+    cache_limits.max_bytes_per_field = n;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& CacheMaxNegativeEntriesPerField(size_t n) {
+    cache_limits.max_negative_entries_per_field = n;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& BloomFalsePositiveRate(double p) {
+    bloom_false_positive_rate = p;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& TTLSweepPeriod(std::chrono::milliseconds dt) {
+    ttl_sweep_period = dt;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& TTLSweepMaxKeys(size_t n) {
+    ttl_sweep_max_keys = n;
+    return *this;
+  }
+  C5T_STORAGE_OPTIONS& TrackChanges(bool b = true) {
+    track_changes = b;
+    return *this;
+  }
+};
+
 // Creates and registers the instance of storage to use.
 // Not header-only, requires the `.cc` library to be linked against!
-std::unique_ptr<C5T_STORAGE_Interface> C5T_STORAGE_CREATE_UNIQUE_INSANCE(std::string const& path);
+std::unique_ptr<C5T_STORAGE_Interface> C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+    std::string const& path, C5T_STORAGE_OPTIONS const& options = C5T_STORAGE_OPTIONS());
 
 // Throws `StorageNotInitializedException` if neither `CREATE`-d nor `INJECT`-ed.
 inline C5T_STORAGE_Interface& C5T_STORAGE_INSTANCE() {
@@ -292,3 +1824,165 @@ C5T_STORAGE_FIELD_ACCESSOR<T> C5T_STORAGE_USE_FIELD(std::string const& name) {
 }
 
 #define C5T_STORAGE(name) C5T_STORAGE_USE_FIELD<C5T_STORAGE_TYPE_##name>(#name)
+
+// `C5T_STORAGE(name)` resolves the field by its name on every use, which is a few virtual calls, a map lookup, and
+// a `dynamic_cast`, each time. The handle resolves it once, and again only if the storage instance changes, so that
+// the code that accesses the storage often, such as the code of the `dlib`-s, can keep it, per load, in a `static`:
+//   static auto kv = C5T_STORAGE_HANDLE(kv);
+//   kv().MultiSet(...);  // Or `kv(storage)`, for the injected `storage`, without `C5T_STORAGE_INJECT()`.
+template <class T>
+class C5T_STORAGE_FIELD_HANDLE final {
+ private:
+  std::string const name_;
+  std::mutex mutex_;
+  uint64_t instance_id_ = 0u;
+  std::unique_ptr<C5T_STORAGE_FIELD_ACCESSOR<T>> accessor_;
+
+ public:
+  explicit C5T_STORAGE_FIELD_HANDLE(std::string name) : name_(std::move(name)) {}
+
+  C5T_STORAGE_FIELD_ACCESSOR<T> operator()(C5T_STORAGE_Interface& storage) {
+    uint64_t const id = storage.InstanceID();
+    std::lock_guard lock(mutex_);
+    if (!accessor_ || instance_id_ != id) {
+      C5T_STORAGE_FIELD_Interface* pimpl = storage.UseFieldTypeErased(name_);
+      if (!pimpl) {
+        throw StorageFieldDeclaredAndNotDefinedException();
+      }
+      auto pimpl_typed = dynamic_cast<C5T_STORAGE_FIELD<T>*>(pimpl);
+      if (!pimpl_typed) {
+        throw StorageInternalErrorException();
+      }
+      accessor_ = std::make_unique<C5T_STORAGE_FIELD_ACCESSOR<T>>(*pimpl_typed, storage);
+      instance_id_ = id;
+    }
+    return *accessor_;
+  }
+
+  C5T_STORAGE_FIELD_ACCESSOR<T> operator()() { return (*this)(C5T_STORAGE_INSTANCE()); }
+};
+
+#define C5T_STORAGE_HANDLE(name) C5T_STORAGE_FIELD_HANDLE<C5T_STORAGE_TYPE_##name>(#name)
+
+inline void C5T_STORAGE_COMPACT() { C5T_STORAGE_INSTANCE().DoCompact(); }
+
+inline C5T_STORAGE_STATS C5T_STORAGE_GET_STATS() { return C5T_STORAGE_INSTANCE().DoGetStats(); }
+
+// Exports what is stored, all the fields, as of the moment the export starts, calling `f()` with the consecutive
+// chunks of the export, which is a single sequential stream, see `lib_c5t_storage_backup.cc`. The writes are not
+// blocked while the export runs: the values they overwrite are kept in memory until the export gets past their keys.
+// Returns the change sequence number the export is as of. With `C5T_STORAGE_OPTIONS::track_changes`, passing it as
+// `since` to a later export makes it incremental: only the keys changed since, including the deleted ones, are
+// exported. Otherwise a non-zero `since` throws `StorageChangesNotTrackedException`. With write-behind, the export
+// is as of what has been flushed.
+inline uint64_t C5T_STORAGE_EXPORT(std::function<void(std::string const& chunk)> f, uint64_t since = 0u) {
+  return C5T_STORAGE_INSTANCE().DoExport(since, std::move(f));
+}
+
+// Applies an export, the full one and then the incremental ones, in order. Meant for a freshly created storage,
+// before its fields are used, as what the fields have cached is not updated. Throws `StorageImportFailedException`
+// if the export is corrupt or incomplete, in which case some of it may have been applied already, and, before applying
+// anything, if it is incremental and the storage is not as of its `since`: the export imported last, with nothing
+// written since.
+inline uint64_t C5T_STORAGE_IMPORT(std::istream& in) { return C5T_STORAGE_INSTANCE().DoImport(in); }
+
+// While the returned scope is alive, the `Has()`-s and `Get()`-s of this thread see the values as of when it was
+// created, regardless of what the other threads write in the meantime. The writes are not blocked by the snapshots:
+// while there are snapshots, the writes keep the values they overwrite in memory, and these are dropped as the
+// snapshots end. The values written by this thread within the snapshot are not seen by it either. The scans and the
+// index lookups read what is on disk, and are not affected. Usage:
+//   {
+//     auto const snapshot = C5T_STORAGE_SNAPSHOT();
+//     ... C5T_STORAGE(kv).Get("a") ... C5T_STORAGE(kv).Get("b") ...
+//   }
+class C5T_STORAGE_SNAPSHOT_SCOPE final {
+ private:
+  uint64_t const version_;
+  uint64_t const previous_;
+
+  C5T_STORAGE_SNAPSHOT_SCOPE(C5T_STORAGE_SNAPSHOT_SCOPE const&) = delete;
+  C5T_STORAGE_SNAPSHOT_SCOPE& operator=(C5T_STORAGE_SNAPSHOT_SCOPE const&) = delete;
+  C5T_STORAGE_SNAPSHOT_SCOPE(C5T_STORAGE_SNAPSHOT_SCOPE&&) = delete;
+  C5T_STORAGE_SNAPSHOT_SCOPE& operator=(C5T_STORAGE_SNAPSHOT_SCOPE&&) = delete;
+
+ public:
+  C5T_STORAGE_SNAPSHOT_SCOPE()
+      : version_(C5T_STORAGE_VERSIONS().Pin()), previous_(C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD()) {
+    C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD() = version_;
+  }
+
+  ~C5T_STORAGE_SNAPSHOT_SCOPE() {
+    C5T_STORAGE_SNAPSHOT_OF_THIS_THREAD() = previous_;
+    if (uint64_t const oldest_snapshot = C5T_STORAGE_VERSIONS().Unpin(version_)) {
+      C5T_STORAGE_META_SINGLETON().VisitAllFields(
+          [oldest_snapshot](C5T_STORAGE_FIELD_Interface* f) { f->ReclaimVersions(oldest_snapshot); });
+    }
+  }
+
+  uint64_t Version() const { return version_; }
+};
+
+inline C5T_STORAGE_SNAPSHOT_SCOPE C5T_STORAGE_SNAPSHOT() { return C5T_STORAGE_SNAPSHOT_SCOPE(); }
+
+template <class F>
+void C5T_STORAGE_TXN_Run(C5T_STORAGE_Interface* impl, F&& f) {
+  C5T_STORAGE_TXN_Impl*& current_txn = C5T_STORAGE_TXN_OF_THIS_THREAD();
+  if (current_txn) {
+    f();
+    return;
+  }
+  C5T_STORAGE_TXN_Impl txn;
+  current_txn = &txn;
+  try {
+    f();
+  } catch (...) {
+    // Nothing to roll back: what the transaction has written is only in `txn`.
+    current_txn = nullptr;
+    throw;
+  }
+  current_txn = nullptr;
+  if (txn.writes.empty()) {
+    return;
+  }
+  // The shards of the keys written are locked in the order of their addresses, so that the commits do not deadlock.
+  std::vector<std::shared_mutex*> mutexes;
+  for (auto const& [_, written] : txn.fields) {
+    written->AddMutexes(mutexes);
+  }
+  std::sort(std::begin(mutexes), std::end(mutexes));
+  mutexes.erase(std::unique(std::begin(mutexes), std::end(mutexes)), std::end(mutexes));
+  std::vector<std::unique_lock<std::shared_mutex>> locks;
+  locks.reserve(mutexes.size());
+  for (std::shared_mutex* m : mutexes) {
+    locks.emplace_back(*m);
+  }
+  // One version for the whole transaction, so that each snapshot sees either all of it or none of it.
+  auto const [version, oldest_snapshot] = C5T_STORAGE_VERSIONS().BeginCommit();
+  try {
+    for (auto const& [_, written] : txn.fields) {
+      written->Prepare(version, oldest_snapshot);
+    }
+    // If the commit throws, nothing is applied, as the backends reject what they can not store before writing anything.
+    (impl ? *impl : C5T_STORAGE_INSTANCE()).DoCommit(txn.writes);
+    for (auto const& [_, written] : txn.fields) {
+      written->Apply();
+    }
+  } catch (...) {
+    C5T_STORAGE_VERSIONS().EndCommit(version);
+    throw;
+  }
+  C5T_STORAGE_VERSIONS().EndCommit(version);
+  // NOTE: After `EndCommit()`, so that the listeners may take snapshots.
+  for (auto const& [_, written] : txn.fields) {
+    written->Publish();
+  }
+}
+
+// Runs `f()`, and commits all the `Set`-s and `Del`-s it has made, across all the fields, as one atomic unit.
+// Within `f()`, the reads see the writes made so far, while the other threads only see them once they are committed.
+// If `f()` throws, nothing is committed, and the exception is re-thrown. A nested `C5T_STORAGE_TXN()` is simply a part
+// of the outer one.
+template <class F>
+void C5T_STORAGE_TXN(F&& f) {
+  C5T_STORAGE_TXN_Run(nullptr, std::forward<F>(f));
+}
@@ -0,0 +1,542 @@
+// The online exports of the storage: a decorator over the backend, right over it, under write-behind and the TTL
+// sweeper, that every write goes through.
+//
+// The export is a single sequential stream: the eight bytes of `kStorageExportMagic`, then the records of the same
+// binary encoding as the log backend, see `AppendStorageRecord()`, each with its own checksum. The first record, 'H',
+// has the `since` and the `as_of` change sequence numbers of the export as its value, then the 'S' and 'D' records of
+// the keys, by field and then by key, then the 'E' record, with the number of 'S' and 'D' records before it.
+//
+// Each commit gets the next change sequence number. The export is as of the last one assigned when it starts: it
+// waits for the commits up to that one to complete, and then scans the fields, page by page, in order, without
+// holding any lock while it reads them. The commits that start while the export runs first load, and keep in memory,
+// the values they are about to overwrite, for the keys the export has not got to yet. The export uses these values
+// instead of what it reads, and drops them once past their keys, so that it is as of when it started. The keys
+// deleted in the meantime are exported from these values too, and the keys created in the meantime are skipped.
+//
+// With `C5T_STORAGE_OPTIONS::track_changes`, each commit also writes, into the `c5t~changes` field and within the
+// same commit, "s" + the encoded change sequence number + '.' + field + '.' + key, and "k" + field + '.' + key ->
+// the change sequence number, and deletes the previous "s" entry of the key, so that the field has one entry per key
+// ever written. The incremental export scans the entries since `since`, in order, and exports the current values
+// of these keys, as of when it started, the same way the full export does. The change sequence numbers continue
+// from the largest one in this field once the storage is opened again.
+//
+// The import leaves "s" + the encoded change sequence number + '.' in this field, tracked changes or not, so that the
+// storage is as of the export it has imported once opened again, and an incremental export is only imported into
+// the storage that is as of its `since`.
+//
+// Without the changes tracked, and while no export runs, the commits take no lock: the change sequence number is an
+// atomic, and so is the flag the export sets before it waits for the commits that have not seen it to complete.
+
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
+
+#include <atomic>
+#include <cstring>
+#include <istream>
+#include <map>
+#include <set>
+
+#include "bricks/sync/waitable_atomic.h"
+
+namespace {
+
+constexpr static char const kStorageExportMagic[] = "C5T_EXP1";
+constexpr static size_t kStorageExportMagicSize = sizeof(kStorageExportMagic) - 1u;
+constexpr static char kStorageExportOpHeader = 'H';
+constexpr static char kStorageExportOpEnd = 'E';
+
+// How many keys the export reads at once, and how large the chunks of the export it passes on are.
+constexpr static size_t kStorageExportPageSize = 1000u;
+constexpr static size_t kStorageExportChunkSize = 1u << 16;
+// How many writes of the import are committed at once.
+constexpr static size_t kStorageImportBatchSize = 1000u;
+
+constexpr static char const* kStorageChangesField = "c5t~changes";
+
+std::string ChangeSequenceKey(uint64_t seq) { return 's' + C5T_STORAGE_INDEX_VALUE(seq); }
+
+void AppendUInt64(std::string& out, uint64_t x) { out.append(reinterpret_cast<char const*>(&x), sizeof(x)); }
+
+uint64_t ReadUInt64(std::string const& s, size_t offset) {
+  uint64_t x;
+  std::memcpy(&x, s.data() + offset, sizeof(x));
+  return x;
+}
+
+// Buffers the records of the export, and passes them on in chunks of about `kStorageExportChunkSize` bytes.
+class ExportStream final {
+ private:
+  std::function<void(std::string const&)> const& f_;
+  std::string buffer_;
+  uint64_t records_ = 0u;
+
+  void FlushIfFull() {
+    if (buffer_.length() >= kStorageExportChunkSize) {
+      f_(buffer_);
+      buffer_.clear();
+    }
+  }
+
+ public:
+  ExportStream(std::function<void(std::string const&)> const& f, uint64_t since, uint64_t as_of)
+      : f_(f), buffer_(kStorageExportMagic, kStorageExportMagicSize) {
+    std::string header;
+    AppendUInt64(header, since);
+    AppendUInt64(header, as_of);
+    AppendStorageRecord(buffer_, kStorageExportOpHeader, "", "", header.data(), static_cast<uint32_t>(header.length()));
+  }
+
+  void Write(std::string const& field, std::string const& key, Optional<std::string> const& value) {
+    AppendStorageRecord(buffer_, C5T_STORAGE_WRITE{field, key, value});
+    ++records_;
+    FlushIfFull();
+  }
+
+  void End() {
+    std::string end;
+    AppendUInt64(end, records_);
+    AppendStorageRecord(buffer_, kStorageExportOpEnd, "", "", end.data(), static_cast<uint32_t>(end.length()));
+    f_(buffer_);
+    buffer_.clear();
+  }
+};
+
+// Reads the records of the export one by one, throwing `StorageImportFailedException` if they are not complete.
+class ImportStream final {
+ private:
+  std::istream& in_;
+  std::string record_;
+
+ public:
+  explicit ImportStream(std::istream& in) : in_(in) {
+    char magic[kStorageExportMagicSize];
+    if (!in_.read(magic, kStorageExportMagicSize) || std::memcmp(magic, kStorageExportMagic, kStorageExportMagicSize)) {
+      throw StorageImportFailedException();
+    }
+  }
+
+  char Read(std::string& field, std::string& key, std::string& value) {
+    record_.resize(kStorageRecordHeaderSize);
+    if (!in_.read(&record_[0], kStorageRecordHeaderSize)) {
+      throw StorageImportFailedException();
+    }
+    uint32_t lengths[4];
+    std::memcpy(lengths, record_.data() + 1u, sizeof(lengths));
+    uint64_t const payload_length = static_cast<uint64_t>(lengths[0]) + lengths[1] + lengths[2];
+    record_.resize(kStorageRecordHeaderSize + payload_length);
+    if (!in_.read(&record_[kStorageRecordHeaderSize], static_cast<std::streamsize>(payload_length)) ||
+        StorageRecordChecksum(record_.data(), payload_length) != lengths[3]) {
+      throw StorageImportFailedException();
+    }
+    field.assign(record_, kStorageRecordHeaderSize, lengths[0]);
+    key.assign(record_, kStorageRecordHeaderSize + lengths[0], lengths[1]);
+    value.assign(record_, kStorageRecordHeaderSize + lengths[0] + lengths[1], lengths[2]);
+    return record_[0];
+  }
+};
+
+class C5T_STORAGE_BackupInstance final : public C5T_STORAGE_Interface {
+ private:
+  // The export that is running. It goes by field, in order, and then by key, in order.
+  struct Export final {
+    uint64_t id = 0u;
+    std::set<std::string> done_fields;
+    std::string field;
+    // The last key of `field` exported, if any.
+    Optional<std::string> last_key;
+    // field -> key -> the value as of when the export has started, or `nullptr` if the key did not exist,
+    // for the keys the export has not got to yet and that have been written since.
+    std::map<std::string, std::map<std::string, Optional<std::string>>> before;
+
+    bool Passed(std::string const& f, std::string const& k) const {
+      return done_fields.count(f) || (f == field && Exists(last_key) && k <= Value(last_key));
+    }
+
+    // Takes the values kept for the keys of `field` up to `key`, or all of them if `key` is null, and moves past them.
+    std::map<std::string, Optional<std::string>> Advance(Optional<std::string> const& key) {
+      std::map<std::string, Optional<std::string>> result;
+      auto& kept = before[field];
+      if (Exists(key)) {
+        auto const until = kept.upper_bound(Value(key));
+        result.insert(std::make_move_iterator(std::begin(kept)), std::make_move_iterator(until));
+        kept.erase(std::begin(kept), until);
+        last_key = key;
+      } else {
+        result = std::move(kept);
+        before.erase(field);
+        done_fields.insert(field);
+      }
+      return result;
+    }
+  };
+
+  struct State final {
+    // The change sequence numbers of the commits that are not done yet.
+    std::set<uint64_t> in_flight;
+    uint64_t exports = 0u;
+    std::unique_ptr<Export> running;
+  };
+
+  std::unique_ptr<C5T_STORAGE_Interface> const inner_;
+  bool const track_changes_;
+  // One export at a time.
+  std::mutex export_mutex_;
+  current::WaitableAtomic<State> state_;
+  // The last change sequence number assigned.
+  std::atomic_uint64_t seq_;
+  // Whether an export runs, and how many commits are being made without the lock.
+  std::atomic_bool exporting_;
+  std::atomic_uint64_t unlocked_writes_;
+
+  // The largest change sequence number in `kStorageChangesField`, found in as many single-key scans as there are bits.
+  uint64_t LastTrackedChange() {
+    auto const any_since = [this](uint64_t seq) {
+      bool found = false;
+      inner_->DoScan(kStorageChangesField,
+                     ChangeSequenceKey(seq),
+                     "t",
+                     1u,
+                     [&found](std::string const&, std::string const&) { found = true; });
+      return found;
+    };
+    uint64_t seq = 0u;
+    for (int bit = 62; bit >= 0; --bit) {
+      if (any_since(seq | (1ull << bit))) {
+        seq |= 1ull << bit;
+      }
+    }
+    return seq;
+  }
+
+  // `writes`, and the updates of the change log for them. The new entries go before the deletes of the previous ones,
+  // so that the incremental export, which scans the change log concurrently, does not miss the keys being rewritten.
+  // The previous entries of the keys written concurrently may stay; then these keys are exported once more than needed.
+  std::vector<C5T_STORAGE_WRITE> WithChanges(std::vector<C5T_STORAGE_WRITE> const& writes, uint64_t seq) {
+    std::vector<C5T_STORAGE_WRITE> result = writes;
+    std::vector<C5T_STORAGE_WRITE> stale;
+    std::set<std::string> ids;
+    std::string const prefix = ChangeSequenceKey(seq) + '.';
+    for (auto const& w : writes) {
+      std::string const id = w.field + '.' + w.key;
+      if (!ids.insert(id).second) {
+        continue;
+      }
+      Optional<std::string> const previous = inner_->DoLoad(kStorageChangesField, 'k' + id);
+      if (Exists(previous)) {
+        uint64_t const previous_seq = std::strtoull(Value(previous).c_str(), nullptr, 10);
+        stale.push_back(C5T_STORAGE_WRITE{kStorageChangesField, ChangeSequenceKey(previous_seq) + '.' + id, nullptr});
+      }
+      result.push_back(C5T_STORAGE_WRITE{kStorageChangesField, prefix + id, std::string()});
+      result.push_back(C5T_STORAGE_WRITE{kStorageChangesField, 'k' + id, current::ToString(seq)});
+    }
+    result.insert(std::end(result), std::begin(stale), std::end(stale));
+    return result;
+  }
+
+  void DoneUnlockedWrite() {
+    if (!--unlocked_writes_ && exporting_) {
+      state_.MutableUse([](State&) {});
+    }
+  }
+
+  // Makes the writes, with `apply()` unless the changes are tracked, so that the running export, if any, is not
+  // affected by them.
+  template <class F>
+  void Write(std::vector<C5T_STORAGE_WRITE> const& writes, F&& apply) {
+    if (!track_changes_) {
+      // NOTE: The export sets `exporting_` before it waits for `unlocked_writes_` to drop to zero, so either it waits
+      // for this write, or this write sees it, and takes the lock.
+      ++unlocked_writes_;
+      if (!exporting_) {
+        ++seq_;
+        try {
+          apply();
+        } catch (...) {
+          DoneUnlockedWrite();
+          throw;
+        }
+        DoneUnlockedWrite();
+        return;
+      }
+      DoneUnlockedWrite();
+    }
+    uint64_t seq;
+    uint64_t export_id = 0u;
+    std::vector<C5T_STORAGE_WRITE const*> capture;
+    state_.MutableUse([&](State& s) {
+      seq = ++seq_;
+      s.in_flight.insert(seq);
+      if (s.running) {
+        export_id = s.running->id;
+        for (auto const& w : writes) {
+          if (!s.running->Passed(w.field, w.key)) {
+            capture.push_back(&w);
+          }
+        }
+      }
+    });
+    try {
+      for (C5T_STORAGE_WRITE const* w : capture) {
+        Optional<std::string> value = inner_->DoLoad(w->field, w->key);
+        state_.MutableUse([&](State& s) {
+          // Not if the export has got to this key in the meantime, as then it has read it before this write.
+          if (s.running && s.running->id == export_id && !s.running->Passed(w->field, w->key)) {
+            s.running->before[w->field].emplace(w->key, std::move(value));
+          }
+        });
+      }
+      if (track_changes_) {
+        inner_->DoCommit(WithChanges(writes, seq));
+      } else {
+        apply();
+      }
+    } catch (...) {
+      state_.MutableUse([seq](State& s) { s.in_flight.erase(seq); });
+      throw;
+    }
+    state_.MutableUse([seq](State& s) { s.in_flight.erase(seq); });
+  }
+
+  // Exports the keys of `field` that are in `page`, as read, or null if they no longer exist, as of when the export
+  // has started. If `last_page`, also the keys deleted since that are past the page.
+  void ExportPage(ExportStream& out,
+                  std::string const& field,
+                  std::vector<std::pair<std::string, Optional<std::string>>> const& page,
+                  bool last_page) {
+    Optional<std::string> until;
+    if (!last_page) {
+      until = page.back().first;
+    }
+    std::map<std::string, Optional<std::string>> before =
+        state_.MutableUse([&until](State& s) { return s.running->Advance(until); });
+    auto it = std::begin(before);
+    auto const export_before = [&](std::string const* key) {
+      for (; it != std::end(before) && (!key || it->first < *key); ++it) {
+        if (Exists(it->second)) {
+          out.Write(field, it->first, it->second);
+        }
+      }
+    };
+    for (auto const& [key, value] : page) {
+      export_before(&key);
+      if (it != std::end(before) && it->first == key) {
+        out.Write(field, key, it->second);
+        ++it;
+      } else {
+        out.Write(field, key, value);
+      }
+    }
+    export_before(nullptr);
+  }
+
+  void StartExportingField(std::string const& field) {
+    state_.MutableUse([&field](State& s) {
+      s.running->field = field;
+      s.running->last_key = nullptr;
+    });
+  }
+
+  void ExportAll(ExportStream& out) {
+    std::vector<std::string> fields;
+    inner_->ListFields([&](std::string const& name) {
+      if (C5T_STORAGE_FIELD_Interface const* field = inner_->UseFieldTypeErased(name)) {
+        for (std::string const& stored : field->StoredFieldNames()) {
+          fields.push_back(stored);
+        }
+      }
+    });
+    std::sort(std::begin(fields), std::end(fields));
+    for (std::string const& field : fields) {
+      StartExportingField(field);
+      std::string from;
+      while (true) {
+        std::vector<std::pair<std::string, Optional<std::string>>> page;
+        inner_->DoScan(field, from, "", kStorageExportPageSize, [&page](std::string const& k, std::string const& v) {
+          page.emplace_back(k, v);
+        });
+        bool const last_page = page.size() < kStorageExportPageSize;
+        ExportPage(out, field, page, last_page);
+        if (last_page) {
+          break;
+        }
+        from = page.back().first + '\0';
+      }
+    }
+  }
+
+  void ExportChangedSince(uint64_t since, ExportStream& out) {
+    // field -> keys. The commits made while this runs may add more keys, which are then exported as of `as_of` too.
+    std::map<std::string, std::set<std::string>> changed;
+    std::string from = ChangeSequenceKey(since + 1u);
+    size_t const field_offset = from.length() + 1u;
+    while (true) {
+      size_t n = 0u;
+      std::string next;
+      auto const add = [&](std::string const& k, std::string const&) {
+        ++n;
+        next = k + '\0';
+        // Past the change sequence number and '.', unless it is the mark left by the import.
+        size_t const dot = k.find('.', field_offset);
+        if (dot != std::string::npos) {
+          changed[k.substr(field_offset, dot - field_offset)].insert(k.substr(dot + 1u));
+        }
+      };
+      inner_->DoScan(kStorageChangesField, from, "t", kStorageExportPageSize, add);
+      if (n < kStorageExportPageSize) {
+        break;
+      }
+      from = next;
+    }
+    for (auto const& [field, keys] : changed) {
+      StartExportingField(field);
+      std::vector<std::pair<std::string, Optional<std::string>>> page;
+      for (auto it = std::begin(keys); it != std::end(keys);) {
+        page.emplace_back(*it, inner_->DoLoad(field, *it));
+        ++it;
+        bool const last_page = it == std::end(keys);
+        if (last_page || page.size() == kStorageExportPageSize) {
+          // The keys that are not in `changed` have not changed since `since`, the values kept for them are dropped.
+          Optional<std::string> until;
+          if (!last_page) {
+            until = page.back().first;
+          }
+          std::map<std::string, Optional<std::string>> const before =
+              state_.MutableUse([&until](State& s) { return s.running->Advance(until); });
+          for (auto const& [key, value] : page) {
+            auto const cit = before.find(key);
+            out.Write(field, key, cit != std::end(before) ? cit->second : value);
+          }
+          page.clear();
+        }
+      }
+    }
+  }
+
+ public:
+  C5T_STORAGE_BackupInstance(std::unique_ptr<C5T_STORAGE_Interface> inner, C5T_STORAGE_OPTIONS const& options)
+      : inner_(std::move(inner)),
+        track_changes_(options.track_changes),
+        seq_(LastTrackedChange()),
+        exporting_(false),
+        unlocked_writes_(0u) {
+    ReplaceRegisteredStorageInstance(inner_.get(), this);
+  }
+
+  ~C5T_STORAGE_BackupInstance() override { ReplaceRegisteredStorageInstance(this, inner_.get()); }
+
+  size_t FieldsCount() const override { return inner_->FieldsCount(); }
+  C5T_STORAGE_CACHE_LIMITS CacheLimits() const override { return inner_->CacheLimits(); }
+  uint64_t InstanceID() const override { return inner_->InstanceID(); }
+  void ListFields(std::function<void(std::string const&)> cb) override { inner_->ListFields(std::move(cb)); }
+  bool NeedToStartFresh(C5T_STORAGE_FIELD_Interface const& field) override { return inner_->NeedToStartFresh(field); }
+  C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const& name) override {
+    return inner_->UseFieldTypeErased(name);
+  }
+
+  void DoSave(std::string const& field, std::string const& key, std::string const& value) override {
+    Write({C5T_STORAGE_WRITE{field, key, value}}, [&]() { inner_->DoSave(field, key, value); });
+  }
+  Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
+    return inner_->DoLoad(field, key);
+  }
+  void DoDelete(std::string const& field, std::string const& key) override {
+    Write({C5T_STORAGE_WRITE{field, key, nullptr}}, [&]() { inner_->DoDelete(field, key); });
+  }
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    inner_->DoScan(field, begin, end, limit, std::move(f));
+  }
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    inner_->DoListKeys(field, std::move(f));
+  }
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override {
+    Write(writes, [&]() { inner_->DoCommit(writes); });
+  }
+  void DoCompact() override { inner_->DoCompact(); }
+  C5T_STORAGE_STATS DoGetStats() override { return inner_->DoGetStats(); }
+
+  uint64_t DoExport(uint64_t since, std::function<void(std::string const& chunk)> f) override {
+    if (since && !track_changes_) {
+      throw StorageChangesNotTrackedException();
+    }
+    std::lock_guard lock(export_mutex_);
+    exporting_ = true;
+    state_.Wait([this](State const&) { return !unlocked_writes_; });
+    uint64_t const as_of = state_.MutableUse([this](State& s) {
+      s.running = std::make_unique<Export>();
+      s.running->id = ++s.exports;
+      return seq_.load();
+    });
+    try {
+      state_.Wait([as_of](State const& s) { return s.in_flight.empty() || *std::begin(s.in_flight) > as_of; });
+      ExportStream out(f, since, as_of);
+      if (since) {
+        ExportChangedSince(since, out);
+      } else {
+        ExportAll(out);
+      }
+      out.End();
+    } catch (...) {
+      state_.MutableUse([](State& s) { s.running = nullptr; });
+      exporting_ = false;
+      throw;
+    }
+    state_.MutableUse([](State& s) { s.running = nullptr; });
+    exporting_ = false;
+    return as_of;
+  }
+
+  uint64_t DoImport(std::istream& in) override {
+    ImportStream records(in);
+    std::string field;
+    std::string key;
+    std::string value;
+    if (records.Read(field, key, value) != kStorageExportOpHeader || value.length() != 2u * sizeof(uint64_t)) {
+      throw StorageImportFailedException();
+    }
+    // The incremental export only follows the one the storage is as of.
+    uint64_t const since = ReadUInt64(value, 0u);
+    if (since && since != seq_) {
+      throw StorageImportFailedException();
+    }
+    uint64_t const as_of = ReadUInt64(value, sizeof(uint64_t));
+    uint64_t count = 0u;
+    std::vector<C5T_STORAGE_WRITE> batch;
+    while (true) {
+      char const op = records.Read(field, key, value);
+      if (op == kStorageRecordOpSet) {
+        batch.push_back(C5T_STORAGE_WRITE{field, key, value});
+      } else if (op == kStorageRecordOpDel) {
+        batch.push_back(C5T_STORAGE_WRITE{field, key, nullptr});
+      } else if (op == kStorageExportOpEnd && value.length() == sizeof(uint64_t) && ReadUInt64(value, 0u) == count) {
+        break;
+      } else {
+        throw StorageImportFailedException();
+      }
+      ++count;
+      if (batch.size() == kStorageImportBatchSize) {
+        inner_->DoCommit(batch);
+        batch.clear();
+      }
+    }
+    if (!batch.empty()) {
+      inner_->DoCommit(batch);
+    }
+    // The change sequence numbers continue from the one of the export, and from it on the next start too.
+    uint64_t seq = seq_;
+    while (seq < as_of && !seq_.compare_exchange_weak(seq, as_of)) {
+    }
+    inner_->DoSave(kStorageChangesField, ChangeSequenceKey(std::max(seq, as_of)) + '.', "");
+    return as_of;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateBackupStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                   C5T_STORAGE_OPTIONS const& options) {
+  return std::make_unique<C5T_STORAGE_BackupInstance>(std::move(inner), options);
+}
@@ -0,0 +1,949 @@
+// The single-file B+tree storage backend.
+//
+// All the fields live in one file, as one B+tree keyed by `field + '\0' + key`, so that the keys of each field are
+// contiguous and ordered, and both the lookups and the range scans are logarithmic. The file is a sequence of pages:
+//   pages 0 and 1  the two meta pages, see `BTreeMeta`
+//   the rest       the nodes of the tree, the overflow pages of the large values, and the pages of the free list
+//
+// The pages are copy-on-write. A commit never modifies the pages that the committed tree refers to: it writes the
+// nodes it changes, and the nodes on their paths up to the root, into free pages, and then makes the new tree current
+// by writing the meta page that refers to its root. The two meta pages alternate, each with its generation and its
+// checksum, and the newest valid one is used on startup. Thus a crash at any point leaves the previous tree intact.
+// The pages a commit stops referring to are added to the free list, to be reused by the next commits, never by itself.
+//
+// The reads go through a read-only `mmap()` of the file, and the decoded nodes are kept in a page cache.
+//
+// The commits are group-committed, as those of the `Log` backend: while one thread, the leader, is writing, the
+// commits from other threads queue up, and the next leader writes all of them as one new tree, with one pair of
+// `fdatasync()`-s. The reads go on while the leader writes the pages, since they are not the pages of the current
+// tree, and are only held up for as long as the leader makes its new tree current.
+//
+// The page layouts, in host byte order:
+//   leaf           'L', uint16_t n, then n times: uint16_t key length, key, uint8_t overflow, uint32_t value length,
+//                  and then either the value itself, or, if `overflow` is set, uint32_t first overflow page
+//   internal       'I', uint16_t n, uint32_t child, then n times: uint16_t key length, key, uint32_t child
+//   overflow       'O', uint32_t next page or zero, uint32_t length, the bytes of the value
+//   free list      'F', uint32_t next page or zero, uint32_t n, n times uint32_t page
+//
+// The free list is a stack of page numbers, stored as a chain of pages from its top down: all of them but the first
+// one are full, so that a commit only writes the pages of the top of the stack that it changes, and keeps the rest.
+//
+// NOTE: The deletes remove the nodes that become empty, and replace the internal nodes left with one child by that
+// child, but do not merge the nodes that become underfull. The tree stays ordered, although no longer perfectly
+// balanced, and the pages freed are reused via the free list.
+
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "bricks/file/file.h"
+#include "bricks/sync/waitable_atomic.h"
+
+namespace {
+
+constexpr static char kBTreeFileName[] = "c5t_storage.btree";
+
+constexpr static size_t kBTreePageSize = 4096u;
+constexpr static uint32_t kBTreeMetaPages = 2u;
+constexpr static size_t kBTreeMaxKeySize = 1024u;
+constexpr static size_t kBTreeMaxInlineValueSize = 1000u;
+constexpr static size_t kBTreePageCacheSize = 4096u;
+
+constexpr static size_t kBTreeNodeHeaderSize = 1u + sizeof(uint16_t) + sizeof(uint32_t);
+constexpr static size_t kBTreeMaxEntrySize =
+    sizeof(uint16_t) + kBTreeMaxKeySize + 1u + sizeof(uint32_t) + kBTreeMaxInlineValueSize;
+// So that the node that no longer fits a page after one more entry can always be split into two that do.
+static_assert(kBTreeNodeHeaderSize + 2u * kBTreeMaxEntrySize <= kBTreePageSize, "The B+tree entries are too large.");
+
+constexpr static char kBTreePageLeaf = 'L';
+constexpr static char kBTreePageInternal = 'I';
+constexpr static char kBTreePageOverflow = 'O';
+constexpr static char kBTreePageFreeList = 'F';
+
+constexpr static size_t kBTreeOverflowHeaderSize = 1u + 2u * sizeof(uint32_t);
+constexpr static size_t kBTreeFreeListHeaderSize = 1u + 2u * sizeof(uint32_t);
+constexpr static size_t kBTreeFreeListPerPage = (kBTreePageSize - kBTreeFreeListHeaderSize) / sizeof(uint32_t);
+
+[[noreturn]] void FatalBTreeError(char const* what, std::string const& path) {
+  std::cerr << "FATAL: Storage B+tree " << what << " failed for '" << path << "': " << std::strerror(errno)
+            << std::endl;
+  ::abort();
+}
+
+template <typename T>
+void Put(std::string& out, T x) {
+  out.append(reinterpret_cast<char const*>(&x), sizeof(T));
+}
+
+template <typename T>
+T Get(char const*& p) {
+  T x;
+  std::memcpy(&x, p, sizeof(T));
+  p += sizeof(T);
+  return x;
+}
+
+uint32_t BTreeChecksum(char const* data, size_t size) {
+  uint64_t h = 14695981039346656037ull;
+  for (size_t i = 0u; i < size; ++i) {
+    h = (h ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+  }
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+// What makes a tree current. Written into the meta page `generation % 2`, followed by the checksum of these bytes.
+struct BTreeMeta final {
+  constexpr static char kMagic[8] = {'C', '5', 'T', 'B', 'T', 'R', 'E', 'E'};
+  constexpr static uint32_t kFormat = 1u;
+
+  uint64_t generation = 0u;
+  uint32_t root = 0u;  // Zero for the empty tree.
+  uint32_t page_count = kBTreeMetaPages;
+  uint32_t free_list = 0u;  // The first page of the free list, zero if there are no free pages.
+
+  std::string Serialize() const {
+    std::string result(kMagic, sizeof(kMagic));
+    Put(result, kFormat);
+    Put(result, generation);
+    Put(result, root);
+    Put(result, page_count);
+    Put(result, free_list);
+    Put(result, BTreeChecksum(result.data(), result.length()));
+    result.resize(kBTreePageSize, '\0');
+    return result;
+  }
+
+  bool Deserialize(char const* page) {
+    char const* p = page;
+    if (std::memcmp(p, kMagic, sizeof(kMagic))) {
+      return false;
+    }
+    p += sizeof(kMagic);
+    if (Get<uint32_t>(p) != kFormat) {
+      return false;
+    }
+    generation = Get<uint64_t>(p);
+    root = Get<uint32_t>(p);
+    page_count = Get<uint32_t>(p);
+    free_list = Get<uint32_t>(p);
+    size_t const size = static_cast<size_t>(p - page);
+    return Get<uint32_t>(p) == BTreeChecksum(page, size);
+  }
+};
+
+// The value of a key in a leaf: either the bytes themselves, or the length and the first page of the overflow chain.
+struct BTreeValue final {
+  std::string bytes;
+  uint32_t overflow_page = 0u;
+  uint32_t overflow_length = 0u;
+
+  size_t EncodedSize() const { return 1u + sizeof(uint32_t) + (overflow_page ? sizeof(uint32_t) : bytes.length()); }
+};
+
+struct BTreeNode final {
+  bool leaf = true;
+  std::vector<std::string> keys;
+  // For the leaves.
+  std::vector<BTreeValue> values;
+  // For the internal nodes, `keys.size() + 1` of them. The keys of `children[i]` are within `[keys[i - 1], keys[i])`.
+  std::vector<uint32_t> children;
+
+  // For the internal nodes: which child the key belongs to.
+  size_t ChildIndex(std::string const& key) const {
+    return static_cast<size_t>(std::upper_bound(keys.begin(), keys.end(), key) - keys.begin());
+  }
+
+  // The size of the `i`-th key, and of the value or the child that follows it.
+  size_t EntrySize(size_t i) const {
+    return sizeof(uint16_t) + keys[i].length() + (leaf ? values[i].EncodedSize() : sizeof(uint32_t));
+  }
+
+  size_t EncodedSize() const {
+    size_t size = 1u + sizeof(uint16_t) + (leaf ? 0u : sizeof(uint32_t));
+    for (size_t i = 0u; i < keys.size(); ++i) {
+      size += EntrySize(i);
+    }
+    return size;
+  }
+
+  std::string Serialize(std::string const& path) const {
+    if (EncodedSize() > kBTreePageSize) {
+      std::cerr << "FATAL: Storage B+tree node of " << EncodedSize() << " bytes in '" << path << "'." << std::endl;
+      ::abort();
+    }
+    std::string result;
+    result += leaf ? kBTreePageLeaf : kBTreePageInternal;
+    Put(result, static_cast<uint16_t>(keys.size()));
+    if (leaf) {
+      for (size_t i = 0u; i < keys.size(); ++i) {
+        Put(result, static_cast<uint16_t>(keys[i].length()));
+        result += keys[i];
+        BTreeValue const& v = values[i];
+        Put(result, static_cast<uint8_t>(v.overflow_page ? 1u : 0u));
+        if (v.overflow_page) {
+          Put(result, v.overflow_length);
+          Put(result, v.overflow_page);
+        } else {
+          Put(result, static_cast<uint32_t>(v.bytes.length()));
+          result += v.bytes;
+        }
+      }
+    } else {
+      Put(result, children[0]);
+      for (size_t i = 0u; i < keys.size(); ++i) {
+        Put(result, static_cast<uint16_t>(keys[i].length()));
+        result += keys[i];
+        Put(result, children[i + 1u]);
+      }
+    }
+    result.resize(kBTreePageSize, '\0');
+    return result;
+  }
+
+  static std::shared_ptr<BTreeNode> Deserialize(char const* page, std::string const& path) {
+    auto node = std::make_shared<BTreeNode>();
+    char const* p = page;
+    char const type = *p++;
+    if (type != kBTreePageLeaf && type != kBTreePageInternal) {
+      std::cerr << "FATAL: Storage B+tree page of type " << static_cast<int>(type) << " in '" << path << "'."
+                << std::endl;
+      ::abort();
+    }
+    node->leaf = (type == kBTreePageLeaf);
+    uint16_t const n = Get<uint16_t>(p);
+    node->keys.reserve(n);
+    if (node->leaf) {
+      node->values.resize(n);
+    } else {
+      node->children.reserve(n + 1u);
+      node->children.push_back(Get<uint32_t>(p));
+    }
+    for (uint16_t i = 0u; i < n; ++i) {
+      uint16_t const key_length = Get<uint16_t>(p);
+      node->keys.emplace_back(p, key_length);
+      p += key_length;
+      if (node->leaf) {
+        BTreeValue& v = node->values[i];
+        bool const overflow = Get<uint8_t>(p) != 0u;
+        uint32_t const length = Get<uint32_t>(p);
+        if (overflow) {
+          v.overflow_length = length;
+          v.overflow_page = Get<uint32_t>(p);
+        } else {
+          v.bytes.assign(p, length);
+          p += length;
+        }
+      } else {
+        node->children.push_back(Get<uint32_t>(p));
+      }
+    }
+    return node;
+  }
+};
+
+class C5T_STORAGE_BTreeInstance final : public C5T_STORAGE_Instance {
+ private:
+  C5T_STORAGE_OPTIONS const options_;
+  std::string const file_path_;
+
+  // Shared by the reads, exclusive for the leader to make its tree current: guards `meta_` and the `mmap()`.
+  std::shared_mutex mutex_;
+  int fd_ = -1;
+  char const* map_ = nullptr;
+  size_t map_size_ = 0u;
+  BTreeMeta meta_;
+
+  // Held by the leader while it writes the pages, guards the state of the commit in progress and of the free pages.
+  std::mutex writer_mutex_;
+  // The pages that are free as of the current tree, to be reused by the next commit. The top of the stack is last.
+  std::vector<uint32_t> free_;
+  // The pages the current free list is stored in, from the bottom of the stack up, so that the `i`-th one holds the
+  // `kBTreeFreeListPerPage` entries of `free_` from `i * kBTreeFreeListPerPage` on. Those that the next commit writes
+  // anew are free as of that commit. If the free list read from the file is not laid out so, it is written anew whole.
+  std::vector<uint32_t> free_list_pages_;
+  bool free_list_aligned_ = true;
+
+  // The state of the commit in progress.
+  uint32_t page_count_ = kBTreeMetaPages;
+  std::unordered_map<uint32_t, std::shared_ptr<BTreeNode>> dirty_;
+  std::vector<uint32_t> freed_;
+
+  // The decoded nodes of the current tree, most recently used first.
+  std::mutex cache_mutex_;
+  std::list<std::pair<uint32_t, std::shared_ptr<BTreeNode const>>> cache_;
+  std::unordered_map<uint32_t, decltype(cache_)::iterator> cache_index_;
+
+  // The commits waiting to be written by the leader, who is the first of the committers to find no leader active.
+  struct GroupCommit final {
+    std::vector<std::vector<C5T_STORAGE_WRITE> const*> pending;
+    uint64_t last_enqueued = 0u;
+    uint64_t last_done = 0u;
+    bool leader_active = false;
+  };
+  current::WaitableAtomic<GroupCommit> group_commit_;
+
+  void ReadPage(uint32_t page, char* data) const {
+    size_t size = kBTreePageSize;
+    off_t offset = static_cast<off_t>(page) * static_cast<off_t>(kBTreePageSize);
+    while (size) {
+      ssize_t const n = ::pread(fd_, data, size, offset);
+      if (n <= 0) {
+        if (n < 0 && errno == EINTR) {
+          continue;
+        }
+        FatalBTreeError("read", file_path_);
+      }
+      data += n;
+      size -= static_cast<size_t>(n);
+      offset += n;
+    }
+  }
+
+  void WritePage(uint32_t page, std::string const& data) {
+    char const* p = data.data();
+    size_t size = data.length();
+    off_t offset = static_cast<off_t>(page) * static_cast<off_t>(kBTreePageSize);
+    while (size) {
+      ssize_t const n = ::pwrite(fd_, p, size, offset);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        FatalBTreeError("write", file_path_);
+      }
+      p += n;
+      size -= static_cast<size_t>(n);
+      offset += n;
+    }
+  }
+
+  // From the `mmap()`-ed file if the page is within it, otherwise into `scratch`.
+  char const* PageData(uint32_t page, std::string& scratch) const {
+    size_t const offset = static_cast<size_t>(page) * kBTreePageSize;
+    if (offset + kBTreePageSize <= map_size_) {
+      return map_ + offset;
+    }
+    scratch.resize(kBTreePageSize);
+    ReadPage(page, scratch.data());
+    return scratch.data();
+  }
+
+  void Remap() {
+    struct stat st;
+    if (::fstat(fd_, &st)) {
+      FatalBTreeError("fstat", file_path_);
+    }
+    size_t const size = static_cast<size_t>(st.st_size);
+    if (size == map_size_) {
+      return;
+    }
+    if (map_) {
+      ::munmap(const_cast<char*>(map_), map_size_);
+      map_ = nullptr;
+      map_size_ = 0u;
+    }
+    if (size) {
+      void* const p = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, fd_, 0);
+      if (p == MAP_FAILED) {
+        FatalBTreeError("mmap", file_path_);
+      }
+      map_ = static_cast<char const*>(p);
+      map_size_ = size;
+    }
+  }
+
+  std::shared_ptr<BTreeNode const> LoadNode(uint32_t page) {
+    {
+      std::lock_guard lock(cache_mutex_);
+      auto const cit = cache_index_.find(page);
+      if (cit != std::end(cache_index_)) {
+        cache_.splice(std::begin(cache_), cache_, cit->second);
+        return cit->second->second;
+      }
+    }
+    std::string scratch;
+    std::shared_ptr<BTreeNode const> node = BTreeNode::Deserialize(PageData(page, scratch), file_path_);
+    std::lock_guard lock(cache_mutex_);
+    if (!cache_index_.count(page)) {
+      cache_.emplace_front(page, node);
+      cache_index_[page] = std::begin(cache_);
+      if (cache_.size() > kBTreePageCacheSize) {
+        cache_index_.erase(cache_.back().first);
+        cache_.pop_back();
+      }
+    }
+    return node;
+  }
+
+  void ForgetCachedPage(uint32_t page) {
+    std::lock_guard lock(cache_mutex_);
+    auto const it = cache_index_.find(page);
+    if (it != std::end(cache_index_)) {
+      cache_.erase(it->second);
+      cache_index_.erase(it);
+    }
+  }
+
+  std::string LoadValue(BTreeValue const& v) const {
+    if (!v.overflow_page) {
+      return v.bytes;
+    }
+    std::string result;
+    result.reserve(v.overflow_length);
+    std::string scratch;
+    for (uint32_t page = v.overflow_page; page;) {
+      char const* p = PageData(page, scratch) + 1u;
+      page = Get<uint32_t>(p);
+      uint32_t const length = Get<uint32_t>(p);
+      result.append(p, length);
+    }
+    return result;
+  }
+
+  // The functions below are for the commit in progress, and must be called with `writer_mutex_` held.
+
+  uint32_t Allocate() {
+    uint32_t page;
+    if (!free_.empty()) {
+      page = free_.back();
+      free_.pop_back();
+    } else {
+      page = page_count_++;
+    }
+    ForgetCachedPage(page);
+    return page;
+  }
+
+  std::shared_ptr<BTreeNode const> View(uint32_t page) {
+    auto const cit = dirty_.find(page);
+    return cit != std::end(dirty_) ? cit->second : LoadNode(page);
+  }
+
+  // The node to modify: the page itself if it was written by this commit already, or its copy in a new page.
+  BTreeNode& Mutable(uint32_t& page) {
+    auto const cit = dirty_.find(page);
+    if (cit != std::end(dirty_)) {
+      return *cit->second;
+    }
+    auto copy = std::make_shared<BTreeNode>(*LoadNode(page));
+    freed_.push_back(page);
+    page = Allocate();
+    return *(dirty_[page] = std::move(copy));
+  }
+
+  void Free(uint32_t page) {
+    dirty_.erase(page);
+    freed_.push_back(page);
+  }
+
+  BTreeValue StoreValue(std::string const& bytes) {
+    BTreeValue v;
+    if (bytes.length() <= kBTreeMaxInlineValueSize) {
+      v.bytes = bytes;
+      return v;
+    }
+    // Written right away: the pages are new, so nothing refers to them until the commit is complete.
+    size_t const per_page = kBTreePageSize - kBTreeOverflowHeaderSize;
+    size_t const pages = (bytes.length() + per_page - 1u) / per_page;
+    std::vector<uint32_t> ids(pages);
+    for (uint32_t& id : ids) {
+      id = Allocate();
+    }
+    for (size_t i = 0u; i < pages; ++i) {
+      size_t const length = std::min(per_page, bytes.length() - i * per_page);
+      std::string page;
+      page += kBTreePageOverflow;
+      Put(page, i + 1u < pages ? ids[i + 1u] : 0u);
+      Put(page, static_cast<uint32_t>(length));
+      page.append(bytes, i * per_page, length);
+      page.resize(kBTreePageSize, '\0');
+      WritePage(ids[i], page);
+    }
+    v.overflow_page = ids.front();
+    v.overflow_length = static_cast<uint32_t>(bytes.length());
+    return v;
+  }
+
+  void FreeValue(BTreeValue const& v) {
+    std::string scratch;
+    for (uint32_t page = v.overflow_page; page;) {
+      char const* p = PageData(page, scratch) + 1u;
+      freed_.push_back(page);
+      page = Get<uint32_t>(p);
+    }
+  }
+
+  // Moves the upper part of `node` into a new page. Returns the separator key and that page. Splits as close to the
+  // middle, by size, as possible, such that both parts fit a page, which `kBTreeMaxEntrySize` makes always possible.
+  std::pair<std::string, uint32_t> Split(BTreeNode& node) {
+    auto right = std::make_shared<BTreeNode>();
+    right->leaf = node.leaf;
+    size_t const n = node.keys.size();
+    size_t const header = node.leaf ? 1u + sizeof(uint16_t) : kBTreeNodeHeaderSize;
+    size_t const total = node.EncodedSize() - header;
+    size_t mid = 0u;
+    size_t best = std::numeric_limits<size_t>::max();
+    size_t left = 0u;
+    for (size_t i = 1u; i + (node.leaf ? 0u : 1u) < n; ++i) {
+      left += node.EntrySize(i - 1u);
+      // The internal nodes move the key `i` up, and its child becomes the first child of the right part.
+      size_t const right_size = total - left - (node.leaf ? 0u : node.EntrySize(i));
+      if (header + left <= kBTreePageSize && header + right_size <= kBTreePageSize) {
+        size_t const imbalance = left > right_size ? left - right_size : right_size - left;
+        if (imbalance < best) {
+          best = imbalance;
+          mid = i;
+        }
+      }
+    }
+    if (!mid) {
+      std::cerr << "FATAL: Storage B+tree node of " << n << " keys can not be split in '" << file_path_ << "'."
+                << std::endl;
+      ::abort();
+    }
+    std::string separator;
+    if (node.leaf) {
+      separator = node.keys[mid];
+      right->keys.assign(std::make_move_iterator(node.keys.begin() + mid), std::make_move_iterator(node.keys.end()));
+      right->values.assign(std::make_move_iterator(node.values.begin() + mid),
+                           std::make_move_iterator(node.values.end()));
+      node.values.resize(mid);
+    } else {
+      separator = std::move(node.keys[mid]);
+      right->keys.assign(std::make_move_iterator(node.keys.begin() + mid + 1u),
+                         std::make_move_iterator(node.keys.end()));
+      right->children.assign(node.children.begin() + mid + 1u, node.children.end());
+      node.children.resize(mid + 1u);
+    }
+    node.keys.resize(mid);
+    uint32_t const page = Allocate();
+    dirty_[page] = std::move(right);
+    return {std::move(separator), page};
+  }
+
+  // Returns the separator and the new right sibling if the node had to be split.
+  Optional<std::pair<std::string, uint32_t>> Insert(uint32_t& page, std::string const& key, BTreeValue value) {
+    BTreeNode& node = Mutable(page);
+    if (node.leaf) {
+      auto const it = std::lower_bound(node.keys.begin(), node.keys.end(), key);
+      size_t const i = static_cast<size_t>(it - node.keys.begin());
+      if (it != node.keys.end() && *it == key) {
+        FreeValue(node.values[i]);
+        node.values[i] = std::move(value);
+      } else {
+        node.keys.insert(it, key);
+        node.values.insert(node.values.begin() + i, std::move(value));
+      }
+    } else {
+      size_t const i = node.ChildIndex(key);
+      uint32_t child = node.children[i];
+      auto const split = Insert(child, key, std::move(value));
+      node.children[i] = child;
+      if (Exists(split)) {
+        node.keys.insert(node.keys.begin() + i, Value(split).first);
+        node.children.insert(node.children.begin() + i + 1u, Value(split).second);
+      }
+    }
+    if (node.EncodedSize() > kBTreePageSize) {
+      return Split(node);
+    }
+    return nullptr;
+  }
+
+  // Returns `false` if there was no such key, in which case nothing is changed. Sets `page` to zero if the node
+  // is now empty, or to its only child if it is an internal node that is left with one.
+  bool Erase(uint32_t& page, std::string const& key) {
+    auto const view = View(page);
+    if (view->leaf) {
+      auto const it = std::lower_bound(view->keys.begin(), view->keys.end(), key);
+      if (it == view->keys.end() || *it != key) {
+        return false;
+      }
+      size_t const i = static_cast<size_t>(it - view->keys.begin());
+      BTreeNode& node = Mutable(page);
+      FreeValue(node.values[i]);
+      node.keys.erase(node.keys.begin() + i);
+      node.values.erase(node.values.begin() + i);
+      if (node.keys.empty()) {
+        Free(page);
+        page = 0u;
+      }
+      return true;
+    }
+    size_t const i = view->ChildIndex(key);
+    uint32_t child = view->children[i];
+    if (!Erase(child, key)) {
+      return false;
+    }
+    BTreeNode& node = Mutable(page);
+    if (child) {
+      node.children[i] = child;
+    } else {
+      node.children.erase(node.children.begin() + i);
+      node.keys.erase(node.keys.begin() + (i ? i - 1u : 0u));
+    }
+    if (node.children.size() == 1u) {
+      uint32_t const only_child = node.children.front();
+      Free(page);
+      page = only_child;
+    }
+    return true;
+  }
+
+  // Writes out the free list: what is left of the free pages, then the pages that this commit has freed, then the pages
+  // of the current free list that are written anew. Those of its pages that only hold what is left are kept, and the
+  // pages for the rest are taken from the free pages if there are enough of them. Returns the top page of the new list.
+  uint32_t WriteFreeList() {
+    std::vector<uint32_t> pages;
+    std::vector<uint32_t> spare;
+    size_t keep = 0u;
+    size_t n = 0u;  // How many entries go into `pages`.
+    auto const update = [&]() {
+      keep = free_list_aligned_ ? std::min(free_.size() / kBTreeFreeListPerPage, free_list_pages_.size()) : 0u;
+      n = free_.size() - keep * kBTreeFreeListPerPage + freed_.size() + (free_list_pages_.size() - keep) +
+          spare.size();
+    };
+    for (update(); pages.size() * kBTreeFreeListPerPage < n; update()) {
+      if (!free_.empty()) {
+        pages.push_back(free_.back());
+        free_.pop_back();
+      } else {
+        pages.push_back(page_count_++);
+      }
+    }
+    // All the pages but the top one must be full, so the ones taken that are not needed are listed as free instead.
+    for (; !pages.empty() && n < (pages.size() - 1u) * kBTreeFreeListPerPage; update()) {
+      spare.push_back(pages.back());
+      pages.pop_back();
+    }
+    std::vector<uint32_t> free = std::move(free_);
+    free.insert(free.end(), freed_.begin(), freed_.end());
+    free.insert(free.end(), free_list_pages_.begin() + keep, free_list_pages_.end());
+    free.insert(free.end(), spare.begin(), spare.end());
+    free_list_pages_.resize(keep);
+    for (uint32_t const id : pages) {
+      size_t const begin = free_list_pages_.size() * kBTreeFreeListPerPage;
+      size_t const count = std::min(kBTreeFreeListPerPage, free.size() - begin);
+      std::string page;
+      page += kBTreePageFreeList;
+      Put(page, free_list_pages_.empty() ? 0u : free_list_pages_.back());
+      Put(page, static_cast<uint32_t>(count));
+      page.append(reinterpret_cast<char const*>(free.data() + begin), count * sizeof(uint32_t));
+      page.resize(kBTreePageSize, '\0');
+      WritePage(id, page);
+      free_list_pages_.push_back(id);
+    }
+    free_list_aligned_ = true;
+    free_ = std::move(free);
+    return free_list_pages_.empty() ? 0u : free_list_pages_.back();
+  }
+
+  void ReadFreeList() {
+    // From the top of the stack down.
+    std::vector<std::vector<uint32_t>> chunks;
+    std::string scratch;
+    for (uint32_t page = meta_.free_list; page;) {
+      free_list_pages_.push_back(page);
+      char const* p = PageData(page, scratch) + 1u;
+      page = Get<uint32_t>(p);
+      uint32_t const n = Get<uint32_t>(p);
+      std::vector<uint32_t>& chunk = chunks.emplace_back();
+      for (uint32_t i = 0u; i < n; ++i) {
+        chunk.push_back(Get<uint32_t>(p));
+      }
+    }
+    std::reverse(free_list_pages_.begin(), free_list_pages_.end());
+    for (size_t i = chunks.size(); i--;) {
+      if (i && chunks[i].size() != kBTreeFreeListPerPage) {
+        free_list_aligned_ = false;
+      }
+      free_.insert(free_.end(), chunks[i].begin(), chunks[i].end());
+    }
+  }
+
+  void Sync() {
+    if (options_.fsync_every_write && ::fdatasync(fd_)) {
+      FatalBTreeError("fdatasync", file_path_);
+    }
+  }
+
+  void Open() {
+    fd_ = ::open(file_path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0) {
+      FatalBTreeError("open", file_path_);
+    }
+    struct stat st;
+    if (::fstat(fd_, &st)) {
+      FatalBTreeError("fstat", file_path_);
+    }
+    if (st.st_size == 0) {
+      WritePage(0u, meta_.Serialize());
+      WritePage(1u, std::string(kBTreePageSize, '\0'));
+      Sync();
+    }
+    Remap();
+    bool found = false;
+    for (uint32_t i = 0u; i < kBTreeMetaPages; ++i) {
+      std::string scratch;
+      BTreeMeta meta;
+      if (meta.Deserialize(PageData(i, scratch)) && (!found || meta.generation > meta_.generation)) {
+        meta_ = meta;
+        found = true;
+      }
+    }
+    if (!found) {
+      std::cerr << "FATAL: No valid meta page in '" << file_path_ << "'." << std::endl;
+      ::abort();
+    }
+    page_count_ = meta_.page_count;
+    ReadFreeList();
+  }
+
+  // Writes the commits as the leader: all of them, in order, into one new tree, which then replaces the current one.
+  void WriteAsLeader(std::vector<std::vector<C5T_STORAGE_WRITE> const*> const& commits) {
+    std::lock_guard writer_lock(writer_mutex_);
+    // Only the leader changes `meta_`, so it can read it without `mutex_`.
+    BTreeMeta meta = meta_;
+    uint32_t root = meta.root;
+    for (auto const* writes : commits) {
+      for (auto const& w : *writes) {
+        std::string const key = w.field + '\0' + w.key;
+        if (Exists(w.value)) {
+          BTreeValue value = StoreValue(Value(w.value));
+          if (!root) {
+            root = Allocate();
+            dirty_[root] = std::make_shared<BTreeNode>();
+          }
+          auto const split = Insert(root, key, std::move(value));
+          if (Exists(split)) {
+            auto new_root = std::make_shared<BTreeNode>();
+            new_root->leaf = false;
+            new_root->keys.push_back(Value(split).first);
+            new_root->children = {root, Value(split).second};
+            root = Allocate();
+            dirty_[root] = std::move(new_root);
+          }
+        } else if (root) {
+          Erase(root, key);
+        }
+      }
+    }
+    for (auto const& [page, node] : dirty_) {
+      WritePage(page, node->Serialize(file_path_));
+    }
+    // What this commit has freed, and the pages of the previous free list written anew, can be reused from the next
+    // commit.
+    meta.free_list = WriteFreeList();
+    Sync();
+    ++meta.generation;
+    meta.root = root;
+    meta.page_count = page_count_;
+    WritePage(static_cast<uint32_t>(meta.generation % kBTreeMetaPages), meta.Serialize());
+    Sync();
+    dirty_.clear();
+    freed_.clear();
+    std::unique_lock lock(mutex_);
+    meta_ = meta;
+    Remap();
+  }
+
+  void Commit(std::vector<C5T_STORAGE_WRITE> const& writes) {
+    // Checked before the writes are queued, so that the other commits of the group do not fail along with this one.
+    for (auto const& w : writes) {
+      if (w.field.length() + 1u + w.key.length() > kBTreeMaxKeySize) {
+        throw StorageKeyTooLongException();
+      }
+    }
+    uint64_t const id = group_commit_.MutableUse([&writes](GroupCommit& g) {
+      g.pending.push_back(&writes);
+      return ++g.last_enqueued;
+    });
+    while (true) {
+      using r_t = std::pair<bool, std::vector<std::vector<C5T_STORAGE_WRITE> const*>>;
+      r_t r = group_commit_.Wait([id](GroupCommit const& g) { return g.last_done >= id || !g.leader_active; },
+                                 [id](GroupCommit& g) -> r_t {
+                                   if (g.last_done >= id) {
+                                     return {false, {}};
+                                   }
+                                   g.leader_active = true;
+                                   std::vector<std::vector<C5T_STORAGE_WRITE> const*> commits;
+                                   std::swap(commits, g.pending);
+                                   return {true, std::move(commits)};
+                                 });
+      if (!r.first) {
+        return;
+      }
+      WriteAsLeader(r.second);
+      group_commit_.MutableUse([n = r.second.size()](GroupCommit& g) {
+        g.last_done += n;
+        g.leader_active = false;
+      });
+    }
+  }
+
+  // Calls `f(key, node, index)` for the keys of the leaves within `[begin, end)`, in order, while it returns `true`.
+  template <class F>
+  bool Visit(uint32_t page, std::string const& begin, std::string const& end, F&& f) {
+    auto const node = LoadNode(page);
+    if (node->leaf) {
+      for (auto it = std::lower_bound(node->keys.begin(), node->keys.end(), begin);
+           it != node->keys.end() && *it < end;
+           ++it) {
+        if (!f(*it, node->values[static_cast<size_t>(it - node->keys.begin())])) {
+          return false;
+        }
+      }
+      return true;
+    }
+    for (size_t i = node->ChildIndex(begin); i < node->children.size() && (i == 0u || node->keys[i - 1u] < end); ++i) {
+      if (!Visit(node->children[i], begin, end, f)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // The range of the composite keys of `field` that correspond to the keys within `[begin, end)`.
+  static std::pair<std::string, std::string> FieldRange(std::string const& field,
+                                                        std::string const& begin,
+                                                        std::string const& end) {
+    return {field + '\0' + begin, end.empty() ? field + '\1' : field + '\0' + end};
+  }
+
+ public:
+  C5T_STORAGE_BTreeInstance(std::string path,
+                            C5T_STORAGE_OPTIONS const& options,
+                            std::string const& file_name = kBTreeFileName,
+                            bool registered = true)
+      : C5T_STORAGE_Instance(std::move(path), options.cache_limits, registered),
+        options_(options),
+        file_path_(current::FileSystem::JoinPath(path_, file_name)) {
+    Open();
+  }
+
+  ~C5T_STORAGE_BTreeInstance() override {
+    if (map_) {
+      ::munmap(const_cast<char*>(map_), map_size_);
+    }
+    if (!options_.fsync_every_write) {
+      ::fdatasync(fd_);
+    }
+    ::close(fd_);
+  }
+
+  void DoSave(std::string const& field, std::string const& key, std::string const& value) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoSave(" << path_ << ", " << field << ", " << key << ", " << value << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    Commit({C5T_STORAGE_WRITE{field, key, value}});
+  }
+
+  Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoLoad(" << path_ << ", " << field << ", " << key << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    std::string const composite = field + '\0' + key;
+    std::shared_lock lock(mutex_);
+    uint32_t page = meta_.root;
+    while (page) {
+      auto const node = LoadNode(page);
+      if (!node->leaf) {
+        page = node->children[node->ChildIndex(composite)];
+        continue;
+      }
+      auto const it = std::lower_bound(node->keys.begin(), node->keys.end(), composite);
+      if (it != node->keys.end() && *it == composite) {
+        return LoadValue(node->values[static_cast<size_t>(it - node->keys.begin())]);
+      }
+      break;
+    }
+    return nullptr;
+  }
+
+  void DoDelete(std::string const& field, std::string const& key) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoDelete(" << path_ << ", " << field << ", " << key << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    Commit({C5T_STORAGE_WRITE{field, key, nullptr}});
+  }
+
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    auto const [begin, end] = FieldRange(field, "", "");
+    std::vector<std::string> keys;
+    {
+      std::shared_lock lock(mutex_);
+      if (meta_.root) {
+        Visit(meta_.root, begin, end, [&](std::string const& composite, BTreeValue const&) {
+          keys.push_back(composite.substr(field.length() + 1u));
+          return true;
+        });
+      }
+    }
+    for (std::string const& key : keys) {
+      f(key);
+    }
+  }
+
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    auto const range = FieldRange(field, begin, end);
+    std::vector<std::pair<std::string, std::string>> page;
+    {
+      std::shared_lock lock(mutex_);
+      if (meta_.root && limit) {
+        Visit(meta_.root, range.first, range.second, [&](std::string const& composite, BTreeValue const& v) {
+          page.emplace_back(composite.substr(field.length() + 1u), LoadValue(v));
+          return page.size() < limit;
+        });
+      }
+    }
+    // Outside the lock, since `f` is the user code.
+    for (auto const& [key, value] : page) {
+      f(key, value);
+    }
+  }
+
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override {
+    if (!writes.empty()) {
+      Commit(writes);
+    }
+  }
+
+  // NOTE: Nothing to do: the pages are reused via the free list as they are freed.
+  void DoCompact() override {}
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats = C5T_STORAGE_Instance::DoGetStats();
+    std::lock_guard writer_lock(writer_mutex_);
+    stats.btree_pages = meta_.page_count;
+    stats.btree_free_pages = free_.size();
+    return stats;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateBTreeStorageInstance(std::string const& path,
+                                                                  C5T_STORAGE_OPTIONS const& options) {
+  return std::make_unique<C5T_STORAGE_BTreeInstance>(path, options);
+}
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateBTreeIndexInstance(std::string const& path, std::string const& file_name) {
+  return std::make_unique<C5T_STORAGE_BTreeInstance>(path, C5T_STORAGE_OPTIONS(), file_name, false);
+}
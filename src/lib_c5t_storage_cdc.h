@@ -0,0 +1,77 @@
+#pragma once
+
+// Change data capture: the committed `Set`-s and `Del`-s of a storage field, published into an actor model topic.
+//
+// Usage:
+//   auto const topic = Topic<C5T_STORAGE_CHANGES<SomeJSON>>("kv2");
+//   auto const cdc_scope = C5T_STORAGE_PUBLISH_CHANGES(kv2, topic);
+//   auto const subscriber_scope = C5T_SUBSCRIBE<Worker>(topic, ...);
+//
+// Each event is a batch: all the changes that a transaction has made to the field, in the order they were made,
+// or the single change of a `Set` or `Del` made outside a transaction. A transaction that spans several fields
+// results in one event per field. What is rolled back is not published.
+//
+// The changes carry the values before and after, as they are in memory, so publishing them costs no serialization.
+// The value before is loaded if it is not in memory, so publishing the changes makes the writes read first.
+//
+// Published as long as the returned scope is alive, regardless of which storage instance is active.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "lib_c5t_actor_model.h"
+#include "lib_c5t_storage.h"
+
+template <class T>
+struct C5T_STORAGE_CHANGES final : crnt::CurrentSuper {
+  std::string field;
+  std::vector<C5T_STORAGE_CHANGE<T>> changes;
+};
+
+template <class T>
+class C5T_STORAGE_CHANGES_PUBLISHER_SCOPE final {
+ private:
+  C5T_STORAGE_FIELD<T>* field_;
+  uint64_t id_;
+
+ public:
+  C5T_STORAGE_CHANGES_PUBLISHER_SCOPE(C5T_STORAGE_FIELD<T>& field,
+                                      std::string name,
+                                      TopicKey<C5T_STORAGE_CHANGES<T>> topic)
+      : field_(&field),
+        id_(field.AddChangesListener(
+            [name = std::move(name), tid = topic.GetTopicID()](std::vector<C5T_STORAGE_CHANGE<T>> const& changes) {
+              auto e = std::make_shared<C5T_STORAGE_CHANGES<T>>();
+              e->field = name;
+              e->changes = changes;
+              InternalEmitEventTo<C5T_STORAGE_CHANGES<T>>(tid, std::move(e));
+            })) {}
+
+  C5T_STORAGE_CHANGES_PUBLISHER_SCOPE(C5T_STORAGE_CHANGES_PUBLISHER_SCOPE const&) = delete;
+  C5T_STORAGE_CHANGES_PUBLISHER_SCOPE& operator=(C5T_STORAGE_CHANGES_PUBLISHER_SCOPE const&) = delete;
+
+  C5T_STORAGE_CHANGES_PUBLISHER_SCOPE(C5T_STORAGE_CHANGES_PUBLISHER_SCOPE&& rhs)
+      : field_(rhs.field_), id_(rhs.id_) {
+    rhs.field_ = nullptr;
+  }
+
+  ~C5T_STORAGE_CHANGES_PUBLISHER_SCOPE() {
+    if (field_) {
+      field_->RemoveChangesListener(id_);
+    }
+  }
+};
+
+// Throws `StorageFieldDeclaredAndNotDefinedException` if the field is not defined.
+template <class T>
+[[nodiscard]] C5T_STORAGE_CHANGES_PUBLISHER_SCOPE<T> C5T_STORAGE_PUBLISH_CHANGES_Impl(
+    std::string const& name, TopicKey<C5T_STORAGE_CHANGES<T>> topic) {
+  C5T_STORAGE_FIELD<T>* field = C5T_STORAGE_FIND_FIELD<T>(name);
+  if (!field) {
+    throw StorageFieldDeclaredAndNotDefinedException();
+  }
+  return C5T_STORAGE_CHANGES_PUBLISHER_SCOPE<T>(*field, name, topic);
+}
+
+#define C5T_STORAGE_PUBLISH_CHANGES(name, topic) C5T_STORAGE_PUBLISH_CHANGES_Impl<C5T_STORAGE_TYPE_##name>(#name, topic)
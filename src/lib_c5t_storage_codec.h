@@ -0,0 +1,280 @@
+#pragma once
+
+// The encodings of the values of the storage fields, chosen per field with `C5T_STORAGE_DEFINE_FIELD_WITH_CODEC()`.
+// Must be included where the fields are defined, since this is where the `JSON` and the binary serialization is.
+//
+// JSON is the default, and it is the only encoding with no header: this is how the values have always been stored,
+// and this keeps the files of the file-per-key backend human-readable. The other encodings start with a two-byte
+// header, `kStorageCodecHeaderV1` and the ID of the codec, and no JSON value can start with this first byte.
+//
+// The values are decoded per their header, not per the codec the field is defined with. Thus the codec of a field
+// can be changed with no migration: the values stored before keep loading, and are re-encoded as they are updated.
+//
+// The views, `C5T_STORAGE_VIEW`, are here too, as they decode the members of the values one by one.
+
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <type_traits>
+
+#include "typesystem/serialization/binary.h"
+#include "typesystem/serialization/json.h"
+
+#include "lib_c5t_storage.h"
+
+enum class C5T_STORAGE_CODEC : char {
+  JSON = 'J',    // `JSON<JSONFormat::Minimalistic>`, the default.
+  Binary = 'B',  // The binary serialization of Current, for `CURRENT_STRUCT`-s and anything else it supports.
+  Raw = 'R',     // The bytes as is, for `std::string` and for the trivially copyable types, such as `int32_t`.
+};
+
+// The first byte of the header; will be a different one if the header is to ever change.
+constexpr static char kStorageCodecHeaderV1 = '\x01';
+constexpr static size_t kStorageCodecHeaderSize = 2u;
+
+template <class T>
+constexpr static bool kStorageCodecRawSupported = std::is_same_v<T, std::string> || std::is_trivially_copyable_v<T>;
+
+template <C5T_STORAGE_CODEC CODEC, class T>
+std::string C5T_STORAGE_ENCODE(T const& value) {
+  if constexpr (CODEC == C5T_STORAGE_CODEC::JSON) {
+    return JSON<JSONFormat::Minimalistic>(value);
+  } else {
+    std::string result{kStorageCodecHeaderV1, static_cast<char>(CODEC)};
+    if constexpr (CODEC == C5T_STORAGE_CODEC::Binary) {
+      std::ostringstream os;
+      SaveIntoBinary(os, value);
+      result += os.str();
+    } else {
+      static_assert(kStorageCodecRawSupported<T>, "The `Raw` codec is for strings and trivially copyable types.");
+      if constexpr (std::is_same_v<T, std::string>) {
+        result += value;
+      } else {
+        result.append(reinterpret_cast<char const*>(&value), sizeof(T));
+      }
+    }
+    return result;
+  }
+}
+
+// Returns `false` if `s` is not a valid encoding of `T` with any of the codecs.
+template <class T>
+bool C5T_STORAGE_DECODE(std::string const& s, T& value) {
+  try {
+    if (s.length() < kStorageCodecHeaderSize || s[0] != kStorageCodecHeaderV1) {
+      ParseJSON<T, JSONFormat::Minimalistic>(s, value);
+      return true;
+    }
+    C5T_STORAGE_CODEC const codec = static_cast<C5T_STORAGE_CODEC>(s[1]);
+    if (codec == C5T_STORAGE_CODEC::Binary) {
+      std::istringstream is(s.substr(kStorageCodecHeaderSize));
+      value = LoadFromBinary<T>(is);
+      return true;
+    } else if (codec == C5T_STORAGE_CODEC::Raw) {
+      if constexpr (std::is_same_v<T, std::string>) {
+        value = s.substr(kStorageCodecHeaderSize);
+        return true;
+      } else if constexpr (kStorageCodecRawSupported<T>) {
+        if (s.length() == kStorageCodecHeaderSize + sizeof(T)) {
+          std::memcpy(&value, s.data() + kStorageCodecHeaderSize, sizeof(T));
+          return true;
+        }
+      }
+    }
+    return false;
+  } catch (current::Exception const&) {
+    return false;
+  }
+}
+
+// Finds the value of the member `name` of the JSON object `json`, skipping over the other members without parsing
+// them. Returns `false` if `json` is not an object. Otherwise sets `[begin, end)` to the JSON of the value of the
+// member, or both to `std::string::npos` if there is no such member, as is the case for the null `Optional`-s.
+inline bool C5T_STORAGE_FIND_JSON_MEMBER(std::string const& json, char const* name, size_t& begin, size_t& end) {
+  size_t const n = json.length();
+  size_t i = 0u;
+  auto const skip_whitespace = [&]() {
+    while (i < n && (json[i] == ' ' || json[i] == '\t' || json[i] == '\n' || json[i] == '\r')) {
+      ++i;
+    }
+  };
+  // Past the closing quote, with `i` at the opening one. Returns `false` if there is no closing quote.
+  auto const skip_string = [&]() {
+    for (++i; i < n; ++i) {
+      if (json[i] == '\\') {
+        ++i;
+      } else if (json[i] == '"') {
+        ++i;
+        return true;
+      }
+    }
+    return false;
+  };
+  auto const skip_value = [&]() {
+    if (i < n && json[i] == '"') {
+      return skip_string();
+    }
+    size_t depth = 0u;
+    while (i < n) {
+      char const c = json[i];
+      if (c == '"') {
+        if (!skip_string()) {
+          return false;
+        }
+        continue;
+      } else if (c == '{' || c == '[') {
+        ++depth;
+      } else if (c == '}' || c == ']') {
+        if (!depth) {
+          return true;
+        }
+        if (!--depth) {
+          ++i;
+          return true;
+        }
+      } else if (c == ',' && !depth) {
+        return true;
+      }
+      ++i;
+    }
+    return !depth;
+  };
+  skip_whitespace();
+  if (i == n || json[i] != '{') {
+    return false;
+  }
+  ++i;
+  size_t const name_length = std::strlen(name);
+  while (true) {
+    skip_whitespace();
+    if (i < n && json[i] == '}') {
+      begin = end = std::string::npos;
+      return true;
+    }
+    if (i == n || json[i] != '"') {
+      return false;
+    }
+    size_t const key_begin = i + 1u;
+    if (!skip_string()) {
+      return false;
+    }
+    bool const match = i - key_begin - 1u == name_length && !json.compare(key_begin, name_length, name);
+    skip_whitespace();
+    if (i == n || json[i] != ':') {
+      return false;
+    }
+    ++i;
+    skip_whitespace();
+    size_t const value_begin = i;
+    if (!skip_value()) {
+      return false;
+    }
+    size_t value_end = i;
+    while (value_end > value_begin && (json[value_end - 1u] == ' ' || json[value_end - 1u] == '\t' ||
+                                       json[value_end - 1u] == '\n' || json[value_end - 1u] == '\r')) {
+      --value_end;
+    }
+    if (match) {
+      begin = value_begin;
+      end = value_end;
+      return true;
+    }
+    skip_whitespace();
+    if (i < n && json[i] == ',') {
+      ++i;
+    } else if (i == n || json[i] != '}') {
+      return false;
+    }
+  }
+}
+
+template <class T>
+struct C5T_STORAGE_IS_OPTIONAL : std::false_type {};
+template <class T>
+struct C5T_STORAGE_IS_OPTIONAL<Optional<T>> : std::true_type {};
+
+// A value of a storage field, as returned by `C5T_STORAGE(name).View(key)`, for the large values of which only a few
+// members are read. The members are read with `C5T_STORAGE_VIEW_GET(view, member)`, and are decoded one at a time:
+// of the values stored as JSON, only the JSON of the member read is parsed, while the values of the other codecs are
+// decoded as a whole on the first read. If the value is in memory decoded already, the view reads it, and decodes
+// nothing. False if the key does not exist. A value that can not be decoded reads as if it does not exist, as it does
+// with `Has()` and `Get()`. The view is made before the value is decoded, so it is still true, but its reads throw
+// `StorageKeyNotFoundException`. Only the JSON members read before the value is found not to decode, and that are
+// valid by themselves, are read, as they are not checked against the rest. Like a cursor, a view is to be used from
+// one thread. Usage:
+//   auto const view = C5T_STORAGE(kv).View("key");
+//   if (view) { ... C5T_STORAGE_VIEW_GET(view, foo) ... }
+template <class T>
+class C5T_STORAGE_VIEW final {
+ public:
+  using value_type = T;
+
+ private:
+  C5T_STORAGE_FIELD_Interface const* self_;
+  mutable std::shared_ptr<T const> value_;
+  std::shared_ptr<std::string const> raw_;
+  // Set once `raw_` has failed to decode, so that the members are not read from it since.
+  mutable bool undecodable_ = false;
+
+ public:
+  C5T_STORAGE_VIEW(C5T_STORAGE_FIELD_Interface const& self,
+                   std::shared_ptr<T const> value,
+                   std::shared_ptr<std::string const> raw)
+      : self_(&self), value_(std::move(value)), raw_(value_ ? nullptr : std::move(raw)) {}
+
+  explicit operator bool() const { return value_ || raw_; }
+
+  // Decodes the value as a whole, once. Throws `StorageKeyNotFoundException` if the key does not exist, or if what is
+  // stored can not be decoded.
+  T const& Decode() const {
+    if (!value_) {
+      if (!raw_) {
+        throw StorageKeyNotFoundException();
+      }
+      auto instance = std::make_shared<T>();
+      bool decoded = false;
+      try {
+        decoded = self_->DoDeserializeImpl(*raw_, instance.get());
+      } catch (current::Exception const&) {
+      }
+      if (!decoded) {
+        undecodable_ = true;
+        throw StorageKeyNotFoundException();
+      }
+      value_ = std::move(instance);
+    }
+    return *value_;
+  }
+
+  // Use `C5T_STORAGE_VIEW_GET()`. `get` returns the member `name` of the value once it is decoded as a whole.
+  template <class M, class F>
+  M Member(char const* name, F&& get) const {
+    if (!value_ && raw_ && !undecodable_ &&
+        (raw_->length() < kStorageCodecHeaderSize || (*raw_)[0] != kStorageCodecHeaderV1)) {
+      size_t begin;
+      size_t end;
+      if (C5T_STORAGE_FIND_JSON_MEMBER(*raw_, name, begin, end)) {
+        if (begin == std::string::npos) {
+          if constexpr (C5T_STORAGE_IS_OPTIONAL<M>::value) {
+            return nullptr;
+          }
+        } else {
+          try {
+            M member;
+            ParseJSON<M, JSONFormat::Minimalistic>(raw_->substr(begin, end - begin), member);
+            return member;
+          } catch (current::Exception const&) {
+            // Then as the value is decoded as a whole, which fails the same way if the value is not valid.
+          }
+        }
+      }
+    }
+    return get(Decode());
+  }
+};
+
+// The member `member` of the value of the `C5T_STORAGE_VIEW` `view`, by value. Only this member is decoded if it can.
+#define C5T_STORAGE_VIEW_GET(view, member)                                                                    \
+  (view).template Member<decltype(std::declval<typename std::decay_t<decltype(view)>::value_type>().member)>( \
+      #member, [](auto const& value) { return value.member; })
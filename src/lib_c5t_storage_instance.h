@@ -0,0 +1,140 @@
+#pragma once
+
+// The part of the storage instance that is the same for all the backends, and the factories of those backends.
+// Internal, only to be used from the `lib_c5t_storage*.cc` files.
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include "lib_c5t_storage.h"
+
+// The instance that `C5T_STORAGE_INSTANCE()` returns. At most one at a time, the second one is a fatal error.
+void RegisterStorageInstance(C5T_STORAGE_Interface* instance);
+void UnregisterStorageInstance(C5T_STORAGE_Interface* instance);
+// For the decorators, such as write-behind, that wrap an already registered instance.
+void ReplaceRegisteredStorageInstance(C5T_STORAGE_Interface* from, C5T_STORAGE_Interface* to);
+
+class C5T_STORAGE_Instance : public C5T_STORAGE_Interface {
+ protected:
+  std::string const path_;
+  C5T_STORAGE_CACHE_LIMITS const cache_limits_;
+  uint64_t const instance_id_;
+  // Whether this is the instance that `C5T_STORAGE_INSTANCE()` returns, and not an internal one of another backend.
+  bool const registered_;
+
+ private:
+  // Of type `C5T_FIELD_INTERFACE<T>*` of respective `T`-s.
+  std::map<std::string, C5T_STORAGE_FIELD_Interface*> field_inner_impls_;
+
+  // Used to `.clear()` all the containers and force-re-load as changing active storages.
+  std::map<C5T_STORAGE_FIELD_Interface const*, bool> initialized_;
+  std::mutex initialized_mutex_;
+
+ public:
+  C5T_STORAGE_Instance(std::string path, C5T_STORAGE_CACHE_LIMITS const& cache_limits, bool registered = true);
+  ~C5T_STORAGE_Instance() override;
+
+  size_t FieldsCount() const override { return field_inner_impls_.size(); }
+  C5T_STORAGE_CACHE_LIMITS CacheLimits() const override { return cache_limits_; }
+  uint64_t InstanceID() const override { return instance_id_; }
+
+  void ListFields(std::function<void(std::string const&)> cb) override {
+    for (auto const& [k, _] : field_inner_impls_) {
+      cb(k);
+    }
+  }
+
+  bool NeedToStartFresh(C5T_STORAGE_FIELD_Interface const& field) override {
+    std::lock_guard lock(initialized_mutex_);
+    bool& b = initialized_[&field];
+    if (!b) {
+      b = true;
+      return true;
+    } else {
+      return false;
+    }
+  }
+
+  C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const& name) override {
+    auto const cit = field_inner_impls_.find(name);
+    return cit != std::end(field_inner_impls_) ? cit->second : nullptr;
+  }
+
+  // Implemented by the decorator of `lib_c5t_storage_backup.cc`, which every backend is wrapped into.
+  uint64_t DoExport(uint64_t, std::function<void(std::string const&)>) override {
+    throw StorageInternalErrorException();
+  }
+  uint64_t DoImport(std::istream&) override { throw StorageInternalErrorException(); }
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats;
+    std::lock_guard lock(initialized_mutex_);
+    for (auto const& [name, field] : field_inner_impls_) {
+      // The fields not used since this instance was created may still hold what they have cached for another one.
+      auto const cit = initialized_.find(field);
+      C5T_STORAGE_CACHE_STATS const cache =
+          (cit != std::end(initialized_) && cit->second) ? field->CacheStats() : C5T_STORAGE_CACHE_STATS();
+      stats.cache += cache;
+      stats.cache_per_field[name] = cache;
+    }
+    return stats;
+  }
+};
+
+// The CRC32C (Castagnoli) of `size` bytes of `data`, continuing from `crc`, the checksum of the bytes before them.
+// With the SSE4.2 instructions if built with them, with a table-driven software implementation otherwise.
+uint32_t StorageCRC32C(char const* data, size_t size, uint32_t crc = 0u);
+
+// The binary encoding of the writes, shared by the log backend and by the transactions journal. In host byte order,
+// each write is `uint8_t op` ('S' or 'D'), three `uint32_t` lengths of the field, key, and value, the `uint32_t`
+// CRC32C of the record but for these four bytes, and then the bytes of the field, the key, and the value. The 'B'
+// records have zero-length field and key, and the records of a multi-write commit as the value.
+constexpr static char kStorageRecordOpSet = 'S';
+constexpr static char kStorageRecordOpDel = 'D';
+constexpr static char kStorageRecordOpBatch = 'B';
+constexpr static size_t kStorageRecordHeaderSize = 1u + 4u * sizeof(uint32_t);
+// Where the checksum is in the header: after the op and the three lengths.
+constexpr static size_t kStorageRecordChecksumOffset = 1u + 3u * sizeof(uint32_t);
+
+// The checksum of the record that starts at `record`, with `payload_length` bytes of field, key, and value.
+uint32_t StorageRecordChecksum(char const* record, uint64_t payload_length);
+
+void AppendStorageRecord(std::string& out,
+                         char op,
+                         std::string const& field,
+                         std::string const& key,
+                         char const* value,
+                         uint32_t value_length);
+void AppendStorageRecord(std::string& out, C5T_STORAGE_WRITE const& w);
+
+// The 'B' record of the writes of a multi-write commit, to be applied all or none.
+void AppendStorageBatchRecord(std::string& out, std::vector<C5T_STORAGE_WRITE> const& writes);
+
+// Returns `false` if `data` is not a sequence of complete records with matching checksums, in which case `writes`
+// should be ignored.
+bool ParseStorageRecords(std::string const& data, std::vector<C5T_STORAGE_WRITE>& writes);
+
+// Defined in `lib_c5t_storage_log.cc`.
+std::unique_ptr<C5T_STORAGE_Interface> CreateLogStorageInstance(std::string const& path,
+                                                                C5T_STORAGE_OPTIONS const& options);
+
+// Defined in `lib_c5t_storage_btree.cc`.
+std::unique_ptr<C5T_STORAGE_Interface> CreateBTreeStorageInstance(std::string const& path,
+                                                                  C5T_STORAGE_OPTIONS const& options);
+// The same B+tree, in the file `file_name` under `path`, not registered, for the other backends to keep their ordered
+// metadata in, such as the keys of the fields of the `FilePerKey` one.
+std::unique_ptr<C5T_STORAGE_Interface> CreateBTreeIndexInstance(std::string const& path, std::string const& file_name);
+
+// Defined in `lib_c5t_storage_backup.cc`.
+std::unique_ptr<C5T_STORAGE_Interface> CreateBackupStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                   C5T_STORAGE_OPTIONS const& options);
+
+// Defined in `lib_c5t_storage_write_behind.cc`.
+std::unique_ptr<C5T_STORAGE_Interface> CreateWriteBehindStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                        C5T_STORAGE_OPTIONS const& options);
+
+// Defined in `lib_c5t_storage_ttl.cc`.
+std::unique_ptr<C5T_STORAGE_Interface> CreateTTLSweeperStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                       C5T_STORAGE_OPTIONS const& options);
@@ -0,0 +1,800 @@
+// The log-structured storage backend.
+//
+// Every `Set` and every `Del` is a single record appended to one file, so the write throughput is bounded by
+// the sequential disk bandwidth, not by creating and writing a file per update. The in-memory index maps each
+// live `field/key` onto where its latest value is in the log, so that a load is a single `pread()`.
+//
+// The log starts with `kLogFileMagic`, followed by the records. The record format, in host byte order, is that of
+// `AppendStorageRecord()`:
+//   uint8_t   op            'S' for set, 'D' for delete
+//   uint32_t  field_length
+//   uint32_t  key_length
+//   uint32_t  value_length  zero for deletes
+//   uint32_t  checksum      the CRC32C of the record but for these four bytes
+//   the bytes of the field, the key, and the value
+// A multi-write commit is one 'B' record, with zero-length field and key, and the records of the writes as its value.
+// Recovery only applies the 'B' record if all of it made it to disk, which is what makes such commits atomic.
+//
+// The commits are group-committed: while one thread, the leader, is writing and `fdatasync()`-ing, the commits from
+// other threads queue up, and the next leader writes all of them at once, with a single `fdatasync()`.
+//
+// On startup the log is scanned to rebuild the index. First the headers alone are walked, to split the log into
+// chunks, then the chunks are checksummed and indexed in parallel, and then their indexes are merged in order.
+// So the recovery of a large log is bound by reading it, not by one core. A record that can not be read in full,
+// or the last one if its checksum does not match, is the torn write of a crash, and is cut off along with what follows.
+// A record in the middle of the log that does not match its checksum is skipped, and reported, see `Logger()` and
+// `C5T_STORAGE_STATS::log_corrupt_records`. So is a header in the middle of the log that does not fit: if one flipped
+// bit of its lengths is why, the walk resumes after it, and otherwise from the next record that is framed and matches
+// its checksum. Only if there is none, or if the header is of a batch whose writes are framed up to the end of the log,
+// is it taken as the torn write, and cut off. The background thread compacts the log once enough of it is garbage:
+// the live records are copied into a new file, which then atomically replaces the log via `rename()`.
+
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "bricks/file/file.h"
+#include "bricks/sync/waitable_atomic.h"
+
+namespace {
+
+constexpr static char kLogFileName[] = "c5t_storage.log";
+constexpr static char kLogCompactingFileName[] = "c5t_storage.log.compacting";
+
+// The logs written before the records had checksums start with a record right away, so with 'S', 'D', or 'B'. They
+// are read in that format, and then compacted right away, which rewrites them in the current one.
+constexpr static char kLogFileMagic[] = "C5T_LOG2";
+constexpr static size_t kLogFileMagicSize = sizeof(kLogFileMagic) - 1u;
+
+constexpr static char kLogOpSet = kStorageRecordOpSet;
+constexpr static char kLogOpDel = kStorageRecordOpDel;
+constexpr static char kLogOpBatch = kStorageRecordOpBatch;
+constexpr static size_t kLogRecordHeaderSize = kStorageRecordHeaderSize;
+constexpr static size_t kLogLegacyRecordHeaderSize = 1u + 3u * sizeof(uint32_t);
+
+// Large enough for the sequential scans to not be bound by the number of syscalls.
+constexpr static size_t kLogReadBufferSize = 1u << 20;
+
+// The logs smaller than this are recovered by one thread, and the larger ones in chunks of at least this size.
+constexpr static uint64_t kLogRecoveryMinChunkSize = 4u << 20;
+
+struct LogRecordHeader final {
+  char op;
+  uint32_t field_length;
+  uint32_t key_length;
+  uint32_t value_length;
+  uint32_t checksum = 0u;
+  // Of a log written before the records had checksums: no `checksum`, and a shorter header.
+  bool legacy = false;
+
+  uint64_t HeaderSize() const { return legacy ? kLogLegacyRecordHeaderSize : kLogRecordHeaderSize; }
+  uint64_t PayloadSize() const { return static_cast<uint64_t>(field_length) + key_length + value_length; }
+  uint64_t RecordSize() const { return HeaderSize() + PayloadSize(); }
+};
+
+// Decodes the header at `p`, which must have `HeaderSize()` bytes.
+LogRecordHeader DecodeLogRecordHeader(char const* p, bool legacy) {
+  LogRecordHeader h;
+  h.op = p[0];
+  std::memcpy(&h.field_length, p + 1u, sizeof(uint32_t));
+  std::memcpy(&h.key_length, p + 1u + sizeof(uint32_t), sizeof(uint32_t));
+  std::memcpy(&h.value_length, p + 1u + 2u * sizeof(uint32_t), sizeof(uint32_t));
+  if (!legacy) {
+    std::memcpy(&h.checksum, p + kStorageRecordChecksumOffset, sizeof(uint32_t));
+  }
+  h.legacy = legacy;
+  return h;
+}
+
+bool IsLogOp(char op) { return op == kLogOpSet || op == kLogOpDel || op == kLogOpBatch; }
+
+[[noreturn]] void FatalLogError(char const* what, std::string const& path) {
+  std::cerr << "FATAL: Storage log " << what << " failed for '" << path << "': " << std::strerror(errno) << std::endl;
+  ::abort();
+}
+
+void WriteAllOrDie(int fd, char const* data, size_t size, std::string const& path) {
+  while (size) {
+    ssize_t const n = ::write(fd, data, size);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      FatalLogError("write", path);
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+  }
+}
+
+void ReadAllOrDie(int fd, char* data, size_t size, uint64_t offset, std::string const& path) {
+  while (size) {
+    ssize_t const n = ::pread(fd, data, size, static_cast<off_t>(offset));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      FatalLogError("read", path);
+    }
+    data += n;
+    size -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+}
+
+// Reads the records of the log sequentially, through a buffer.
+class LogScanner final {
+ private:
+  int const fd_;
+  uint64_t offset_;
+  uint64_t const end_;
+  bool const legacy_;
+  std::string buffer_;
+  size_t buffer_begin_ = 0u;
+
+  // Makes sure `n` bytes are available in the buffer. Returns `false` if the log ends before that.
+  bool Ensure(size_t n) {
+    size_t const available = buffer_.length() - buffer_begin_;
+    if (available >= n) {
+      return true;
+    }
+    buffer_.erase(0u, buffer_begin_);
+    buffer_begin_ = 0u;
+    uint64_t const file_offset = offset_ + buffer_.length();
+    size_t const want = static_cast<size_t>(std::min<uint64_t>(std::max(n, kLogReadBufferSize), end_ - file_offset));
+    if (buffer_.length() + want < n) {
+      return false;
+    }
+    size_t const old_length = buffer_.length();
+    buffer_.resize(old_length + want);
+    size_t done = 0u;
+    while (done < want) {
+      ssize_t const r = ::pread(fd_, &buffer_[old_length + done], want - done, static_cast<off_t>(file_offset + done));
+      if (r <= 0) {
+        if (r < 0 && errno == EINTR) {
+          continue;
+        }
+        buffer_.resize(old_length + done);
+        return buffer_.length() >= n;
+      }
+      done += static_cast<size_t>(r);
+    }
+    return true;
+  }
+
+ public:
+  LogScanner(int fd, uint64_t begin, uint64_t end, bool legacy = false)
+      : fd_(fd), offset_(begin), end_(end), legacy_(legacy) {}
+
+  // The offset of the record to be read next, which is also the end of the last complete record read.
+  uint64_t Offset() const { return offset_; }
+
+  // Calls `f(header, field, key, value)` on the next record. Returns `false` at the end, or on a torn record.
+  template <class F>
+  bool Next(F&& f) {
+    size_t const header_size = legacy_ ? kLogLegacyRecordHeaderSize : kLogRecordHeaderSize;
+    if (!Ensure(header_size)) {
+      return false;
+    }
+    LogRecordHeader const h = DecodeLogRecordHeader(buffer_.data() + buffer_begin_, legacy_);
+    if (!IsLogOp(h.op) || h.RecordSize() > end_ - offset_ || !Ensure(static_cast<size_t>(h.RecordSize()))) {
+      return false;
+    }
+    char const* p = buffer_.data() + buffer_begin_;
+    if (!legacy_ && StorageRecordChecksum(p, h.PayloadSize()) != h.checksum) {
+      return false;
+    }
+    if (h.op == kLogOpBatch) {
+      // The whole batch is there, so its writes are read as if they were standalone records.
+      buffer_begin_ += header_size;
+      offset_ += header_size;
+      return h.value_length == 0u || Next(std::forward<F>(f));
+    }
+    p += header_size;
+    std::string field(p, h.field_length);
+    std::string key(p + h.field_length, h.key_length);
+    f(h, std::move(field), std::move(key), p + h.field_length + h.key_length);
+    buffer_begin_ += static_cast<size_t>(h.RecordSize());
+    offset_ += h.RecordSize();
+    return true;
+  }
+};
+
+class C5T_STORAGE_LogInstance final : public C5T_STORAGE_Instance {
+ private:
+  struct ValueLocation final {
+    uint64_t value_offset;
+    uint32_t value_length;
+    uint64_t record_size;
+  };
+  // The keys of each field are ordered, for `DoScan()`.
+  using index_t = std::unordered_map<std::string, std::map<std::string, ValueLocation>>;
+
+  // What the recovery learns from its chunk of the log: the last write of each key, and the records it skipped.
+  struct RecoveredWrite final {
+    bool set;
+    ValueLocation location;
+  };
+  struct RecoveredChunk final {
+    std::unordered_map<std::string, std::unordered_map<std::string, RecoveredWrite>> writes;
+    uint64_t records = 0u;
+    // The offsets and the sizes of the records that do not match their checksums.
+    std::vector<std::pair<uint64_t, uint64_t>> corrupt;
+  };
+
+  C5T_STORAGE_OPTIONS const options_;
+  std::string const log_path_;
+  std::string const compacting_path_;
+
+  // Guards everything below. Compactions are serialized by `compaction_mutex_`, which is taken first.
+  std::mutex mutex_;
+  std::mutex compaction_mutex_;
+  int fd_ = -1;
+  uint64_t end_ = 0u;
+  uint64_t live_bytes_ = 0u;
+  index_t index_;
+
+  // The commits waiting to be written by the leader, who is the first of the committers to find no leader active.
+  struct GroupCommit final {
+    std::vector<std::vector<C5T_STORAGE_WRITE> const*> pending;
+    uint64_t last_enqueued = 0u;
+    uint64_t last_done = 0u;
+    bool leader_active = false;
+  };
+  current::WaitableAtomic<GroupCommit> group_commit_;
+
+  current::WaitableAtomic<bool> terminating_;
+  std::thread compaction_thread_;
+
+  // As of when the log was opened.
+  uint64_t recovered_records_ = 0u;
+  uint64_t corrupt_records_ = 0u;
+  uint64_t truncated_bytes_ = 0u;
+
+  static LogRecordHeader HeaderOf(C5T_STORAGE_WRITE const& w) {
+    return LogRecordHeader{Exists(w.value) ? kLogOpSet : kLogOpDel,
+                           static_cast<uint32_t>(w.field.length()),
+                           static_cast<uint32_t>(w.key.length()),
+                           static_cast<uint32_t>(Exists(w.value) ? Value(w.value).length() : 0u)};
+  }
+
+  static void ApplyToIndex(index_t& index,
+                           uint64_t& live_bytes,
+                           uint64_t record_offset,
+                           LogRecordHeader const& h,
+                           std::string field,
+                           std::string key) {
+    auto& per_field = index[field];
+    auto it = per_field.find(key);
+    if (it != std::end(per_field)) {
+      live_bytes -= it->second.record_size;
+    }
+    if (h.op == kLogOpSet) {
+      ValueLocation const location{record_offset + h.HeaderSize() + h.field_length + h.key_length,
+                                   h.value_length,
+                                   h.RecordSize()};
+      if (it != std::end(per_field)) {
+        it->second = location;
+      } else {
+        per_field.emplace(std::move(key), location);
+      }
+      live_bytes += h.RecordSize();
+    } else if (it != std::end(per_field)) {
+      per_field.erase(it);
+    }
+  }
+
+  // Indexes the records within `[begin, end)` of the log mapped at `data`, which the caller has checked to be framed.
+  static void RecoverChunk(char const* data, uint64_t begin, uint64_t end, RecoveredChunk& chunk) {
+    auto const apply = [&chunk, data](uint64_t offset, LogRecordHeader const& h) {
+      char const* p = data + offset + kLogRecordHeaderSize;
+      RecoveredWrite& w = chunk.writes[std::string(p, h.field_length)][std::string(p + h.field_length, h.key_length)];
+      w.set = h.op == kLogOpSet;
+      w.location = ValueLocation{offset + kLogRecordHeaderSize + h.field_length + h.key_length,
+                                 h.value_length,
+                                 h.RecordSize()};
+      ++chunk.records;
+    };
+    // Calls `f(offset, header)` for each write of the batch record at `offset`, or returns `false` if not framed.
+    auto const batch = [data](uint64_t offset, LogRecordHeader const& h, auto&& f) {
+      uint64_t const end = offset + h.RecordSize();
+      for (uint64_t i = offset + kLogRecordHeaderSize; i < end;) {
+        if (end - i < kLogRecordHeaderSize) {
+          return false;
+        }
+        LogRecordHeader const w = DecodeLogRecordHeader(data + i, false);
+        if ((w.op != kLogOpSet && w.op != kLogOpDel) || w.RecordSize() > end - i) {
+          return false;
+        }
+        f(i, w);
+        i += w.RecordSize();
+      }
+      return true;
+    };
+    for (uint64_t offset = begin; offset < end;) {
+      LogRecordHeader const h = DecodeLogRecordHeader(data + offset, false);
+      if (StorageRecordChecksum(data + offset, h.PayloadSize()) != h.checksum) {
+        chunk.corrupt.emplace_back(offset, h.RecordSize());
+      } else if (h.op != kLogOpBatch) {
+        apply(offset, h);
+      } else if (batch(offset, h, [](uint64_t, LogRecordHeader const&) {})) {
+        // NOTE: The writes of the batch are covered by its checksum, so they are only checked to be framed.
+        batch(offset, h, apply);
+      } else {
+        chunk.corrupt.emplace_back(offset, h.RecordSize());
+      }
+      offset += h.RecordSize();
+    }
+  }
+
+  // The end of the record at `offset`, the header of which does not fit in the log, if it does with one bit of its
+  // lengths flipped back, and then matches its checksum. Otherwise `size`.
+  static uint64_t RepairedRecordEnd(char const* data, uint64_t offset, uint64_t size) {
+    std::string header(data + offset, kLogRecordHeaderSize);
+    for (size_t bit = 8u; bit < 8u * kStorageRecordChecksumOffset; ++bit) {
+      char const mask = static_cast<char>(1u << (bit % 8u));
+      header[bit / 8u] ^= mask;
+      LogRecordHeader const h = DecodeLogRecordHeader(header.data(), false);
+      if (h.RecordSize() <= size - offset &&
+          StorageCRC32C(data + offset + kLogRecordHeaderSize,
+                        static_cast<size_t>(h.PayloadSize()),
+                        StorageCRC32C(header.data(), kStorageRecordChecksumOffset)) == h.checksum) {
+        return offset + h.RecordSize();
+      }
+      header[bit / 8u] ^= mask;
+    }
+    return size;
+  }
+
+  // Whether the record at `offset`, the header of which does not fit in the log, is a batch written partially: its
+  // writes are framed and match their checksums up to the end of the log, but for the last one, possibly torn.
+  static bool IsTornBatch(char const* data, uint64_t offset, LogRecordHeader const& h, uint64_t size) {
+    if (h.op != kLogOpBatch) {
+      return false;
+    }
+    for (uint64_t i = offset + kLogRecordHeaderSize; size - i >= kLogRecordHeaderSize;) {
+      LogRecordHeader const w = DecodeLogRecordHeader(data + i, false);
+      if (w.op != kLogOpSet && w.op != kLogOpDel) {
+        return false;
+      }
+      if (w.RecordSize() > size - i) {
+        return true;
+      }
+      if (StorageRecordChecksum(data + i, w.PayloadSize()) != w.checksum) {
+        return false;
+      }
+      i += w.RecordSize();
+    }
+    return true;
+  }
+
+  // The offset of the first record at or after `from` that is framed and matches its checksum, or `size` if none is.
+  // Byte by byte, as what follows a header that does not fit is not known to be framed; only run on a corrupt log.
+  static uint64_t Resync(char const* data, uint64_t from, uint64_t size) {
+    for (uint64_t offset = from; size - offset >= kLogRecordHeaderSize; ++offset) {
+      LogRecordHeader const h = DecodeLogRecordHeader(data + offset, false);
+      if (IsLogOp(h.op) && h.RecordSize() <= size - offset &&
+          StorageRecordChecksum(data + offset, h.PayloadSize()) == h.checksum) {
+        return offset;
+      }
+    }
+    return size;
+  }
+
+  // Recovers the log of `size` bytes that starts with `kLogFileMagic`. Sets `end_` to where the valid records end.
+  void RecoverInParallel(uint64_t size) {
+    void* const mapped = ::mmap(nullptr, static_cast<size_t>(size), PROT_READ, MAP_PRIVATE, fd_, 0);
+    if (mapped == MAP_FAILED) {
+      FatalLogError("mmap", log_path_);
+    }
+    char const* const data = static_cast<char const*>(mapped);
+
+    // The headers alone, to find where the records are, as the ranges of the framed records. Skips the headers that do
+    // not fit, see the top of this file, and stops at the one that is the torn write.
+    size_t const threads = options_.recovery_threads
+                               ? options_.recovery_threads
+                               : std::max(static_cast<size_t>(std::thread::hardware_concurrency()), size_t(1u));
+    uint64_t const chunk_size = std::max(size / threads, kLogRecoveryMinChunkSize);
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    uint64_t begin = kLogFileMagicSize;
+    uint64_t framed_end = kLogFileMagicSize;
+    uint64_t unframed = 0u;
+    while (size - framed_end >= kLogRecordHeaderSize) {
+      LogRecordHeader const h = DecodeLogRecordHeader(data + framed_end, false);
+      if (!IsLogOp(h.op) || h.RecordSize() > size - framed_end) {
+        uint64_t next = IsLogOp(h.op) ? RepairedRecordEnd(data, framed_end, size) : size;
+        if (next == size && !IsTornBatch(data, framed_end, h, size)) {
+          next = Resync(data, framed_end + 1u, size);
+        }
+        if (next == size) {
+          break;
+        }
+        if (begin != framed_end) {
+          ranges.emplace_back(begin, framed_end);
+        }
+        ++unframed;
+        begin = framed_end = next;
+        continue;
+      }
+      framed_end += h.RecordSize();
+      if (framed_end - begin >= chunk_size) {
+        ranges.emplace_back(begin, framed_end);
+        begin = framed_end;
+      }
+    }
+    if (begin != framed_end || ranges.empty()) {
+      ranges.emplace_back(begin, framed_end);
+    }
+
+    std::vector<RecoveredChunk> chunks(ranges.size());
+    if (chunks.size() == 1u) {
+      RecoverChunk(data, ranges[0].first, ranges[0].second, chunks[0]);
+    } else {
+      std::vector<std::thread> workers;
+      for (size_t i = 0u; i < chunks.size(); ++i) {
+        workers.emplace_back([&, i]() { RecoverChunk(data, ranges[i].first, ranges[i].second, chunks[i]); });
+      }
+      for (auto& t : workers) {
+        t.join();
+      }
+    }
+    ::munmap(mapped, static_cast<size_t>(size));
+
+    // In order, so that the later writes of each key win.
+    end_ = framed_end;
+    corrupt_records_ += unframed;
+    for (RecoveredChunk& chunk : chunks) {
+      for (auto& [field, keys] : chunk.writes) {
+        auto& per_field = index_[field];
+        for (auto& [key, w] : keys) {
+          if (w.set) {
+            per_field[key] = w.location;
+          } else {
+            per_field.erase(key);
+          }
+        }
+      }
+      recovered_records_ += chunk.records;
+      corrupt_records_ += chunk.corrupt.size();
+      if (!chunk.corrupt.empty() && chunk.corrupt.back().first + chunk.corrupt.back().second == framed_end) {
+        // The last record, written partially, and not a corrupt one.
+        end_ = chunk.corrupt.back().first;
+        --corrupt_records_;
+      }
+    }
+    for (auto const& [field, keys] : index_) {
+      for (auto const& [key, location] : keys) {
+        live_bytes_ += location.record_size;
+      }
+    }
+  }
+
+  // Recovers the log written before the records had checksums, and rewrites it in the current format.
+  void RecoverLegacy(uint64_t size) {
+    LogScanner scanner(fd_, 0u, size, true);
+    while (scanner.Next([&](LogRecordHeader const& h, std::string field, std::string key, char const*) {
+      ApplyToIndex(index_, live_bytes_, scanner.Offset(), h, std::move(field), std::move(key));
+      ++recovered_records_;
+    })) {
+    }
+    end_ = scanner.Offset();
+    truncated_bytes_ = size - end_;
+    Compact();
+  }
+
+  void Recover() {
+    // A leftover from a compaction that has not completed. The log itself is intact until the `rename()`.
+    current::FileSystem::RmFile(compacting_path_, current::FileSystem::RmFileParameters::Silent);
+
+    fd_ = ::open(log_path_.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd_ < 0) {
+      FatalLogError("open", log_path_);
+    }
+    off_t const size = ::lseek(fd_, 0, SEEK_END);
+    if (size < 0) {
+      FatalLogError("lseek", log_path_);
+    }
+    if (size == 0) {
+      WriteAllOrDie(fd_, kLogFileMagic, kLogFileMagicSize, log_path_);
+      end_ = kLogFileMagicSize;
+      return;
+    }
+    std::string magic(std::min(static_cast<size_t>(size), kLogFileMagicSize), '\0');
+    ReadAllOrDie(fd_, magic.data(), magic.length(), 0u, log_path_);
+    if (magic != kLogFileMagic) {
+      RecoverLegacy(static_cast<uint64_t>(size));
+      return;
+    }
+    RecoverInParallel(static_cast<uint64_t>(size));
+    truncated_bytes_ = static_cast<uint64_t>(size) - end_;
+    if (truncated_bytes_) {
+      // NOTE: The torn tail is what was being written when the process died, it was never acknowledged.
+      if (::ftruncate(fd_, static_cast<off_t>(end_))) {
+        FatalLogError("ftruncate", log_path_);
+      }
+    }
+    if ((corrupt_records_ || truncated_bytes_) && options_.logger) {
+      options_.logger("Storage log '" + log_path_ + "': " + current::ToString(recovered_records_) +
+                      " records recovered, " + current::ToString(corrupt_records_) +
+                      " corrupt records skipped, " + current::ToString(truncated_bytes_) +
+                      " bytes of a partial write cut off.");
+    }
+  }
+
+  // Writes the commits as the leader: all at once, with the index updated in order, and with one `fdatasync()`.
+  void WriteAsLeader(std::vector<std::vector<C5T_STORAGE_WRITE> const*> const& commits) {
+    std::string data;
+    for (auto const* writes : commits) {
+      if (writes->size() == 1u) {
+        AppendStorageRecord(data, writes->front());
+      } else {
+        AppendStorageBatchRecord(data, *writes);
+      }
+    }
+    int fd_to_sync;
+    {
+      std::lock_guard lock(mutex_);
+      WriteAllOrDie(fd_, data.data(), data.length(), log_path_);
+      uint64_t offset = end_;
+      for (auto const* writes : commits) {
+        if (writes->size() != 1u) {
+          offset += kLogRecordHeaderSize;
+        }
+        for (auto const& w : *writes) {
+          LogRecordHeader const h = HeaderOf(w);
+          ApplyToIndex(index_, live_bytes_, offset, h, w.field, w.key);
+          offset += h.RecordSize();
+        }
+      }
+      end_ += data.length();
+      // NOTE: The duplicate descriptor keeps the file open even if a compaction replaces the log meanwhile,
+      // in which case the compaction has already `fsync`-ed these very records into the new log file.
+      fd_to_sync = options_.fsync_every_write ? ::dup(fd_) : -1;
+    }
+    if (fd_to_sync >= 0) {
+      if (::fdatasync(fd_to_sync)) {
+        FatalLogError("fdatasync", log_path_);
+      }
+      ::close(fd_to_sync);
+    }
+  }
+
+  void Commit(std::vector<C5T_STORAGE_WRITE> const& writes) {
+    uint64_t const id = group_commit_.MutableUse([&writes](GroupCommit& g) {
+      g.pending.push_back(&writes);
+      return ++g.last_enqueued;
+    });
+    while (true) {
+      using r_t = std::pair<bool, std::vector<std::vector<C5T_STORAGE_WRITE> const*>>;
+      r_t r = group_commit_.Wait([id](GroupCommit const& g) { return g.last_done >= id || !g.leader_active; },
+                                 [id](GroupCommit& g) -> r_t {
+                                   if (g.last_done >= id) {
+                                     return {false, {}};
+                                   }
+                                   g.leader_active = true;
+                                   std::vector<std::vector<C5T_STORAGE_WRITE> const*> commits;
+                                   std::swap(commits, g.pending);
+                                   return {true, std::move(commits)};
+                                 });
+      if (!r.first) {
+        return;
+      }
+      WriteAsLeader(r.second);
+      group_commit_.MutableUse([n = r.second.size()](GroupCommit& g) {
+        g.last_done += n;
+        g.leader_active = false;
+      });
+    }
+  }
+
+  bool NeedsCompaction() {
+    std::lock_guard lock(mutex_);
+    return end_ >= options_.compaction_min_log_size &&
+           static_cast<double>(end_ - live_bytes_) >= options_.compaction_min_garbage_ratio * static_cast<double>(end_);
+  }
+
+  // Writes the live records into a new file, with no lock held but for the very end, to then catch up on what was
+  // appended to the log meanwhile, and to atomically replace the log with the new file.
+  void Compact() {
+    std::lock_guard compaction_lock(compaction_mutex_);
+
+    uint64_t snapshot_end;
+    index_t snapshot;
+    {
+      std::lock_guard lock(mutex_);
+      snapshot_end = end_;
+      snapshot = index_;
+    }
+
+    int const new_fd = ::open(compacting_path_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (new_fd < 0) {
+      FatalLogError("open", compacting_path_);
+    }
+
+    index_t new_index;
+    uint64_t new_end = kLogFileMagicSize;
+    uint64_t new_live_bytes = 0u;
+    std::string buffer(kLogFileMagic, kLogFileMagicSize);
+    std::string value;
+    // NOTE: The headers passed in are not legacy: the log is only legacy until it is first compacted.
+    auto const append = [&](LogRecordHeader const& h, std::string field, std::string key, char const* data) {
+      AppendStorageRecord(buffer, h.op, field, key, data, h.value_length);
+      ApplyToIndex(new_index, new_live_bytes, new_end, h, std::move(field), std::move(key));
+      new_end += h.RecordSize();
+      if (buffer.length() >= kLogReadBufferSize) {
+        WriteAllOrDie(new_fd, buffer.data(), buffer.length(), compacting_path_);
+        buffer.clear();
+      }
+    };
+
+    // NOTE: Reading from `fd_` with no lock held is safe: the log is append-only, and it is only ever
+    // replaced by the compaction, which this thread is the one running.
+    for (auto& [field, keys] : snapshot) {
+      for (auto& [key, location] : keys) {
+        value.resize(location.value_length);
+        ReadAllOrDie(fd_, value.data(), value.length(), location.value_offset, log_path_);
+        LogRecordHeader const h{kLogOpSet,
+                                static_cast<uint32_t>(field.length()),
+                                static_cast<uint32_t>(key.length()),
+                                location.value_length};
+        append(h, field, key, value.data());
+      }
+    }
+
+    std::lock_guard lock(mutex_);
+    LogScanner scanner(fd_, snapshot_end, end_);
+    while (scanner.Next(append)) {
+    }
+    if (!buffer.empty()) {
+      WriteAllOrDie(new_fd, buffer.data(), buffer.length(), compacting_path_);
+    }
+    if (::fsync(new_fd)) {
+      FatalLogError("fsync", compacting_path_);
+    }
+    ::close(new_fd);
+    current::FileSystem::RenameFile(compacting_path_, log_path_);
+    ::close(fd_);
+    fd_ = ::open(log_path_.c_str(), O_RDWR | O_APPEND);
+    if (fd_ < 0) {
+      FatalLogError("open", log_path_);
+    }
+    index_ = std::move(new_index);
+    end_ = new_end;
+    live_bytes_ = new_live_bytes;
+  }
+
+  void CompactionThread() {
+    while (!terminating_.WaitFor([](bool b) { return b; }, options_.compaction_check_period)) {
+      if (NeedsCompaction()) {
+        Compact();
+      }
+    }
+  }
+
+ public:
+  C5T_STORAGE_LogInstance(std::string path, C5T_STORAGE_OPTIONS const& options)
+      : C5T_STORAGE_Instance(std::move(path), options.cache_limits),
+        options_(options),
+        log_path_(current::FileSystem::JoinPath(path_, kLogFileName)),
+        compacting_path_(current::FileSystem::JoinPath(path_, kLogCompactingFileName)),
+        terminating_(false) {
+    Recover();
+    compaction_thread_ = std::thread([this]() { CompactionThread(); });
+  }
+
+  ~C5T_STORAGE_LogInstance() override {
+    terminating_.SetValue(true);
+    compaction_thread_.join();
+    if (!options_.fsync_every_write) {
+      ::fdatasync(fd_);
+    }
+    ::close(fd_);
+  }
+
+  void DoSave(std::string const& field, std::string const& key, std::string const& value) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoSave(" << path_ << ", " << field << ", " << key << ", " << value << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    Commit({C5T_STORAGE_WRITE{field, key, value}});
+  }
+
+  Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoLoad(" << path_ << ", " << field << ", " << key << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    std::lock_guard lock(mutex_);
+    auto const cit_field = index_.find(field);
+    if (cit_field == std::end(index_)) {
+      return nullptr;
+    }
+    auto const cit = cit_field->second.find(key);
+    if (cit == std::end(cit_field->second)) {
+      return nullptr;
+    }
+    std::string value(cit->second.value_length, '\0');
+    ReadAllOrDie(fd_, value.data(), value.length(), cit->second.value_offset, log_path_);
+    return value;
+  }
+
+  void DoDelete(std::string const& field, std::string const& key) override {
+#ifdef C5T_DEBUG_STORAGE
+    std::cerr << "DoDelete(" << path_ << ", " << field << ", " << key << ")\n";
+#endif  // C5T_DEBUG_STORAGE
+    Commit({C5T_STORAGE_WRITE{field, key, nullptr}});
+  }
+
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    std::vector<std::string> keys;
+    {
+      std::lock_guard lock(mutex_);
+      auto const cit_field = index_.find(field);
+      if (cit_field != std::end(index_)) {
+        keys.reserve(cit_field->second.size());
+        for (auto const& [key, _] : cit_field->second) {
+          keys.push_back(key);
+        }
+      }
+    }
+    for (std::string const& key : keys) {
+      f(key);
+    }
+  }
+
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    std::vector<std::pair<std::string, std::string>> page;
+    {
+      std::lock_guard lock(mutex_);
+      auto const cit_field = index_.find(field);
+      if (cit_field == std::end(index_)) {
+        return;
+      }
+      auto const& keys = cit_field->second;
+      for (auto it = keys.lower_bound(begin); it != std::end(keys) && (end.empty() || it->first < end); ++it) {
+        if (page.size() == limit) {
+          break;
+        }
+        std::string value(it->second.value_length, '\0');
+        ReadAllOrDie(fd_, value.data(), value.length(), it->second.value_offset, log_path_);
+        page.emplace_back(it->first, std::move(value));
+      }
+    }
+    // Outside the lock, since `f` is the user code.
+    for (auto const& [key, value] : page) {
+      f(key, value);
+    }
+  }
+
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override { Commit(writes); }
+
+  void DoCompact() override { Compact(); }
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats = C5T_STORAGE_Instance::DoGetStats();
+    stats.log_recovered_records = recovered_records_;
+    stats.log_corrupt_records = corrupt_records_;
+    stats.log_truncated_bytes = truncated_bytes_;
+    return stats;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateLogStorageInstance(std::string const& path,
+                                                                C5T_STORAGE_OPTIONS const& options) {
+  return std::make_unique<C5T_STORAGE_LogInstance>(path, options);
+}
@@ -0,0 +1,127 @@
+// The TTL sweeper: a decorator over the storage instance that deletes the keys that have expired in the background.
+//
+// Only used if `ttl_sweep_period` is set. The sweeper, a thread tracked by the lifetime manager, wakes up every
+// `ttl_sweep_period`, and, for each field that may have keys with TTLs, deletes up to `ttl_sweep_max_keys` of the ones
+// that have expired, in the order they expired. The work per wakeup is bounded, so the sweeps do not hold up the other
+// writes for long; what is not deleted by one sweep is deleted by the next ones. The deletes are the regular ones: the
+// indexes and the listeners see them too.
+//
+// The expired keys read as if they do not exist right away, the sweeper only reclaims what they take on disk and in
+// memory. It stops on `C5T_LIFETIME_MANAGER_EXIT()`, and when the storage instance is destroyed.
+
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
+
+#include "lib_c5t_lifetime_manager.h"
+
+#include "bricks/sync/waitable_atomic.h"
+
+namespace {
+
+class C5T_STORAGE_TTLSweeperInstance final : public C5T_STORAGE_Interface {
+ private:
+  struct State final {
+    bool stop = false;
+    // Set once the sweeper is done, or if it never started.
+    bool done = false;
+    uint64_t swept = 0u;
+  };
+
+  std::unique_ptr<C5T_STORAGE_Interface> const inner_;
+  // Shared with the sweeper thread, since it is joined by the lifetime manager, not by this instance.
+  std::shared_ptr<current::WaitableAtomic<State>> const state_;
+  LifetimeTerminationSignalScope shutdown_scope_;
+
+  static void Sweeper(std::shared_ptr<current::WaitableAtomic<State>> state,
+                      C5T_STORAGE_Interface* storage,
+                      C5T_STORAGE_OPTIONS const options) {
+    while (!state->WaitFor([](State const& s) { return s.stop; }, options.ttl_sweep_period)) {
+      uint64_t swept = 0u;
+      C5T_STORAGE_META_SINGLETON().VisitAllFields([&](C5T_STORAGE_FIELD_Interface* f) {
+        if (f->HasTTLs()) {
+          swept += f->SweepExpired(*storage, options.ttl_sweep_max_keys);
+        }
+      });
+      state->MutableUse([swept](State& s) { s.swept += swept; });
+    }
+    state->MutableUse([](State& s) { s.done = true; });
+  }
+
+ public:
+  C5T_STORAGE_TTLSweeperInstance(std::unique_ptr<C5T_STORAGE_Interface> inner, C5T_STORAGE_OPTIONS const& options)
+      : inner_(std::move(inner)),
+        state_(std::make_shared<current::WaitableAtomic<State>>()),
+        shutdown_scope_(C5T_LIFETIME_MANAGER_NOTIFY_OF_SHUTDOWN(
+            [state = state_]() { state->MutableUse([](State& s) { s.stop = true; }); })) {
+    ReplaceRegisteredStorageInstance(inner_.get(), this);
+    // What the fields know of their TTLs is of the previous storage instance, if any. Learned from what is stored,
+    // so that the keys of the fields not used since are swept too.
+    C5T_STORAGE_META_SINGLETON().VisitAllFields([this](C5T_STORAGE_FIELD_Interface* f) {
+      bool ttls = false;
+      inner_->DoScan(C5T_STORAGE_TTL_FIELD(f->Name()), "", "", 1u, [&ttls](std::string const&, std::string const&) {
+        ttls = true;
+      });
+      f->SetHasTTLs(ttls);
+    });
+    if (C5T_LIFETIME_MANAGER_SHUTTING_DOWN) {
+      // The lifetime manager would not start the sweeper at this point.
+      state_->MutableUse([](State& s) { s.done = true; });
+    } else {
+      C5T_LIFETIME_MANAGER_TRACKED_THREAD("C5T_STORAGE TTL sweeper", [state = state_, this, options]() {
+        Sweeper(state, this, options);
+      });
+    }
+  }
+
+  ~C5T_STORAGE_TTLSweeperInstance() override {
+    state_->MutableUse([](State& s) { s.stop = true; });
+    state_->Wait([](State const& s) { return s.done; });
+    ReplaceRegisteredStorageInstance(this, inner_.get());
+  }
+
+  size_t FieldsCount() const override { return inner_->FieldsCount(); }
+  C5T_STORAGE_CACHE_LIMITS CacheLimits() const override { return inner_->CacheLimits(); }
+  uint64_t InstanceID() const override { return inner_->InstanceID(); }
+  void ListFields(std::function<void(std::string const&)> cb) override { inner_->ListFields(std::move(cb)); }
+  bool NeedToStartFresh(C5T_STORAGE_FIELD_Interface const& field) override { return inner_->NeedToStartFresh(field); }
+  C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const& name) override {
+    return inner_->UseFieldTypeErased(name);
+  }
+
+  void DoSave(std::string const& field, std::string const& key, std::string const& value) override {
+    inner_->DoSave(field, key, value);
+  }
+  Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
+    return inner_->DoLoad(field, key);
+  }
+  void DoDelete(std::string const& field, std::string const& key) override { inner_->DoDelete(field, key); }
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    inner_->DoScan(field, begin, end, limit, std::move(f));
+  }
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    inner_->DoListKeys(field, std::move(f));
+  }
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override { inner_->DoCommit(writes); }
+  void DoCompact() override { inner_->DoCompact(); }
+  uint64_t DoExport(uint64_t since, std::function<void(std::string const& chunk)> f) override {
+    return inner_->DoExport(since, std::move(f));
+  }
+  uint64_t DoImport(std::istream& in) override { return inner_->DoImport(in); }
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats = inner_->DoGetStats();
+    stats.ttl_swept = state_->ImmutableUse([](State const& s) { return s.swept; });
+    return stats;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateTTLSweeperStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                       C5T_STORAGE_OPTIONS const& options) {
+  return std::make_unique<C5T_STORAGE_TTLSweeperInstance>(std::move(inner), options);
+}
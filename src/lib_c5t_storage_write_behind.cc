@@ -0,0 +1,289 @@
+// The write-behind storage: a decorator over any backend that makes `Set`-s and `Del`-s not wait for the disk.
+//
+// The writes update the pending map and return. The background flusher, a thread tracked by the lifetime manager,
+// wakes up every `write_behind_flush_period`, or sooner if too many keys are pending, takes all the pending writes,
+// and writes them out as a single `DoCommit()` into the wrapped backend. Repeated writes to the same key are coalesced
+// while they are pending, so that a hot key is written once per flush, not once per `Set`.
+//
+// The loads check the pending writes and the writes being flushed first, so the reads always see the latest values.
+// A transaction is pending as a whole and flushed as a whole, within a single commit, so it stays atomic.
+//
+// On `C5T_LIFETIME_MANAGER_EXIT()` the flusher writes out everything that is pending and stops; from then on the
+// writes go straight to the wrapped backend. The same full flush happens when the storage instance is destroyed.
+
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_instance.h"
+
+#include <map>
+#include <set>
+
+#include "lib_c5t_lifetime_manager.h"
+
+#include "bricks/sync/waitable_atomic.h"
+
+namespace {
+
+class C5T_STORAGE_WriteBehindInstance final : public C5T_STORAGE_Interface {
+ private:
+  using clock_t = std::chrono::steady_clock;
+
+  // field -> key -> value, or `nullptr` for a delete.
+  using writes_t = std::map<std::string, std::map<std::string, Optional<std::string>>>;
+
+  struct State final {
+    writes_t pending;
+    size_t pending_count = 0u;
+    clock_t::time_point oldest_pending;
+    // What the flusher is writing right now, so that the loads see it until it is written.
+    writes_t in_flight;
+    size_t in_flight_count = 0u;
+    clock_t::time_point oldest_in_flight;
+
+    bool stop = false;
+    // Set once the flusher is done, or if it never started. The writes are then made synchronously.
+    bool write_through = false;
+
+    uint64_t flushed = 0u;
+    uint64_t coalesced = 0u;
+  };
+
+  std::unique_ptr<C5T_STORAGE_Interface> const inner_;
+  C5T_STORAGE_OPTIONS const options_;
+  // Shared with the flusher thread, since it is joined by the lifetime manager, not by this instance.
+  std::shared_ptr<current::WaitableAtomic<State>> const state_;
+  LifetimeTerminationSignalScope shutdown_scope_;
+
+  static void Append(writes_t const& writes, std::vector<C5T_STORAGE_WRITE>& out) {
+    for (auto const& [field, keys] : writes) {
+      for (auto const& [key, value] : keys) {
+        out.push_back(C5T_STORAGE_WRITE{field, key, value});
+      }
+    }
+  }
+
+  static void Flusher(std::shared_ptr<current::WaitableAtomic<State>> state,
+                      C5T_STORAGE_Interface* inner,
+                      C5T_STORAGE_OPTIONS const options) {
+    while (true) {
+      size_t const max_pending = options.write_behind_max_pending;
+      state->WaitFor([max_pending](State const& s) { return s.stop || s.pending_count >= max_pending; },
+                     options.write_behind_flush_period);
+      bool const stop = state->ImmutableUse([](State const& s) { return s.stop; });
+      std::vector<C5T_STORAGE_WRITE> writes;
+      state->MutableUse([&writes](State& s) {
+        s.in_flight = std::move(s.pending);
+        s.in_flight_count = s.pending_count;
+        s.oldest_in_flight = s.oldest_pending;
+        s.pending.clear();
+        s.pending_count = 0u;
+        Append(s.in_flight, writes);
+      });
+      if (!writes.empty()) {
+        inner->DoCommit(writes);
+      }
+      state->MutableUse([stop](State& s) {
+        s.flushed += s.in_flight_count;
+        s.in_flight.clear();
+        s.in_flight_count = 0u;
+        if (stop && !s.pending_count) {
+          // Under the same lock as the check, so that no write can sneak in between the last flush and this.
+          s.write_through = true;
+        }
+      });
+      if (state->ImmutableUse([](State const& s) { return s.write_through; })) {
+        return;
+      }
+    }
+  }
+
+  void Enqueue(std::vector<C5T_STORAGE_WRITE> const& writes) {
+    bool const enqueued = state_->MutableUse([&writes](State& s) {
+      if (s.write_through) {
+        return false;
+      }
+      if (!s.pending_count) {
+        s.oldest_pending = clock_t::now();
+      }
+      for (auto const& w : writes) {
+        auto& keys = s.pending[w.field];
+        auto it = keys.find(w.key);
+        if (it == std::end(keys)) {
+          keys.emplace(w.key, w.value);
+          ++s.pending_count;
+        } else {
+          it->second = w.value;
+          ++s.coalesced;
+        }
+      }
+      return true;
+    });
+    if (!enqueued) {
+      inner_->DoCommit(writes);
+    }
+  }
+
+ public:
+  C5T_STORAGE_WriteBehindInstance(std::unique_ptr<C5T_STORAGE_Interface> inner, C5T_STORAGE_OPTIONS const& options)
+      : inner_(std::move(inner)),
+        options_(options),
+        state_(std::make_shared<current::WaitableAtomic<State>>()),
+        shutdown_scope_(C5T_LIFETIME_MANAGER_NOTIFY_OF_SHUTDOWN(
+            [state = state_]() { state->MutableUse([](State& s) { s.stop = true; }); })) {
+    ReplaceRegisteredStorageInstance(inner_.get(), this);
+    if (C5T_LIFETIME_MANAGER_SHUTTING_DOWN) {
+      // The lifetime manager would not start the flusher at this point.
+      state_->MutableUse([](State& s) { s.write_through = true; });
+    } else {
+      C5T_LIFETIME_MANAGER_TRACKED_THREAD(
+          "C5T_STORAGE write-behind flusher",
+          [state = state_, inner = inner_.get(), options = options_]() { Flusher(state, inner, options); });
+    }
+  }
+
+  ~C5T_STORAGE_WriteBehindInstance() override {
+    state_->MutableUse([](State& s) { s.stop = true; });
+    state_->Wait([](State const& s) { return s.write_through; });
+    ReplaceRegisteredStorageInstance(this, inner_.get());
+  }
+
+  size_t FieldsCount() const override { return inner_->FieldsCount(); }
+  C5T_STORAGE_CACHE_LIMITS CacheLimits() const override { return inner_->CacheLimits(); }
+  uint64_t InstanceID() const override { return inner_->InstanceID(); }
+  void ListFields(std::function<void(std::string const&)> cb) override { inner_->ListFields(std::move(cb)); }
+  bool NeedToStartFresh(C5T_STORAGE_FIELD_Interface const& field) override { return inner_->NeedToStartFresh(field); }
+  C5T_STORAGE_FIELD_Interface* UseFieldTypeErased(std::string const& name) override {
+    return inner_->UseFieldTypeErased(name);
+  }
+
+  void DoSave(std::string const& field, std::string const& key, std::string const& value) override {
+    Enqueue({C5T_STORAGE_WRITE{field, key, value}});
+  }
+
+  void DoDelete(std::string const& field, std::string const& key) override {
+    Enqueue({C5T_STORAGE_WRITE{field, key, nullptr}});
+  }
+
+  void DoCommit(std::vector<C5T_STORAGE_WRITE> const& writes) override { Enqueue(writes); }
+
+  Optional<std::string> DoLoad(std::string const& field, std::string const& key) override {
+    Optional<std::string> value;
+    bool const buffered = state_->ImmutableUse([&](State const& s) {
+      for (writes_t const* writes : {&s.pending, &s.in_flight}) {
+        auto const cit_field = writes->find(field);
+        if (cit_field != std::end(*writes)) {
+          auto const cit_key = cit_field->second.find(key);
+          if (cit_key != std::end(cit_field->second)) {
+            value = cit_key->second;
+            return true;
+          }
+        }
+      }
+      return false;
+    });
+    return buffered ? value : inner_->DoLoad(field, key);
+  }
+
+  void DoListKeys(std::string const& field, std::function<void(std::string const& key)> f) override {
+    std::set<std::string> keys;
+    inner_->DoListKeys(field, [&keys](std::string const& key) { keys.insert(key); });
+    state_->ImmutableUse([&](State const& s) {
+      for (writes_t const* writes : {&s.in_flight, &s.pending}) {
+        auto const cit_field = writes->find(field);
+        if (cit_field != std::end(*writes)) {
+          for (auto const& [key, value] : cit_field->second) {
+            if (Exists(value)) {
+              keys.insert(key);
+            } else {
+              keys.erase(key);
+            }
+          }
+        }
+      }
+    });
+    for (std::string const& key : keys) {
+      f(key);
+    }
+  }
+
+  // Merges what the wrapped backend has with the pending writes, which take precedence.
+  void DoScan(std::string const& field,
+              std::string const& begin,
+              std::string const& end,
+              size_t limit,
+              std::function<void(std::string const& key, std::string const& value)> f) override {
+    auto const in_range = [&end](std::string const& key) { return end.empty() || key < end; };
+    std::map<std::string, Optional<std::string>> overlay;
+    state_->ImmutableUse([&](State const& s) {
+      for (writes_t const* writes : {&s.in_flight, &s.pending}) {
+        auto const cit_field = writes->find(field);
+        if (cit_field != std::end(*writes)) {
+          for (auto it = cit_field->second.lower_bound(begin); it != std::end(cit_field->second) && in_range(it->first);
+               ++it) {
+            overlay[it->first] = it->second;
+          }
+        }
+      }
+    });
+    std::string from = begin;
+    auto overlay_it = std::begin(overlay);
+    while (limit) {
+      std::vector<std::pair<std::string, std::string>> page;
+      inner_->DoScan(field, from, end, limit, [&page](std::string const& k, std::string const& v) {
+        page.emplace_back(k, v);
+      });
+      bool const last_page = page.size() < limit;
+      // What the overlay has up to the last key of this page, or all of it, if this is the last page.
+      auto const covered = [&](std::string const& key) { return last_page || key <= page.back().first; };
+      auto page_it = std::begin(page);
+      while (limit && (page_it != std::end(page) || (overlay_it != std::end(overlay) && covered(overlay_it->first)))) {
+        bool const take_overlay = overlay_it != std::end(overlay) && covered(overlay_it->first) &&
+                                  (page_it == std::end(page) || overlay_it->first <= page_it->first);
+        if (take_overlay) {
+          if (page_it != std::end(page) && page_it->first == overlay_it->first) {
+            ++page_it;
+          }
+          if (Exists(overlay_it->second)) {
+            f(overlay_it->first, Value(overlay_it->second));
+            --limit;
+          }
+          ++overlay_it;
+        } else {
+          f(page_it->first, page_it->second);
+          --limit;
+          ++page_it;
+        }
+      }
+      if (last_page) {
+        return;
+      }
+      from = page.back().first + '\0';
+    }
+  }
+
+  void DoCompact() override { inner_->DoCompact(); }
+  uint64_t DoExport(uint64_t since, std::function<void(std::string const& chunk)> f) override {
+    return inner_->DoExport(since, std::move(f));
+  }
+  uint64_t DoImport(std::istream& in) override { return inner_->DoImport(in); }
+
+  C5T_STORAGE_STATS DoGetStats() override {
+    C5T_STORAGE_STATS stats = inner_->DoGetStats();
+    state_->ImmutableUse([&stats](State const& s) {
+      stats.write_behind_queue_depth = s.pending_count + s.in_flight_count;
+      if (stats.write_behind_queue_depth) {
+        clock_t::time_point const oldest = s.in_flight_count ? s.oldest_in_flight : s.oldest_pending;
+        stats.write_behind_lag = std::chrono::duration_cast<std::chrono::microseconds>(clock_t::now() - oldest);
+      }
+      stats.write_behind_flushed = s.flushed;
+      stats.write_behind_coalesced = s.coalesced;
+    });
+    return stats;
+  }
+};
+
+}  // namespace
+
+std::unique_ptr<C5T_STORAGE_Interface> CreateWriteBehindStorageInstance(std::unique_ptr<C5T_STORAGE_Interface> inner,
+                                                                        C5T_STORAGE_OPTIONS const& options) {
+  return std::make_unique<C5T_STORAGE_WriteBehindInstance>(std::move(inner), options);
+}
@@ -3,12 +3,9 @@
 #include "lib_c5t_actor_model.h"
 #include "typesystem/types.h"
 
-struct TimerEvent final : crnt::CurrentSuper {
-  uint32_t const i;
-
-  TimerEvent() = delete;
-  TimerEvent(TimerEvent const&) = delete;
-  TimerEvent& operator=(TimerEvent const&) = delete;
+// Small and trivially copyable, so it is delivered by value, with no `shared_ptr` involved.
+struct TimerEvent final {
+  uint32_t i;
 
   TimerEvent(uint32_t i) : i(i) {}
 };
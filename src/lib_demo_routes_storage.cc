@@ -0,0 +1,62 @@
+#include "lib_demo_routes_storage.h"
+
+#include "blocks/http/api.h"
+#include "lib_c5t_logger.h"
+#include "lib_c5t_lifetime_manager.h"
+#include "lib_c5t_storage.h"
+#include "lib_c5t_storage_codec.h"
+
+void DefineDemoStorageFields() { C5T_STORAGE_DEFINE_FIELD(demo_kv, std::string, PERSIST_LATEST); }
+
+void RegisterDemoRoutesStorage(HTTPServerContext& ctx) {
+  current::http::HTTPServerPOSIX& http = ctx.http;
+  HTTPRoutesScope& routes = *reinterpret_cast<HTTPRoutesScope*>(ctx.proutes);
+
+  // `GET /storage/kv/<key>` is the value of `<key>`, `POST` or `PUT` sets it to the body, and `DELETE` deletes it.
+  ctx.FastRegister("/storage/kv", HTTPServerContext::CountMask::One, [](FastRequest const& r) {
+    std::string const& key = r.url_path_args[0];
+    try {
+      if (r.method == "POST" || r.method == "PUT") {
+        C5T_STORAGE(demo_kv).Set(key, r.body);
+        return FastResponse().Body("set\n");
+      } else if (r.method == "DELETE") {
+        C5T_STORAGE(demo_kv).Del(key);
+        return FastResponse().Body("deleted\n");
+      }
+      Optional<std::string> const value = C5T_STORAGE(demo_kv).Get(key);
+      if (Exists(value)) {
+        return FastResponse().Body(Value(value));
+      }
+      return FastResponse().Body("no such key\n").Code(HTTPResponseCode.NotFound);
+    } catch (StorageNotInitializedException const&) {
+      return FastResponse().Body("no storage\n").Code(HTTPResponseCode.NotFound);
+    }
+  });
+
+  // `/storage/export` is the full export of the storage, `/storage/export/<since>` is the incremental one, see
+  // `C5T_STORAGE_EXPORT()`. Streamed as it is made, chunk by chunk.
+  routes += http.Register("/storage/export", URLPathArgs::CountMask::None | URLPathArgs::CountMask::One, [](Request r) {
+    C5T_LOGGER("demo") << "/storage/export requested";
+    C5T_LIFETIME_MANAGER_TRACKED_THREAD(
+        "storage export sender",
+        [](Request r) {
+          uint64_t const since = r.url_path_args.size() >= 1u ? current::FromString<uint64_t>(r.url_path_args[0]) : 0u;
+          C5T_STORAGE_Interface* storage = nullptr;
+          try {
+            storage = &C5T_STORAGE_INSTANCE();
+          } catch (StorageNotInitializedException const&) {
+            r("no storage\n", HTTPResponseCode.NotFound);
+            return;
+          }
+          auto rc = r.SendChunkedResponse();
+          try {
+            uint64_t const as_of = storage->DoExport(since, [&rc](std::string const& chunk) { rc(chunk); });
+            C5T_LOGGER("demo") << "/storage/export done, since " << since << ", as of " << as_of;
+          } catch (current::Exception const& e) {
+            // The response is cut short, and the import of what was sent fails.
+            C5T_LOGGER("demo") << "/storage/export failed: " << e.what();
+          }
+        },
+        std::move(r));
+  });
+}
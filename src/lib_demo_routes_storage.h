@@ -0,0 +1,12 @@
+#pragma once
+
+#include "lib_c5t_storage.h"
+#include "lib_http_server.h"
+
+// What the demo stores, via `/storage/kv/<key>`, for `/storage/export` to export.
+C5T_STORAGE_DECLARE_FIELD(demo_kv, std::string);
+
+// Must be called before the storage is created.
+void DefineDemoStorageFields();
+
+void RegisterDemoRoutesStorage(HTTPServerContext& ctx);
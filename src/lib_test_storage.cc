@@ -1,10 +1,12 @@
 #include "lib_c5t_storage.h"
 #include "lib_test_storage.h"
 
-#include "typesystem/serialization/json.h"  // IWYU pragma: keep
+#include "lib_c5t_storage_codec.h"
 
 void DefineTestStorageFields() {
   C5T_STORAGE_DEFINE_FIELD(kv1, std::string, PERSIST_LATEST);
   C5T_STORAGE_DEFINE_FIELD(kv2, SomeJSON, PERSIST_LATEST);
-  C5T_STORAGE_DEFINE_FIELD(kv3, int32_t, DO_NOT_PERSIST);
+  C5T_STORAGE_DEFINE_FIELD_WITH_CODEC(kv3, int32_t, DO_NOT_PERSIST, Raw);
+  C5T_STORAGE_DEFINE_FIELD(kv_indexed, SomeJSON, PERSIST_LATEST);
+  C5T_STORAGE_DEFINE_INDEX(kv_indexed, foo, [](SomeJSON const& x) { return x.foo; });
 }
@@ -21,6 +21,7 @@ CURRENT_STRUCT(SomeJSON) {
 C5T_STORAGE_DECLARE_FIELD(kv1, std::string);
 C5T_STORAGE_DECLARE_FIELD(kv2, SomeJSON);
 C5T_STORAGE_DECLARE_FIELD(kv3, int32_t);
+C5T_STORAGE_DECLARE_FIELD(kv_indexed, SomeJSON);
 C5T_STORAGE_DECLARE_FIELD(kv_declared_but_not_defined, int32_t);
 
 void DefineTestStorageFields();
@@ -46,6 +46,7 @@ TODOs;
 #include <gtest/gtest.h>
 
 #include "lib_c5t_actor_model.h"
+#include "lib_c5t_actor_model_streams.h"
 #include "lib_c5t_dlib.h"
 #include "lib_c5t_lifetime_manager.h"
 #include "lib_test_actor_model.h"
@@ -198,6 +199,295 @@ TEST(ActorModelTest, Nullable) {
   EXPECT_EQ("b501", oss.str());
 }
 
+TEST(ActorModelTest, RetainedEvents) {
+  auto const a = Topic<TestEvent<'a'>>("a", TopicRetention().LastN(2));
+  auto const b = Topic<TestEvent<'b'>>("b");
+
+  C5T_EMIT<TestEvent<'a'>>(a, 1);
+  C5T_EMIT<TestEvent<'a'>>(a, 2);
+  C5T_EMIT<TestEvent<'a'>>(a, 3);
+  C5T_EMIT<TestEvent<'b'>>(b, 4);
+
+  std::ostringstream oss1;
+  ActorSubscriberScope const s1 = C5T_SUBSCRIBE<TestWorker>(a + b, oss1);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("a2a3", oss1.str());
+
+  C5T_EMIT<TestEvent<'a'>>(a, 5);
+  C5T_EMIT<TestEvent<'b'>>(b, 6);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("a2a3a5b6", oss1.str());
+
+  std::ostringstream oss2;
+  ActorSubscriberScope const s2 = C5T_SUBSCRIBE<TestWorker>(a, oss2);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("a3a5", oss2.str());
+  EXPECT_EQ("a2a3a5b6", oss1.str());
+}
+
+TEST(ActorModelTest, RetainedEventsMaxAge) {
+  auto const a = Topic<TestEvent<'a'>>("a", TopicRetention().LastFor(std::chrono::milliseconds(50)));
+
+  C5T_EMIT<TestEvent<'a'>>(a, 1);
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  C5T_EMIT<TestEvent<'a'>>(a, 2);
+  C5T_EMIT<TestEvent<'a'>>(a, 3);
+
+  std::ostringstream oss;
+  ActorSubscriberScope const s = C5T_SUBSCRIBE<TestWorker>(a, oss);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("a2a3", oss.str());
+}
+
+TEST(ActorModelTest, StreamMapFilter) {
+  auto const a = Topic<TestEvent<'a'>>("a");
+  auto const b = Topic<TestEvent<'b'>>("b");
+
+  auto const stream = C5T_STREAM(a)
+                          .Filter([](TestEvent<'a'> const& e) { return e.x % 2 == 1; })
+                          .Map([](TestEvent<'a'> const& e) { return TestEvent<'a'>(e.x * 10); })
+                          .Filter([](TestEvent<'a'> const& e) { return e.x != 50; })
+                          .Map([](TestEvent<'a'> const& e) { return std::make_shared<TestEvent<'b'>>(e.x + 1); })
+                          .To(b);
+
+  std::ostringstream oss;
+  ActorSubscriberScope const s = C5T_SUBSCRIBE<TestWorker>(b, oss);
+  for (int i = 1; i <= 7; ++i) {
+    C5T_EMIT<TestEvent<'a'>>(a, i);
+  }
+  // The stream is a subscriber itself, so the first wait gets the events into `b`, and the second one into `oss`.
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("b11b31b71", oss.str());
+}
+
+TEST(ActorModelTest, StreamWindows) {
+  auto const a = Topic<TestEvent<'a'>>("a");
+  auto const sums_tumbling = Topic<TestEvent<'t'>>("sums_tumbling");
+  auto const sums_sliding = Topic<TestEvent<'s'>>("sums_sliding");
+
+  auto const ToSum = [](auto const& w) {
+    int sum = 0;
+    for (auto const& e : w.events) {
+      sum += e->x;
+    }
+    return sum;
+  };
+
+  auto const s1 = C5T_STREAM(a)
+                      .Window(3)
+                      .Map([&](ActorStreamWindow<TestEvent<'a'>> const& w) { return TestEvent<'t'>(ToSum(w)); })
+                      .To(sums_tumbling);
+  auto const s2 = C5T_STREAM(a)
+                      .Window(3, 1)
+                      .Map([&](ActorStreamWindow<TestEvent<'a'>> const& w) { return TestEvent<'s'>(ToSum(w)); })
+                      .To(sums_sliding);
+
+  std::ostringstream oss_tumbling;
+  std::ostringstream oss_sliding;
+  ActorSubscriberScope const c1 = C5T_SUBSCRIBE<TestWorker>(sums_tumbling, oss_tumbling);
+  ActorSubscriberScope const c2 = C5T_SUBSCRIBE<TestWorker>(sums_sliding, oss_sliding);
+  for (int i = 1; i <= 7; ++i) {
+    C5T_EMIT<TestEvent<'a'>>(a, i);
+  }
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("t6t15", oss_tumbling.str());
+  EXPECT_EQ("s6s9s12s15s18", oss_sliding.str());
+}
+
+TEST(ActorModelTest, StreamAggregate) {
+  auto const a = Topic<TestEvent<'a'>>("a");
+  using aggregate_t = ActorStreamAggregate<bool, int>;
+  auto const sums = Topic<aggregate_t>("sums");
+
+  auto const s = C5T_STREAM(a)
+                     .Aggregate([](TestEvent<'a'> const& e) { return e.x % 2 == 0; },
+                                0,
+                                [](int sum, TestEvent<'a'> const& e) { return sum + e.x; })
+                     .To(sums);
+
+  struct Collector final {
+    std::ostringstream& oss;
+    Collector(std::ostringstream& oss) : oss(oss) {}
+    void OnEvent(aggregate_t const& e) { oss << (e.key ? "even:" : "odd:") << e.value << ' '; }
+    void OnBatchDone() {}
+    void OnShutdown() {}
+  };
+
+  std::ostringstream oss;
+  ActorSubscriberScope const c = C5T_SUBSCRIBE<Collector>(sums, oss);
+  for (int i = 1; i <= 5; ++i) {
+    C5T_EMIT<TestEvent<'a'>>(a, i);
+  }
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("odd:1 even:2 odd:4 even:6 odd:9 ", oss.str());
+
+  // Each `.To()` of the same stream, and of its copy, aggregates on its own.
+  auto const sums2 = Topic<aggregate_t>("sums2");
+  auto const sums3 = Topic<aggregate_t>("sums3");
+  auto const stream = C5T_STREAM(a).Aggregate([](TestEvent<'a'> const& e) { return e.x % 2 == 0; },
+                                               0,
+                                               [](int sum, TestEvent<'a'> const& e) { return sum + e.x; });
+  auto const copy = stream;
+  auto const s2 = stream.To(sums2);
+  auto const s3 = copy.To(sums3);
+  std::ostringstream oss2;
+  std::ostringstream oss3;
+  ActorSubscriberScope const c2 = C5T_SUBSCRIBE<Collector>(sums2, oss2);
+  ActorSubscriberScope const c3 = C5T_SUBSCRIBE<Collector>(sums3, oss3);
+  for (int i = 1; i <= 3; ++i) {
+    C5T_EMIT<TestEvent<'a'>>(a, i);
+  }
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("odd:1 even:2 odd:4 ", oss2.str());
+  EXPECT_EQ("odd:1 even:2 odd:4 ", oss3.str());
+}
+
+struct InlineTestEvent final {
+  int x;
+  char c;
+};
+static_assert(kActorModelIsInlineEvent<InlineTestEvent>);
+static_assert(!kActorModelIsInlineEvent<TestEvent<'a'>>);
+
+struct InlineTestWorker final {
+  std::ostringstream& oss;
+  InlineTestWorker(std::ostringstream& oss) : oss(oss) {}
+  void OnEvent(InlineTestEvent const& e) { oss << e.c << e.x; }
+  template <char C>
+  void OnEvent(TestEvent<C> const& e) {
+    oss << C << e.x;
+  }
+  void OnBatchDone() {}
+  void OnShutdown() {}
+};
+
+TEST(ActorModelTest, InlineEvents) {
+  auto const i = Topic<InlineTestEvent>("i", TopicRetention().LastN(1));
+  auto const a = Topic<TestEvent<'a'>>("a");
+
+  C5T_EMIT<InlineTestEvent>(i, 0, 'x');
+  C5T_EMIT<InlineTestEvent>(i, 1, 'i');
+
+  std::ostringstream oss;
+  ActorSubscriberScope const s = C5T_SUBSCRIBE<InlineTestWorker>(i + a, oss);
+  C5T_EMIT<InlineTestEvent>(i, 2, 'i');
+  C5T_EMIT<TestEvent<'a'>>(a, 3);
+  C5T_EMIT<InlineTestEvent>(i, 4, 'i');
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("i1i2a3i4", oss.str());
+
+  // Subscribed to before the stream is, so that the retained event replayed into the stream is not missed.
+  auto const b = Topic<TestEvent<'b'>>("b");
+  std::ostringstream oss2;
+  ActorSubscriberScope const s2 = C5T_SUBSCRIBE<TestWorker>(b, oss2);
+  auto const stream =
+      C5T_STREAM(i).Map([](InlineTestEvent const& e) { return TestEvent<'b'>(e.x * 100); }).To(b);
+  C5T_EMIT<InlineTestEvent>(i, 5, 'i');
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("b400b500", oss2.str());
+}
+
+TEST(ActorModelTest, EmitBuffering) {
+  auto const i = Topic<InlineTestEvent>("i");
+  auto const a = Topic<TestEvent<'a'>>("a");
+
+  std::ostringstream oss;
+  ActorSubscriberScope const s = C5T_SUBSCRIBE<InlineTestWorker>(i + a, oss);
+
+  {
+    ActorEmitBufferScope buffer(ActorEmitBuffering().MaxEvents(3).MaxLatency(std::chrono::hours(1)));
+    C5T_EMIT<InlineTestEvent>(i, 1, 'i');
+    C5T_EMIT<TestEvent<'a'>>(a, 2);
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("", oss.str());
+
+    // The third event fills the buffer, and the events are delivered in the order they were emitted.
+    C5T_EMIT<InlineTestEvent>(i, 3, 'i');
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("i1a2i3", oss.str());
+
+    C5T_EMIT<TestEvent<'a'>>(a, 4);
+    C5T_EMIT<TestEvent<'a'>>(a, 5);
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("i1a2i3", oss.str());
+
+    C5T_EMIT_FLUSH();
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("i1a2i3a4a5", oss.str());
+
+    C5T_EMIT<InlineTestEvent>(i, 6, 'i');
+  }
+  // The end of the scope flushes the buffer.
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("i1a2i3a4a5i6", oss.str());
+
+  {
+    ActorEmitBufferScope buffer(ActorEmitBuffering().MaxLatency(std::chrono::milliseconds(0)));
+    C5T_EMIT<TestEvent<'a'>>(a, 7);
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("i1a2i3a4a5i6a7", oss.str());
+  }
+
+  {
+    // The events of a producer that went idle are delivered once the latency budget is spent, with no more emits.
+    ActorEmitBufferScope buffer(ActorEmitBuffering().MaxLatency(std::chrono::milliseconds(10)));
+    C5T_EMIT<TestEvent<'a'>>(a, 8);
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+    EXPECT_EQ("i1a2i3a4a5i6a7a8", oss.str());
+  }
+
+  // Without the scope, and with `C5T_EMIT_FLUSH()` being a no-op, the events are delivered right away.
+  C5T_EMIT_FLUSH();
+  C5T_EMIT<TestEvent<'a'>>(a, 9);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("i1a2i3a4a5i6a7a8a9", oss.str());
+}
+
+TEST(ActorModelTest, ExpiredEventsAreShed) {
+  auto const i = Topic<InlineTestEvent>("i");
+  auto const a = Topic<TestEvent<'a'>>("a");
+
+  struct SheddingWorker final {
+    std::ostringstream& oss;
+    SheddingWorker(std::ostringstream& oss) : oss(oss) {}
+    void OnEvent(InlineTestEvent const& e) { oss << e.c << e.x; }
+    void OnEvent(TestEvent<'a'> const& e) { oss << 'a' << e.x; }
+    void OnShed(size_t n) { oss << '[' << n << ']'; }
+    void OnBatchDone() {}
+    void OnShutdown() {}
+  };
+
+  std::ostringstream oss;
+  ActorSubscriberScopeFor<SheddingWorker> s = C5T_SUBSCRIBE<SheddingWorker>(i + a, oss);
+
+  auto const past = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+  {
+    // Buffered, so that all of the events, being for the same topic, get into the same batch of the subscriber.
+    ActorEmitBufferScope buffer;
+    C5T_EMIT<InlineTestEvent>(i, 1, 'i');
+    C5T_EMIT_WITH_DEADLINE<InlineTestEvent>(past, i, 2, 'i');
+    C5T_EMIT_WITH_TTL<InlineTestEvent>(std::chrono::hours(1), i, 3, 'i');
+    C5T_EMIT_WITH_DEADLINE<InlineTestEvent>(past, i, 4, 'i');
+    C5T_EMIT_WITH_TTL<InlineTestEvent>(std::chrono::hours(1), i, 5, 'i');
+  }
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("[2]i1i3i5", oss.str());
+  EXPECT_EQ(2u, s.GetNumShed());
+
+  C5T_EMIT_WITH_DEADLINE<TestEvent<'a'>>(past, a, 6);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  C5T_EMIT_WITH_TTL<TestEvent<'a'>>(std::chrono::hours(1), a, 7);
+  C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  EXPECT_EQ("[2]i1i3i5[1]a7", oss.str());
+  EXPECT_EQ(3u, s.GetNumShed());
+}
+
 TEST(ActorModelTest, InjectedFromDLib) {
   EXPECT_EQ(42,
             C5T_DLIB_CALL("test_actor_model", [&](C5T_DLib& dlib) { return dlib.CallOrDefault<int()>("Smoke42"); }));
@@ -1,12 +1,19 @@
 #include <gtest/gtest.h>
 
+#include <sstream>
+#include <thread>
+
 #include "bricks/file/file.h"
 #include "bricks/strings/split.h"
 #include "bricks/strings/join.h"
 #include "bricks/time/chrono.h"
 
 #include "lib_c5t_dlib.h"
+#include "lib_c5t_lifetime_manager.h"
 #include "lib_c5t_storage.h"
+#include "lib_c5t_storage_cdc.h"
+#include "lib_c5t_storage_codec.h"
+#include "lib_c5t_storage_instance.h"  // For `AppendStorageBatchRecord()`.
 #include "lib_test_storage.h"
 
 struct CallDefineTestStorageFields final {
@@ -14,6 +21,13 @@ struct CallDefineTestStorageFields final {
 };
 CallDefineTestStorageFields CallDefineTestStorageFields_impl;
 
+struct InitLifetimeManager final {
+  InitLifetimeManager() {
+    C5T_LIFETIME_MANAGER_SET_LOGGER([](std::string const&) {});
+  }
+};
+InitLifetimeManager InitLifetimeManager_impl;
+
 inline std::string CurrentTestName() { return ::testing::UnitTest::GetInstance()->current_test_info()->name(); }
 
 struct TestStorageDir final {
@@ -62,7 +76,7 @@ TEST(StorageTest, FieldsList) {
   auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(current::Singleton<TestStorageDir>().dir);
   std::vector<std::string> v;
   C5T_STORAGE_LIST_FIELDS([&v](std::string const& s) { v.push_back(s); });
-  EXPECT_EQ("kv1,kv2,kv3", current::strings::Join(v, ','));
+  EXPECT_EQ("kv1,kv2,kv3,kv_indexed", current::strings::Join(v, ','));
 }
 
 TEST(StorageTest, NeedsStorage) {
@@ -167,6 +181,1290 @@ TEST(StorageTest, MapPersists) {
   }
 }
 
+TEST(StorageTest, LogBackendPersists) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const options = C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::Log);
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("k"));
+    C5T_STORAGE(kv1).Set("k", "v");
+    C5T_STORAGE(kv1).Set("k2", "v2");
+    C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(42).SetBar("bar"));
+    C5T_STORAGE(kv1).Set("k", "v3");
+    C5T_STORAGE(kv1).Del("k2");
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ("v3", C5T_STORAGE(kv1).GetOrThrow("k"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("k2"));
+    EXPECT_EQ(42, C5T_STORAGE(kv2).GetOrThrow("k").foo);
+    EXPECT_FALSE(current::FileSystem::IsDir(dir + "/kv1"));
+  }
+}
+
+TEST(StorageTest, LogBackendCompactionAndRecovery) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const log = dir + "/c5t_storage.log";
+  auto const options = C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::Log);
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    for (int i = 0; i < 100; ++i) {
+      C5T_STORAGE(kv1).Set("k", "v" + current::ToString(i));
+      C5T_STORAGE(kv1).Set("tmp" + current::ToString(i), "x");
+      C5T_STORAGE(kv1).Del("tmp" + current::ToString(i));
+    }
+    uint64_t const size_before_compaction = current::FileSystem::GetFileSize(log);
+    C5T_STORAGE_COMPACT();
+    EXPECT_LT(current::FileSystem::GetFileSize(log) * 100, size_before_compaction);
+    EXPECT_EQ("v99", C5T_STORAGE(kv1).GetOrThrow("k"));
+    C5T_STORAGE(kv1).Set("k2", "v2");
+  }
+
+  uint64_t const size_before_torn_write = current::FileSystem::GetFileSize(log);
+  // Emulate a crash in the middle of appending a record.
+  current::FileSystem::WriteStringToFile(std::string("S\x02\x00\x00\x00\x05", 6), log.c_str(), true);
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ(size_before_torn_write, current::FileSystem::GetFileSize(log));
+    EXPECT_EQ("v99", C5T_STORAGE(kv1).GetOrThrow("k"));
+    EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k2"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("tmp0"));
+    C5T_STORAGE(kv1).Set("k3", "v3");
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ("v3", C5T_STORAGE(kv1).GetOrThrow("k3"));
+  }
+}
+
+TEST(StorageTest, Transactions) {
+  for (auto const backend : {C5T_STORAGE_BACKEND::FilePerKey, C5T_STORAGE_BACKEND::Log, C5T_STORAGE_BACKEND::BTree}) {
+    auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName() +
+                     current::ToString(static_cast<int>(backend));
+    auto const options = C5T_STORAGE_OPTIONS().Backend(backend).FsyncEveryWrite();
+
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      C5T_STORAGE(kv1).Set("k", "v");
+      C5T_STORAGE_TXN([]() {
+        C5T_STORAGE(kv1).Set("k", "v2");
+        C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(1));
+        C5T_STORAGE_TXN([]() { C5T_STORAGE(kv1).Set("k2", "v3"); });
+        // The writes are visible from within the transaction.
+        EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k"));
+      });
+      EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k"));
+
+      struct Rollback final {};
+      EXPECT_THROW(C5T_STORAGE_TXN([]() {
+                     C5T_STORAGE(kv1).Set("k", "nope");
+                     C5T_STORAGE(kv1).Del("k2");
+                     C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(2));
+                     throw Rollback();
+                   }),
+                   Rollback);
+      EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k"));
+      EXPECT_EQ("v3", C5T_STORAGE(kv1).GetOrThrow("k2"));
+      EXPECT_EQ(1, C5T_STORAGE(kv2).GetOrThrow("k").foo);
+
+      // The other threads do not see what is not committed, and, once it is, what is in memory is what is on disk.
+      C5T_STORAGE_TXN([]() {
+        C5T_STORAGE(kv1).Set("r", "a");
+        std::thread([]() {
+          EXPECT_FALSE(C5T_STORAGE(kv1).Has("r"));
+          C5T_STORAGE(kv1).Set("r", "b");
+        }).join();
+        EXPECT_EQ("a", C5T_STORAGE(kv1).GetOrThrow("r"));
+      });
+      EXPECT_EQ("a", C5T_STORAGE(kv1).GetOrThrow("r"));
+    }
+
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k"));
+      EXPECT_EQ("v3", C5T_STORAGE(kv1).GetOrThrow("k2"));
+      EXPECT_EQ(1, C5T_STORAGE(kv2).GetOrThrow("k").foo);
+      EXPECT_EQ("a", C5T_STORAGE(kv1).GetOrThrow("r"));
+    }
+  }
+}
+
+TEST(StorageTest, LogBackendChecksums) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const log = dir + "/c5t_storage.log";
+  std::vector<std::string> logged;
+  auto const options = C5T_STORAGE_OPTIONS()
+                           .Backend(C5T_STORAGE_BACKEND::Log)
+                           .RecoveryThreads(4u)
+                           .Logger([&logged](std::string const& s) { logged.push_back(s); });
+
+  // The known answer of CRC32C.
+  EXPECT_EQ(0xe3069283u, StorageCRC32C("123456789", 9u));
+
+  {
+    // The log of the earlier versions, with no checksums, is read, and rewritten with them.
+    current::FileSystem::MkDir(dir, current::FileSystem::MkDirParameters::Silent);
+    std::string legacy;
+    for (std::string const key : {"a", "b"}) {
+      std::string const value = "\"" + key + key + "\"";
+      uint32_t const lengths[3] = {3u, 1u, static_cast<uint32_t>(value.length())};
+      legacy += 'S' + std::string(reinterpret_cast<char const*>(lengths), sizeof(lengths)) + "kv1" + key + value;
+    }
+    current::FileSystem::WriteStringToFile(legacy, log.c_str());
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ("aa", C5T_STORAGE(kv1).GetOrThrow("a"));
+    EXPECT_EQ("bb", C5T_STORAGE(kv1).GetOrThrow("b"));
+    EXPECT_EQ(2u, C5T_STORAGE_GET_STATS().log_recovered_records);
+    EXPECT_EQ("C5T_LOG2", current::FileSystem::ReadFileAsString(log).substr(0u, 8u));
+    // Enough for the recovery to be split into chunks: ten megabytes, in commits of ten keys.
+    for (int i = 0; i < 100; ++i) {
+      std::vector<C5T_STORAGE_WRITE> writes;
+      for (int j = 0; j < 10; ++j) {
+        std::string const key = current::ToString(i * 10 + j);
+        writes.push_back(C5T_STORAGE_WRITE{"kv1", key, '"' + std::string(10000u, static_cast<char>('a' + j)) + '"'});
+      }
+      C5T_STORAGE_INSTANCE().DoCommit(writes);
+    }
+    C5T_STORAGE(kv1).Set("c", "corrupt me");
+    C5T_STORAGE(kv1).Set("d", "dd");
+  }
+
+  {
+    // Corrupt a record in the middle, and emulate a crash in the middle of appending one.
+    std::string contents = current::FileSystem::ReadFileAsString(log);
+    contents[contents.find("corrupt me")] = 'C';
+    contents += std::string("S\x03\x00\x00\x00\x01", 6);
+    current::FileSystem::WriteStringToFile(contents, log.c_str());
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    C5T_STORAGE_STATS const stats = C5T_STORAGE_GET_STATS();
+    EXPECT_EQ(1u, stats.log_corrupt_records);
+    EXPECT_EQ(6u, stats.log_truncated_bytes);
+    EXPECT_EQ(2u + 1000u + 1u, stats.log_recovered_records);
+    ASSERT_EQ(1u, logged.size());
+    EXPECT_NE(std::string::npos, logged[0].find("1 corrupt records skipped"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("c"));
+    EXPECT_EQ("dd", C5T_STORAGE(kv1).GetOrThrow("d"));
+    EXPECT_EQ("aa", C5T_STORAGE(kv1).GetOrThrow("a"));
+    for (int i = 0; i < 1000; i += 37) {
+      EXPECT_EQ(std::string(10000u, static_cast<char>('a' + i % 10)),
+                C5T_STORAGE(kv1).GetOrThrow(current::ToString(i)));
+    }
+    for (std::string const key : {"e", "f", "g", "h"}) {
+      C5T_STORAGE(kv1).Set(key, key + key);
+    }
+  }
+
+  {
+    // Corrupt the headers of the records in the middle, so that they no longer fit: flip a bit of the length of one,
+    // and overwrite the type of another.
+    std::string contents = current::FileSystem::ReadFileAsString(log);
+    size_t const e = contents.find("kv1e\"ee\"") - kStorageRecordHeaderSize;
+    contents[e + kStorageRecordChecksumOffset - 1u] ^= 0x40;
+    contents[contents.find("kv1g\"gg\"") - kStorageRecordHeaderSize] = 'X';
+    current::FileSystem::WriteStringToFile(contents, log.c_str());
+  }
+
+  {
+    // The records that follow them are found again, rather than cut off.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    C5T_STORAGE_STATS const stats = C5T_STORAGE_GET_STATS();
+    EXPECT_EQ(3u, stats.log_corrupt_records);
+    EXPECT_EQ(0u, stats.log_truncated_bytes);
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("e"));
+    EXPECT_EQ("ff", C5T_STORAGE(kv1).GetOrThrow("f"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("g"));
+    EXPECT_EQ("hh", C5T_STORAGE(kv1).GetOrThrow("h"));
+    EXPECT_EQ("dd", C5T_STORAGE(kv1).GetOrThrow("d"));
+  }
+
+  {
+    // The file-per-key backend writes the values under temporary names first, which a crash may leave behind.
+    auto const fpk = dir + "_file_per_key";
+    current::FileSystem::MkDir(fpk, current::FileSystem::MkDirParameters::Silent);
+    current::FileSystem::WriteStringToFile("\"partial", (fpk + "/c5t_storage.tmp.1").c_str());
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(fpk);
+    EXPECT_THROW(current::FileSystem::ReadFileAsString(fpk + "/c5t_storage.tmp.1"), current::Exception);
+    C5T_STORAGE(kv1).Set("k", "v");
+    EXPECT_EQ("v", C5T_STORAGE(kv1).GetOrThrow("k"));
+  }
+}
+
+TEST(StorageTest, LogBackendGroupCommit) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const log = dir + "/c5t_storage.log";
+  auto const options = C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::Log).FsyncEveryWrite();
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([t]() {
+        for (int i = 0; i < 25; ++i) {
+          // NOTE: The values are JSON-s, since this is what the fields are defined with.
+          std::vector<C5T_STORAGE_WRITE> writes;
+          writes.push_back(C5T_STORAGE_WRITE{"kv1", current::ToString(t * 100 + i), std::string("\"a\"")});
+          writes.push_back(C5T_STORAGE_WRITE{"kv1", current::ToString(t * 100 + i) + "b", std::string("\"b\"")});
+          C5T_STORAGE_INSTANCE().DoCommit(writes);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  uint64_t const size_before_torn_write = current::FileSystem::GetFileSize(log);
+  {
+    // Emulate a crash in the middle of appending a multi-write commit, with its first write complete.
+    std::vector<C5T_STORAGE_WRITE> writes;
+    writes.push_back(C5T_STORAGE_WRITE{"kv1", "torn", std::string("\"x\"")});
+    writes.push_back(C5T_STORAGE_WRITE{"kv1", "torn2", std::string("\"y\"")});
+    std::string record;
+    AppendStorageBatchRecord(record, writes);
+    record.resize(record.length() - 1u);
+    current::FileSystem::WriteStringToFile(record, log.c_str(), true);
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ(size_before_torn_write, current::FileSystem::GetFileSize(log));
+    for (int t = 0; t < 8; ++t) {
+      for (int i = 0; i < 25; ++i) {
+        EXPECT_EQ("a", C5T_STORAGE(kv1).GetOrThrow(current::ToString(t * 100 + i)));
+        EXPECT_EQ("b", C5T_STORAGE(kv1).GetOrThrow(current::ToString(t * 100 + i) + "b"));
+      }
+    }
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("torn"));
+  }
+}
+
+TEST(StorageTest, WriteBehind) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+
+  {
+    // Flush "never", so that the writes stay pending until the storage is destroyed.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+        dir, C5T_STORAGE_OPTIONS().WriteBehind().WriteBehindFlushPeriod(std::chrono::hours(1)));
+    C5T_STORAGE(kv1).Set("k", "v");
+    C5T_STORAGE(kv1).Set("k", "v2");
+    C5T_STORAGE(kv1).Set("k2", "v3");
+    C5T_STORAGE(kv1).Del("k2");
+    C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(42));
+
+    EXPECT_FALSE(current::FileSystem::IsDir(dir + "/kv1"));
+    // The pending writes are visible to the loads, bypassing the in-memory contents of the fields.
+    EXPECT_EQ("\"v2\"", Value(C5T_STORAGE_INSTANCE().DoLoad("kv1", "k")));
+    EXPECT_FALSE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "k2")));
+
+    C5T_STORAGE_STATS const stats = C5T_STORAGE_GET_STATS();
+    EXPECT_EQ(3u, stats.write_behind_queue_depth);
+    EXPECT_EQ(2u, stats.write_behind_coalesced);
+    EXPECT_EQ(0u, stats.write_behind_flushed);
+    EXPECT_GT(stats.write_behind_lag.count(), 0);
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("k"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("k2"));
+    EXPECT_EQ(42, C5T_STORAGE(kv2).GetOrThrow("k").foo);
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+        dir, C5T_STORAGE_OPTIONS().WriteBehind().WriteBehindFlushPeriod(std::chrono::milliseconds(1)));
+    C5T_STORAGE(kv1).Set("k", "v4");
+    while (C5T_STORAGE_GET_STATS().write_behind_flushed < 1u) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().write_behind_queue_depth);
+    EXPECT_EQ("\"v4\"", current::FileSystem::ReadFileAsString(dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv1", "k")));
+  }
+}
+
+TEST(StorageTest, ConcurrentAccess) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+
+  {
+    auto const storage_scope =
+        C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::Log));
+    C5T_STORAGE(kv1).Set("shared", "0");
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([t]() {
+        for (int i = 0; i < 100; ++i) {
+          std::string const key = current::ToString(t) + '_' + current::ToString(i % 10);
+          C5T_STORAGE(kv1).Set(key, current::ToString(i));
+          EXPECT_EQ(current::ToString(i), C5T_STORAGE(kv1).GetOrThrow(key));
+          // Every read of the key all the threads write to sees some complete value.
+          C5T_STORAGE(kv1).Set("shared", current::ToString(t));
+          EXPECT_EQ(1u, C5T_STORAGE(kv1).GetOrThrow("shared").length());
+          if (i % 10 == 9) {
+            C5T_STORAGE(kv1).Del(key);
+            EXPECT_FALSE(C5T_STORAGE(kv1).Has(key));
+          }
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+  }
+
+  {
+    auto const storage_scope =
+        C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::Log));
+    for (int t = 0; t < 8; ++t) {
+      EXPECT_EQ("98", C5T_STORAGE(kv1).GetOrThrow(current::ToString(t) + "_8"));
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has(current::ToString(t) + "_9"));
+    }
+    EXPECT_EQ(1u, C5T_STORAGE(kv1).GetOrThrow("shared").length());
+  }
+}
+
+TEST(StorageTest, BoundedCache) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const options = C5T_STORAGE_OPTIONS()
+                           .Backend(C5T_STORAGE_BACKEND::Log)
+                           .CacheMaxBytesPerField(16u * 1000u)
+                           .CacheMaxNegativeEntriesPerField(16u * 2u);
+  auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+
+  for (int i = 0; i < 1000; ++i) {
+    C5T_STORAGE(kv1).Set("k" + current::ToString(i), std::string(100u, 'x'));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("nope" + current::ToString(i)));
+  }
+  C5T_STORAGE_STATS const stats = C5T_STORAGE_GET_STATS();
+  EXPECT_LE(stats.cache_per_field.at("kv1").bytes, 16u * 1000u);
+  EXPECT_LE(stats.cache_per_field.at("kv1").negative_entries, 16u * 2u);
+  EXPECT_LT(stats.cache_per_field.at("kv1").entries, 1000u);
+  EXPECT_GT(stats.cache.evictions, 0u);
+  EXPECT_EQ(1000u, stats.cache.misses);
+
+  // The evicted keys are re-loaded from disk.
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(100u, C5T_STORAGE(kv1).GetOrThrow("k" + current::ToString(i)).length());
+  }
+  EXPECT_GT(C5T_STORAGE_GET_STATS().cache.misses, 1000u);
+
+  uint64_t const hits_before = C5T_STORAGE_GET_STATS().cache.hits;
+  EXPECT_TRUE(C5T_STORAGE(kv1).Has("k999"));
+  EXPECT_EQ(hits_before + 1u, C5T_STORAGE_GET_STATS().cache.hits);
+}
+
+TEST(StorageTest, Codecs) {
+  {
+    std::string const raw = C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::Raw>(int32_t(42));
+    EXPECT_EQ(kStorageCodecHeaderSize + sizeof(int32_t), raw.length());
+    int32_t x = 0;
+    ASSERT_TRUE(C5T_STORAGE_DECODE(raw, x));
+    EXPECT_EQ(42, x);
+    EXPECT_FALSE(C5T_STORAGE_DECODE(raw.substr(0u, raw.length() - 1u), x));
+  }
+  {
+    std::string s;
+    ASSERT_TRUE(C5T_STORAGE_DECODE(C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::Raw>(std::string("\"-\n")), s));
+    EXPECT_EQ("\"-\n", s);
+  }
+  {
+    SomeJSON x;
+    ASSERT_TRUE(C5T_STORAGE_DECODE(C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::Binary>(SomeJSON().SetFoo(1).SetBar("b")), x));
+    EXPECT_EQ(1, x.foo);
+    EXPECT_EQ("b", Value(x.bar));
+    // The JSON-s have no header, which is how the values stored before the codecs were introduced keep loading.
+    EXPECT_EQ("{\"foo\":2}", C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::JSON>(SomeJSON().SetFoo(2)));
+    ASSERT_TRUE(C5T_STORAGE_DECODE("{\"foo\":2}", x));
+    EXPECT_EQ(2, x.foo);
+    EXPECT_FALSE(C5T_STORAGE_DECODE(std::string("\x01?"), x));
+  }
+
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    C5T_STORAGE(kv3).Set("k", 42);
+    EXPECT_EQ(kStorageCodecHeaderSize + sizeof(int32_t),
+              current::FileSystem::GetFileSize(dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv3", "k")));
+    // Emulate the codec of `kv2` changed from JSON to binary while there are JSON values stored already.
+    C5T_STORAGE(kv2).Set("json", SomeJSON().SetFoo(1));
+    C5T_STORAGE_INSTANCE().DoSave("kv2", "binary", C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::Binary>(SomeJSON().SetFoo(2)));
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ(42, C5T_STORAGE(kv3).GetOrThrow("k"));
+    EXPECT_EQ(1, C5T_STORAGE(kv2).GetOrThrow("json").foo);
+    EXPECT_EQ(2, C5T_STORAGE(kv2).GetOrThrow("binary").foo);
+  }
+}
+
+TEST(StorageTest, Scans) {
+  auto const keys = [](C5T_STORAGE_CURSOR<std::string> it) {
+    std::vector<std::string> result;
+    while (it.Next()) {
+      result.push_back(it.Key() + '=' + it.Value());
+    }
+    return current::strings::Join(result, ',');
+  };
+  for (auto const backend : {C5T_STORAGE_BACKEND::FilePerKey, C5T_STORAGE_BACKEND::Log, C5T_STORAGE_BACKEND::BTree}) {
+    auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName() +
+                     current::ToString(static_cast<int>(backend));
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().Backend(backend));
+      for (std::string const k : {"b2", "a", "b1", "c", "b3", "ba"}) {
+        C5T_STORAGE(kv1).Set(k, k);
+      }
+      EXPECT_EQ("a=a,b1=b1,b2=b2,b3=b3,ba=ba,c=c", keys(C5T_STORAGE(kv1).Range()));
+      C5T_STORAGE(kv1).Del("b2");
+      C5T_STORAGE(kv1).Set("b1", "x");
+      EXPECT_EQ("b1=x,b3=b3,ba=ba", keys(C5T_STORAGE(kv1).Prefix("b", 2u)));
+      EXPECT_EQ("b1=x,b3=b3", keys(C5T_STORAGE(kv1).Range("b0", "b4", 1u)));
+      EXPECT_EQ("ba=ba,c=c", keys(C5T_STORAGE(kv1).Range("b4")));
+      EXPECT_EQ("", keys(C5T_STORAGE(kv1).Prefix("d")));
+    }
+    {
+      // The ordered keys are there after the restart, and merged with the pending writes when writing behind.
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+          dir,
+          C5T_STORAGE_OPTIONS().Backend(backend).WriteBehind().WriteBehindFlushPeriod(std::chrono::hours(1)));
+      EXPECT_EQ("a=a,b1=x,b3=b3,ba=ba,c=c", keys(C5T_STORAGE(kv1).Range()));
+      C5T_STORAGE(kv1).Del("b3");
+      C5T_STORAGE(kv1).Set("b2", "y");
+      C5T_STORAGE(kv1).Set("bb", "z");
+      C5T_STORAGE(kv1).Del("c");
+      EXPECT_EQ("a=a,b1=x,b2=y,ba=ba,bb=z", keys(C5T_STORAGE(kv1).Range("", "", 1u)));
+      EXPECT_EQ("b1=x,b2=y,ba=ba,bb=z", keys(C5T_STORAGE(kv1).Prefix("b", 2u)));
+      EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().write_behind_flushed);
+    }
+  }
+}
+
+TEST(StorageTest, Preload) {
+  for (auto const backend : {C5T_STORAGE_BACKEND::FilePerKey, C5T_STORAGE_BACKEND::Log, C5T_STORAGE_BACKEND::BTree}) {
+    auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName() +
+                     current::ToString(static_cast<int>(backend));
+    auto const options = C5T_STORAGE_OPTIONS().Backend(backend);
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      for (int i = 0; i < 100; ++i) {
+        C5T_STORAGE(kv1).Set("k" + current::ToString(i), "v" + current::ToString(i));
+      }
+      C5T_STORAGE(kv1).Del("k42");
+    }
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      std::vector<std::string> log;
+      EXPECT_EQ(99u,
+                C5T_STORAGE(kv1).Preload(C5T_STORAGE_PRELOAD_OPTIONS().Threads(4u).Logger(
+                    [&log](std::string const& s) { log.push_back(s); })));
+      ASSERT_FALSE(log.empty());
+      EXPECT_EQ(0u, log.back().find("Preloaded `kv1`: 99 of 99 keys, 99 found, ")) << log.back();
+      C5T_STORAGE_CACHE_STATS const stats = C5T_STORAGE_GET_STATS().cache;
+      EXPECT_EQ(99u, stats.misses);
+      EXPECT_EQ("v7", C5T_STORAGE(kv1).GetOrThrow("k7"));
+      EXPECT_EQ(stats.misses, C5T_STORAGE_GET_STATS().cache.misses);
+
+      EXPECT_EQ(1u, C5T_STORAGE(kv1).Preload({"k42", "k43", "nope"}));
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("nope"));
+      EXPECT_EQ(stats.misses + 2u, C5T_STORAGE_GET_STATS().cache.misses);
+    }
+  }
+
+  // What is thrown while loading a key is re-thrown from the thread that preloads.
+  struct LoadFailed final {};
+  EXPECT_THROW(C5T_STORAGE_PRELOAD_Impl(
+                   "kv1",
+                   {"a", "b", "c", "d"},
+                   [](std::string const& key) -> bool {
+                     if (key == "c") {
+                       throw LoadFailed();
+                     }
+                     return true;
+                   },
+                   C5T_STORAGE_PRELOAD_OPTIONS().Threads(2u)),
+               LoadFailed);
+}
+
+TEST(StorageTest, Indexes) {
+  auto const keys = [](std::vector<std::string> const& v) { return current::strings::Join(v, ','); };
+
+  // The integers of all types compare as numbers, and the long strings are cut, yet told apart.
+  EXPECT_LT(C5T_STORAGE_INDEX_VALUE(int64_t(-1)), C5T_STORAGE_INDEX_VALUE(uint64_t(0)));
+  EXPECT_LT(C5T_STORAGE_INDEX_VALUE(std::numeric_limits<int64_t>::max()),
+            C5T_STORAGE_INDEX_VALUE(std::numeric_limits<uint64_t>::max()));
+  EXPECT_EQ(C5T_STORAGE_INDEX_VALUE(int32_t(42)), C5T_STORAGE_INDEX_VALUE(uint64_t(42)));
+  EXPECT_LT(C5T_STORAGE_INDEX_VALUE(std::string("aa")), C5T_STORAGE_INDEX_VALUE(std::string(1000u, 'a')));
+  EXPECT_LT(C5T_STORAGE_INDEX_VALUE(std::string(1000u, 'a')), C5T_STORAGE_INDEX_VALUE(std::string("b")));
+  EXPECT_NE(C5T_STORAGE_INDEX_VALUE(std::string(1000u, 'a')), C5T_STORAGE_INDEX_VALUE(std::string(1001u, 'a')));
+  EXPECT_GT(100u, C5T_STORAGE_INDEX_VALUE(std::string(1000u, 'a')).length());
+
+  for (auto const backend : {C5T_STORAGE_BACKEND::FilePerKey, C5T_STORAGE_BACKEND::Log, C5T_STORAGE_BACKEND::BTree}) {
+    auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName() +
+                     current::ToString(static_cast<int>(backend));
+    auto const options = C5T_STORAGE_OPTIONS().Backend(backend);
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      C5T_STORAGE(kv_indexed).Set("a", SomeJSON().SetFoo(1));
+      C5T_STORAGE(kv_indexed).Set("b", SomeJSON().SetFoo(2));
+      C5T_STORAGE(kv_indexed).Set("c", SomeJSON().SetFoo(1));
+      C5T_STORAGE(kv_indexed).Set("d", SomeJSON().SetFoo(-3));
+      EXPECT_EQ("a,c", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 1)));
+      C5T_STORAGE(kv_indexed).Set("c", SomeJSON().SetFoo(2));
+      C5T_STORAGE(kv_indexed).Del("b");
+      EXPECT_EQ("a", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 1)));
+      EXPECT_EQ("c", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 2)));
+      EXPECT_EQ("d,a,c", keys(C5T_STORAGE(kv_indexed).FindByIndexRange("foo", -10, 10)));
+      EXPECT_EQ("a", keys(C5T_STORAGE(kv_indexed).FindByIndexRange("foo", 0, 2)));
+      EXPECT_EQ("", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 42)));
+      ASSERT_THROW(C5T_STORAGE(kv_indexed).FindByIndex("bar", 1), StorageIndexNotDefinedException);
+
+      // The writes of the transactions that are rolled back do not make it into the index.
+      ASSERT_THROW(C5T_STORAGE_TXN([]() {
+                     C5T_STORAGE(kv_indexed).Set("a", SomeJSON().SetFoo(42));
+                     throw StorageInternalErrorException();
+                   }),
+                   StorageInternalErrorException);
+      EXPECT_EQ("", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 42)));
+      C5T_STORAGE_TXN([]() { C5T_STORAGE(kv_indexed).Set("a", SomeJSON().SetFoo(42)); });
+      EXPECT_EQ("a", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 42)));
+      EXPECT_EQ("", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 1)));
+
+      // Emulate the index defined after some values were stored already.
+      C5T_STORAGE_INSTANCE().DoSave(
+          "kv_indexed", "e", C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::JSON>(SomeJSON().SetFoo(2)));
+      C5T_STORAGE_INSTANCE().DoDelete(C5T_STORAGE_INDEX_FIELD("kv_indexed", "foo"), kStorageIndexBuiltMarker);
+    }
+    {
+      // The index is persisted, and it is rebuilt as it is used for the first time, if needed.
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+      EXPECT_EQ("c,e", keys(C5T_STORAGE(kv_indexed).FindByIndex("foo", 2)));
+      EXPECT_EQ("d,c,e,a", keys(C5T_STORAGE(kv_indexed).FindByIndexRange("foo", -3, 43)));
+    }
+  }
+}
+
+TEST(StorageTest, ChangesPublished) {
+  struct Collector final {
+    std::vector<std::string>& out;
+    Collector(std::vector<std::string>& out) : out(out) {}
+    void OnEvent(C5T_STORAGE_CHANGES<SomeJSON> const& e) {
+      std::vector<std::string> changes;
+      for (auto const& c : e.changes) {
+        changes.push_back(c.key + ':' + (c.before ? current::ToString(c.before->foo) : "") + "->" +
+                          (c.after ? current::ToString(c.after->foo) : ""));
+      }
+      out.push_back(e.field + '{' + current::strings::Join(changes, ',') + '}');
+    }
+    void OnBatchDone() {}
+    void OnShutdown() {}
+  };
+
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+  C5T_STORAGE(kv2).Set("a", SomeJSON().SetFoo(1));
+
+  auto const topic = Topic<C5T_STORAGE_CHANGES<SomeJSON>>("kv2");
+  std::vector<std::string> events;
+  {
+    auto const cdc_scope = C5T_STORAGE_PUBLISH_CHANGES(kv2, topic);
+    ActorSubscriberScope const subscriber_scope = C5T_SUBSCRIBE<Collector>(topic, events);
+    C5T_STORAGE(kv2).Set("a", SomeJSON().SetFoo(2));
+    C5T_STORAGE(kv2).Set("b", SomeJSON().SetFoo(3));
+    C5T_STORAGE_TXN([]() {
+      C5T_STORAGE(kv2).Del("a");
+      C5T_STORAGE(kv1).Set("x", "not published");
+      C5T_STORAGE(kv2).Set("b", SomeJSON().SetFoo(4));
+      C5T_STORAGE(kv2).Set("c", SomeJSON().SetFoo(5));
+    });
+    ASSERT_THROW(C5T_STORAGE_TXN([]() {
+                   C5T_STORAGE(kv2).Set("c", SomeJSON().SetFoo(6));
+                   throw StorageInternalErrorException();
+                 }),
+                 StorageInternalErrorException);
+    C5T_STORAGE(kv2).Del("nope");
+    C5T_ACTORS_DEBUG_WAIT_FOR_ALL_EVENTS_TO_PROPAGATE();
+  }
+  C5T_STORAGE(kv2).Del("c");
+  EXPECT_EQ("kv2{a:1->2}, kv2{b:->3}, kv2{a:2->,b:3->4,c:->5}", current::strings::Join(events, ", "));
+}
+
+TEST(StorageTest, BloomFilter) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const persisted = [&dir]() {
+    try {
+      current::FileSystem::GetFileSize(dir + "/c5t_storage.bloom.kv1");
+      return true;
+    } catch (current::Exception const&) {
+      return false;
+    }
+  };
+  // The filters are loaded or built in the background, and are not looked at until then.
+  auto const wait_for_filters = []() {
+    while (C5T_STORAGE_GET_STATS().bloom.filters < C5T_STORAGE_INSTANCE().FieldsCount()) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  };
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    wait_for_filters();
+    // More than the initial capacity of the filter, so that it is grown along the way.
+    for (int i = 0; i < 3000; ++i) {
+      C5T_STORAGE(kv1).Set("k" + current::ToString(i), "v");
+    }
+    for (int i = 0; i < 1000; ++i) {
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("nope" + current::ToString(i)));
+    }
+    C5T_STORAGE_BLOOM_STATS const stats = C5T_STORAGE_GET_STATS().bloom;
+    EXPECT_EQ(1000u, stats.negatives + stats.false_positives);
+    EXPECT_LT(stats.false_positives, 50u);
+    EXPECT_EQ(0.01, stats.configured_false_positive_rate);
+    EXPECT_LT(stats.estimated_false_positive_rate, 0.05);
+  }
+  EXPECT_TRUE(persisted());
+  {
+    // The filter is loaded from disk, and is removed from there as long as it is in use.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    wait_for_filters();
+    for (int i = 0; i < 3000; i += 7) {
+      EXPECT_TRUE(C5T_STORAGE(kv1).Has("k" + current::ToString(i)));
+    }
+    EXPECT_FALSE(persisted());
+    C5T_STORAGE(kv1).Set("new", "v");
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("nope" + current::ToString(i)));
+    }
+    EXPECT_GT(C5T_STORAGE_GET_STATS().bloom.negatives, 90u);
+    EXPECT_EQ(C5T_STORAGE_INSTANCE().FieldsCount(), C5T_STORAGE_GET_STATS().bloom.filters);
+  }
+  {
+    // Disabled.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().BloomFalsePositiveRate(0));
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("new"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("nope"));
+    EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().bloom.lookups);
+    EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().bloom.filters);
+    // The persisted filter would not know of this key, so it is removed.
+    EXPECT_TRUE(persisted());
+    C5T_STORAGE(kv1).Set("disabled", "v");
+    EXPECT_FALSE(persisted());
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("disabled"));
+    // Only the filters that are ready are persisted.
+    wait_for_filters();
+  }
+  EXPECT_TRUE(persisted());
+  {
+    // Same for the writes made before the filter is loaded, which it knows of once it is.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    C5T_STORAGE_INSTANCE().DoSave("kv1", "unloaded", "\"v\"");
+    EXPECT_FALSE(persisted());
+    wait_for_filters();
+    EXPECT_TRUE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "unloaded")));
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("unloaded"));
+  }
+}
+
+TEST(StorageTest, Snapshots) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  // A small cache, so that the values the snapshot needs would be evicted if they were not kept.
+  auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().CacheMaxBytesPerField(2000u));
+  for (int i = 0; i < 100; ++i) {
+    C5T_STORAGE(kv1).Set("k" + current::ToString(i), "old");
+  }
+  {
+    auto const snapshot = C5T_STORAGE_SNAPSHOT();
+    EXPECT_EQ("old", C5T_STORAGE(kv1).GetOrThrow("k0"));
+    std::thread([]() {
+      // Not blocked by the snapshot, and does not see it.
+      for (int i = 0; i < 100; ++i) {
+        C5T_STORAGE(kv1).Set("k" + current::ToString(i), "new");
+      }
+      C5T_STORAGE(kv1).Del("k1");
+      C5T_STORAGE(kv1).Set("added", "new");
+      EXPECT_THROW(C5T_STORAGE_TXN([]() {
+                     C5T_STORAGE(kv1).Set("k2", "rolled back");
+                     throw StorageInternalErrorException();
+                   }),
+                   StorageInternalErrorException);
+      EXPECT_EQ("new", C5T_STORAGE(kv1).GetOrThrow("k0"));
+    }).join();
+    for (int i = 0; i < 100; ++i) {
+      EXPECT_EQ("old", C5T_STORAGE(kv1).GetOrDefault("k" + current::ToString(i))) << i;
+    }
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("added"));
+    {
+      auto const newer_snapshot = C5T_STORAGE_SNAPSHOT();
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("k1"));
+      EXPECT_EQ("new", C5T_STORAGE(kv1).GetOrThrow("k2"));
+    }
+    EXPECT_EQ("old", C5T_STORAGE(kv1).GetOrThrow("k1"));
+  }
+  EXPECT_EQ("new", C5T_STORAGE(kv1).GetOrThrow("k0"));
+  EXPECT_FALSE(C5T_STORAGE(kv1).Has("k1"));
+  EXPECT_EQ("new", C5T_STORAGE(kv1).GetOrThrow("added"));
+  // The versions kept for the snapshot are dropped, and the cache is within its limit again.
+  EXPECT_LE(C5T_STORAGE_GET_STATS().cache_per_field["kv1"].bytes, 2000u);
+  // The snapshots taken while the transactions are committed see each of them either as a whole or not at all.
+  std::atomic_bool done(false);
+  std::thread writer([&done]() {
+    for (int i = 0; i < 300; ++i) {
+      C5T_STORAGE_TXN([i]() {
+        for (int j = 0; j < 10; ++j) {
+          C5T_STORAGE(kv1).Set("t" + current::ToString(j), current::ToString(i));
+        }
+        C5T_STORAGE(kv2).Set("t", SomeJSON().SetFoo(i));
+      });
+    }
+    done = true;
+  });
+  std::vector<std::thread> readers;
+  for (int t = 0; t < 4; ++t) {
+    readers.emplace_back([&done]() {
+      while (!done) {
+        auto const snapshot = C5T_STORAGE_SNAPSHOT();
+        std::string const v = C5T_STORAGE(kv1).GetOrDefault("t0");
+        for (int j = 1; j < 10; ++j) {
+          EXPECT_EQ(v, C5T_STORAGE(kv1).GetOrDefault("t" + current::ToString(j)));
+        }
+        Optional<SomeJSON> const o = C5T_STORAGE(kv2).Get("t");
+        EXPECT_EQ(v, Exists(o) ? current::ToString(Value(o).foo) : "");
+      }
+    });
+  }
+  writer.join();
+  for (auto& t : readers) {
+    t.join();
+  }
+}
+
+TEST(StorageTest, BTreeBackend) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const options = C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::BTree);
+  auto const key = [](int i) { return "k" + current::ToString(10000 + i); };
+  std::string const large(10000u, 'x');
+
+  uint64_t pages = 0u;
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    // Enough keys for the tree to be several levels deep, committed in batches.
+    for (int j = 0; j < 20; ++j) {
+      C5T_STORAGE_TXN([&]() {
+        for (int i = j * 100; i < (j + 1) * 100; ++i) {
+          C5T_STORAGE(kv1).Set(key(i), std::string(50u, 'a' + i % 26));
+        }
+      });
+    }
+    C5T_STORAGE(kv1).Set("large", large);
+    for (int i = 0; i < 2000; i += 2) {
+      C5T_STORAGE(kv1).Del(key(i));
+    }
+    EXPECT_THROW(C5T_STORAGE(kv1).Set(std::string(2000u, 'k'), "v"), StorageKeyTooLongException);
+    pages = C5T_STORAGE_GET_STATS().btree_pages;
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ(large, C5T_STORAGE(kv1).GetOrThrow("large"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has(key(0)));
+    EXPECT_EQ(std::string(50u, 'b'), C5T_STORAGE(kv1).GetOrThrow(key(1)));
+    size_t count = 0u;
+    auto it = C5T_STORAGE(kv1).Range(key(0), key(2000));
+    while (it.Next()) {
+      ++count;
+    }
+    EXPECT_EQ(1000u, count);
+    EXPECT_EQ(pages, C5T_STORAGE_GET_STATS().btree_pages);
+    // Once the pages freed by the first overwrites can be reused, overwriting no longer grows the file.
+    for (int k = 0; k < 2; ++k) {
+      C5T_STORAGE(kv1).Set("large", large + current::ToString(k));
+    }
+    pages = C5T_STORAGE_GET_STATS().btree_pages;
+    for (int k = 0; k < 10; ++k) {
+      C5T_STORAGE(kv1).Set("large", large + current::ToString(k));
+    }
+    EXPECT_EQ(pages, C5T_STORAGE_GET_STATS().btree_pages);
+    EXPECT_LT(0u, C5T_STORAGE_GET_STATS().btree_free_pages);
+    for (int i = 1; i < 2000; i += 2) {
+      C5T_STORAGE(kv1).Del(key(i));
+    }
+    C5T_STORAGE(kv1).Del("large");
+  }
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_FALSE(C5T_STORAGE(kv1).Range().Next());
+    C5T_STORAGE(kv1).Set("k", "v");
+    EXPECT_EQ("v", C5T_STORAGE(kv1).GetOrThrow("k"));
+  }
+
+  // The longest keys with the values around the longest kept in the nodes, and a free list of several pages.
+  std::string const long_key(1018u, 'k');
+  uint64_t free_pages = 0u;
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    for (int i = 0; i < 10; ++i) {
+      C5T_STORAGE(kv1).Set(long_key + current::ToString(10 + i), std::string(1020u, 'a' + i));
+    }
+    C5T_STORAGE_TXN([&]() {
+      for (int i = 0; i < 1000; ++i) {
+        C5T_STORAGE(kv1).Set(key(i), std::string(5000u, 'o'));
+      }
+    });
+    C5T_STORAGE_TXN([&]() {
+      for (int i = 0; i < 1000; ++i) {
+        C5T_STORAGE(kv1).Del(key(i));
+      }
+    });
+    free_pages = C5T_STORAGE_GET_STATS().btree_free_pages;
+    EXPECT_LT(2000u, free_pages);
+    pages = C5T_STORAGE_GET_STATS().btree_pages;
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    for (int i = 0; i < 10; ++i) {
+      EXPECT_EQ(std::string(1020u, 'a' + i), C5T_STORAGE(kv1).GetOrThrow(long_key + current::ToString(10 + i)));
+    }
+    EXPECT_EQ(free_pages, C5T_STORAGE_GET_STATS().btree_free_pages);
+    for (int i = 0; i < 100; ++i) {
+      C5T_STORAGE(kv1).Set(key(i), std::string(5000u, 'o'));
+    }
+    EXPECT_EQ(pages, C5T_STORAGE_GET_STATS().btree_pages);
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ(std::string(5000u, 'o'), C5T_STORAGE(kv1).GetOrThrow(key(99)));
+    EXPECT_EQ(std::string(1020u, 'j'), C5T_STORAGE(kv1).GetOrThrow(long_key + "19"));
+  }
+
+  // The concurrent commits are written in groups, and the reads see each of them whole, while they are being written.
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS(options).FsyncEveryWrite());
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+    std::thread reader([&]() {
+      while (!done) {
+        for (int t = 0; t < 8; ++t) {
+          for (int i = 0; i < 25; ++i) {
+            std::string const k = "g" + current::ToString(t * 100 + i);
+            if (Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", k + "b")) &&
+                !Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", k))) {
+              ++torn;
+            }
+          }
+        }
+      }
+    });
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 8; ++t) {
+      threads.emplace_back([t]() {
+        for (int i = 0; i < 25; ++i) {
+          std::string const k = "g" + current::ToString(t * 100 + i);
+          std::vector<C5T_STORAGE_WRITE> writes;
+          writes.push_back(C5T_STORAGE_WRITE{"kv1", k, std::string("\"a\"")});
+          writes.push_back(C5T_STORAGE_WRITE{"kv1", k + "b", std::string("\"b\"")});
+          C5T_STORAGE_INSTANCE().DoCommit(writes);
+        }
+      });
+    }
+    for (auto& t : threads) {
+      t.join();
+    }
+    done = true;
+    reader.join();
+    EXPECT_EQ(0, torn.load());
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    for (int t = 0; t < 8; ++t) {
+      for (int i = 0; i < 25; ++i) {
+        EXPECT_EQ("a", C5T_STORAGE(kv1).GetOrThrow("g" + current::ToString(t * 100 + i)));
+        EXPECT_EQ("b", C5T_STORAGE(kv1).GetOrThrow("g" + current::ToString(t * 100 + i) + "b"));
+      }
+    }
+  }
+}
+
+TEST(StorageTest, TTLs) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+
+  {
+    // No sweeper: the keys that have expired read as if they do not exist, but stay on disk.
+    auto const storage_scope =
+        C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, C5T_STORAGE_OPTIONS().TTLSweepPeriod(std::chrono::milliseconds(0)));
+    C5T_STORAGE(kv1).Set("short", "v", std::chrono::milliseconds(50));
+    C5T_STORAGE(kv1).Set("long", "v", std::chrono::hours(1));
+    C5T_STORAGE(kv1).Set("reset", "v", std::chrono::milliseconds(50));
+    C5T_STORAGE(kv1).Set("reset", "v2");
+    C5T_STORAGE(kv1).Set("forever", "v");
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("short"));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("short"));
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("long"));
+    EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("reset"));
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("forever"));
+    EXPECT_TRUE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "short")));
+    EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().ttl_swept);
+  }
+
+  {
+    // The expiration times are persisted, and the sweeper deletes what has expired, one key per sweep here.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+        dir, C5T_STORAGE_OPTIONS().TTLSweepPeriod(std::chrono::milliseconds(1)).TTLSweepMaxKeys(1u));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("short"));
+    EXPECT_TRUE(C5T_STORAGE(kv1).Has("long"));
+    for (int i = 0; i < 5; ++i) {
+      C5T_STORAGE(kv1).Set("tmp" + current::ToString(i), "v", std::chrono::microseconds(1));
+    }
+    while (C5T_STORAGE_GET_STATS().ttl_swept < 6u) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_FALSE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "short")));
+    EXPECT_FALSE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "tmp0")));
+    EXPECT_EQ("v2", C5T_STORAGE(kv1).GetOrThrow("reset"));
+    // What is left of the expiration times is of `long` only.
+    std::vector<std::string> ttl_keys;
+    C5T_STORAGE_INSTANCE().DoListKeys(C5T_STORAGE_TTL_FIELD("kv1"),
+                                      [&ttl_keys](std::string const& key) { ttl_keys.push_back(key); });
+    ASSERT_EQ(2u, ttl_keys.size());
+    EXPECT_EQ("klong", ttl_keys[0]);
+    EXPECT_EQ(".long", ttl_keys[1].substr(ttl_keys[1].length() - 5u));
+  }
+
+  {
+    // The sweeper is off by default. Emulate a stale entry, which expires before the key that is set here.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    C5T_STORAGE_INSTANCE().DoSave(C5T_STORAGE_TTL_FIELD("kv1"), C5T_STORAGE_TTL_DEADLINE(1u, "ghost"), "");
+    C5T_STORAGE(kv1).Set("soon", "v", std::chrono::microseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_EQ(0u, C5T_STORAGE_GET_STATS().ttl_swept);
+  }
+
+  {
+    // The field is not used, and the stale entry does not hold up the sweeper, which is removed along the way.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(
+        dir, C5T_STORAGE_OPTIONS().TTLSweepPeriod(std::chrono::milliseconds(1)).TTLSweepMaxKeys(1u));
+    while (C5T_STORAGE_GET_STATS().ttl_swept < 1u) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    EXPECT_FALSE(Exists(C5T_STORAGE_INSTANCE().DoLoad("kv1", "soon")));
+    EXPECT_FALSE(Exists(C5T_STORAGE_INSTANCE().DoLoad(C5T_STORAGE_TTL_FIELD("kv1"),
+                                                      C5T_STORAGE_TTL_DEADLINE(1u, "ghost"))));
+  }
+}
+
+TEST(StorageTest, HandlesAndBatches) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto kv1 = C5T_STORAGE_HANDLE(kv1);
+  auto kv2 = C5T_STORAGE_HANDLE(kv2);
+  auto const options = C5T_STORAGE_OPTIONS().Backend(C5T_STORAGE_BACKEND::BTree);
+
+  EXPECT_THROW(kv1(), StorageNotInitializedException);
+
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    kv1().MultiSet(std::map<std::string, std::string>{{"a", "1"}, {"b", "2"}, {"c", "3"}});
+    kv2().MultiSet(std::vector<std::pair<std::string, SomeJSON>>{{"x", SomeJSON().SetFoo(42)}});
+    EXPECT_EQ("2", C5T_STORAGE(kv1).GetOrThrow("b"));
+    EXPECT_EQ(42, kv2().GetOrThrow("x").foo);
+
+    kv1().MultiDel({"a", "nope"});
+    auto const values = kv1().MultiGet({"a", "b", "c", "nope"});
+    ASSERT_EQ(4u, values.size());
+    EXPECT_FALSE(Exists(values[0]));
+    EXPECT_EQ("2", Value(values[1]));
+    EXPECT_EQ("3", Value(values[2]));
+    EXPECT_FALSE(Exists(values[3]));
+
+    // A batch is a transaction: all or nothing, also when the backend rejects it.
+    EXPECT_THROW(kv1().MultiSet(std::map<std::string, std::string>{{"d", "4"}, {std::string(2000u, 'k'), "5"}}),
+                 StorageKeyTooLongException);
+    EXPECT_FALSE(kv1().Has("d"));
+  }
+
+  {
+    // The handles are resolved again for the new storage instance.
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    EXPECT_EQ("3", kv1().GetOrThrow("c"));
+    EXPECT_FALSE(kv1().Has("d"));
+    EXPECT_EQ(42, kv2(C5T_STORAGE_INSTANCE()).GetOrThrow("x").foo);
+  }
+}
+
+TEST(StorageTest, SharedReads) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+  C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(1).SetBar("one"));
+  std::string const buffer = "[k]";
+  std::string_view const key = std::string_view(buffer).substr(1u, 1u);
+  std::shared_ptr<SomeJSON const> const p = C5T_STORAGE(kv2).GetShared(key);
+  ASSERT_TRUE(p != nullptr);
+  EXPECT_EQ("one", Value(p->bar));
+  // No copies: the same value is returned while it is not changed, and the one returned before stays as it was.
+  EXPECT_EQ(p.get(), C5T_STORAGE(kv2).GetShared("k").get());
+  C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(2).SetBar("two"));
+  EXPECT_EQ(1, p->foo);
+  EXPECT_EQ(2, C5T_STORAGE(kv2).GetShared(key)->foo);
+  EXPECT_TRUE(C5T_STORAGE(kv2).GetShared("nope") == nullptr);
+  EXPECT_TRUE(C5T_STORAGE(kv2).Has(key));
+  EXPECT_EQ(2, C5T_STORAGE(kv2).GetOrThrow(key).foo);
+  {
+    // The snapshots see what was there as of when they began.
+    auto const snapshot = C5T_STORAGE_SNAPSHOT();
+    C5T_STORAGE(kv2).Set("k", SomeJSON().SetFoo(3));
+    EXPECT_EQ(2, C5T_STORAGE(kv2).GetShared(key)->foo);
+  }
+  EXPECT_EQ(3, C5T_STORAGE(kv2).GetShared(key)->foo);
+}
+
+TEST(StorageTest, FilePerKeyFanOut) {
+  auto const keys = [](C5T_STORAGE_CURSOR<std::string> it) {
+    std::vector<std::string> result;
+    while (it.Next()) {
+      result.push_back(it.Key());
+    }
+    return current::strings::Join(result, ',');
+  };
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  // Emulate the storage written by the earlier versions, with the keys as `field/key`. One of the keys is named
+  // the same as the directories of the fan-out.
+  current::FileSystem::MkDir(dir, current::FileSystem::MkDirParameters::Silent);
+  current::FileSystem::MkDir(dir + "/kv1", current::FileSystem::MkDirParameters::Silent);
+  for (std::string const key : {"a", "b", "ab", "c5"}) {
+    current::FileSystem::WriteStringToFile("\"" + key + key + "\"", (dir + "/kv1/" + key).c_str());
+  }
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ("aa", C5T_STORAGE(kv1).GetOrThrow("a"));
+    EXPECT_EQ("abab", C5T_STORAGE(kv1).GetOrThrow("ab"));
+    EXPECT_EQ("c5c5", C5T_STORAGE(kv1).GetOrThrow("c5"));
+    EXPECT_TRUE(current::FileSystem::IsDir(dir + '/' + C5T_STORAGE_FILE_PER_KEY_DIR("kv1", "b")));
+    EXPECT_FALSE(current::FileSystem::IsDir(dir + "/c5t_storage.migrating.kv1"));
+    C5T_STORAGE(kv1).Set("d", "dd");
+    C5T_STORAGE(kv1).Del("b");
+    EXPECT_EQ("a,ab,c5,d", keys(C5T_STORAGE(kv1).Range()));
+  }
+  EXPECT_EQ("\"aa\"", current::FileSystem::ReadFileAsString(dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv1", "a")));
+  EXPECT_EQ("\"dd\"", current::FileSystem::ReadFileAsString(dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv1", "d")));
+  {
+    // Reopens in the new layout, with the migration interrupted midway: some keys still in the staging directory.
+    current::FileSystem::MkDir(dir + "/c5t_storage.migrating.kv1", current::FileSystem::MkDirParameters::Silent);
+    current::FileSystem::RenameFile(dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv1", "a"),
+                                    dir + "/c5t_storage.migrating.kv1/a");
+    current::FileSystem::WriteStringToFile("\"ee\"", (dir + "/kv1/e").c_str());
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ("a,ab,c5,d,e", keys(C5T_STORAGE(kv1).Range()));
+    EXPECT_EQ("aa", C5T_STORAGE(kv1).GetOrThrow("a"));
+    EXPECT_EQ("ee", C5T_STORAGE(kv1).GetOrThrow("e"));
+    EXPECT_FALSE(C5T_STORAGE(kv1).Has("b"));
+  }
+  {
+    // Only the keys are moved through the staging directory, the directories of the fan-out stay where they are.
+    current::FileSystem::WriteStringToFile("\"ff\"", (dir + "/kv1/f").c_str());
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ("a,ab,c5,d,e,f", keys(C5T_STORAGE(kv1).Range()));
+    EXPECT_EQ("ff", C5T_STORAGE(kv1).GetOrThrow("f"));
+    EXPECT_FALSE(current::FileSystem::IsDir(dir + "/c5t_storage.migrating.kv1"));
+  }
+  {
+    // The ordered keys are listed anew unless the storage was closed cleanly, as they may miss the last writes.
+    // Emulate the crash after a write, which leaves neither this mark nor the Bloom filter behind.
+    EXPECT_EQ(0u, current::FileSystem::GetFileSize(dir + "/c5t_storage.keys.clean"));
+    current::FileSystem::RmFile(dir + "/c5t_storage.keys.clean");
+    current::FileSystem::RmFile(dir + "/c5t_storage.bloom.kv1");
+    std::string const g = dir + '/' + C5T_STORAGE_FILE_PER_KEY_DIR("kv1", "g");
+    current::FileSystem::MkDir(g.substr(0u, g.length() - 3u), current::FileSystem::MkDirParameters::Silent);
+    current::FileSystem::MkDir(g, current::FileSystem::MkDirParameters::Silent);
+    current::FileSystem::WriteStringToFile("\"gg\"", (dir + '/' + C5T_STORAGE_FILE_PER_KEY_PATH("kv1", "g")).c_str());
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir);
+    EXPECT_EQ("a,ab,c5,d,e,f,g", keys(C5T_STORAGE(kv1).Range()));
+  }
+}
+
+TEST(StorageTest, ExportImport) {
+  auto const key = [](int i) { return "k" + current::ToString(1000 + i); };
+  std::string const a(100u, 'a');
+  for (auto const backend : {C5T_STORAGE_BACKEND::FilePerKey, C5T_STORAGE_BACKEND::Log, C5T_STORAGE_BACKEND::BTree}) {
+    auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName() +
+                     current::ToString(static_cast<int>(backend));
+    auto const options = C5T_STORAGE_OPTIONS().Backend(backend).TrackChanges();
+    std::string full;
+    std::string incremental;
+    uint64_t as_of;
+    uint64_t incremental_as_of;
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_from", options);
+      for (int i = 0; i < 2000; ++i) {
+        C5T_STORAGE(kv1).Set(key(i), a);
+      }
+      C5T_STORAGE(kv1).Set("ttl", "v", std::chrono::hours(1));
+      C5T_STORAGE(kv_indexed).Set("x", SomeJSON().SetFoo(1));
+      // The writes made while the export runs, both to the keys already exported and to the ones not yet, are not in
+      // the export. The first chunk is passed on once the first page of keys is exported.
+      bool written = false;
+      as_of = C5T_STORAGE_EXPORT([&](std::string const& chunk) {
+        full += chunk;
+        if (!written) {
+          written = true;
+          C5T_STORAGE(kv1).Set(key(0), "b");
+          C5T_STORAGE(kv1).Set(key(1999), "b");
+          C5T_STORAGE(kv1).Del(key(1998));
+          C5T_STORAGE(kv1).Set("new", "b");
+          C5T_STORAGE(kv_indexed).Set("x", SomeJSON().SetFoo(2));
+        }
+      });
+      EXPECT_TRUE(written);
+      C5T_STORAGE(kv1).Set(key(1), "c");
+      incremental_as_of = C5T_STORAGE_EXPORT([&](std::string const& chunk) { incremental += chunk; }, as_of);
+      EXPECT_EQ(as_of + 6u, incremental_as_of);
+    }
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_to", options);
+      std::istringstream in(full);
+      EXPECT_EQ(as_of, C5T_STORAGE_IMPORT(in));
+    }
+    {
+      auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_to", options);
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(0)));
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(1998)));
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(1999)));
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("new"));
+      EXPECT_EQ("v", C5T_STORAGE(kv1).GetOrThrow("ttl"));
+      EXPECT_EQ(1, C5T_STORAGE(kv_indexed).GetOrThrow("x").foo);
+      EXPECT_EQ(1u, C5T_STORAGE(kv_indexed).FindByIndex("foo", 1).size());
+      // The changes made since are exported since the export of what is imported.
+      std::string since_import;
+      C5T_STORAGE(kv1).Set(key(2), "d");
+      EXPECT_EQ(as_of + 1u, C5T_STORAGE_EXPORT([&](std::string const& chunk) { since_import += chunk; }, as_of));
+      EXPECT_NE(std::string::npos, since_import.find(key(2)));
+      EXPECT_EQ(std::string::npos, since_import.find(key(3)));
+      // Which makes the storage no longer as of the export the incremental one follows.
+      std::istringstream in(incremental);
+      EXPECT_THROW(C5T_STORAGE_IMPORT(in), StorageImportFailedException);
+      EXPECT_EQ("d", C5T_STORAGE(kv1).GetOrThrow(key(2)));
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(0)));
+    }
+    {
+      // Without the changes tracked, the storage is as of the export it has imported once opened again too.
+      auto const storage_scope =
+          C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_replica", C5T_STORAGE_OPTIONS().Backend(backend));
+      std::istringstream in(full);
+      EXPECT_EQ(as_of, C5T_STORAGE_IMPORT(in));
+    }
+    {
+      auto const storage_scope =
+          C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_replica", C5T_STORAGE_OPTIONS().Backend(backend));
+      std::istringstream in(incremental);
+      EXPECT_EQ(incremental_as_of, C5T_STORAGE_IMPORT(in));
+    }
+    {
+      auto const storage_scope =
+          C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_replica", C5T_STORAGE_OPTIONS().Backend(backend));
+      EXPECT_EQ("b", C5T_STORAGE(kv1).GetOrThrow(key(0)));
+      EXPECT_EQ("c", C5T_STORAGE(kv1).GetOrThrow(key(1)));
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(2)));
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has(key(1998)));
+      EXPECT_EQ("b", C5T_STORAGE(kv1).GetOrThrow(key(1999)));
+      EXPECT_EQ("b", C5T_STORAGE(kv1).GetOrThrow("new"));
+      EXPECT_EQ(a, C5T_STORAGE(kv1).GetOrThrow(key(3)));
+      EXPECT_EQ(2, C5T_STORAGE(kv_indexed).GetOrThrow("x").foo);
+      EXPECT_EQ(0u, C5T_STORAGE(kv_indexed).FindByIndex("foo", 1).size());
+      EXPECT_EQ(1u, C5T_STORAGE(kv_indexed).FindByIndex("foo", 2).size());
+      // The writes made while the export runs are not in it without the changes tracked either.
+      std::string replica;
+      C5T_STORAGE_EXPORT([&](std::string const& chunk) {
+        if (replica.empty()) {
+          C5T_STORAGE(kv1).Set(key(1999), "e");
+        }
+        replica += chunk;
+      });
+      EXPECT_NE(std::string::npos, replica.find(key(1999) + "\"b\""));
+      EXPECT_EQ(std::string::npos, replica.find(key(1999) + "\"e\""));
+      EXPECT_EQ("e", C5T_STORAGE(kv1).GetOrThrow(key(1999)));
+    }
+    {
+      // The exports cut short or damaged are rejected, and so are the incremental ones into the storage that has not
+      // imported what they follow. Without the changes tracked, the incremental exports are rejected too.
+      auto const storage_scope =
+          C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir + "_broken", C5T_STORAGE_OPTIONS().Backend(backend));
+      std::istringstream truncated(full.substr(0u, full.length() - 1u));
+      EXPECT_THROW(C5T_STORAGE_IMPORT(truncated), StorageImportFailedException);
+      std::istringstream not_since(incremental);
+      EXPECT_THROW(C5T_STORAGE_IMPORT(not_since), StorageImportFailedException);
+      EXPECT_FALSE(C5T_STORAGE(kv1).Has("new"));
+      std::string damaged = incremental;
+      damaged[damaged.length() / 2u] ^= 1;
+      std::istringstream in(damaged);
+      EXPECT_THROW(C5T_STORAGE_IMPORT(in), StorageImportFailedException);
+      EXPECT_THROW(C5T_STORAGE_EXPORT([](std::string const&) {}, as_of), StorageChangesNotTrackedException);
+    }
+  }
+}
+
+TEST(StorageTest, Views) {
+  auto const dir = current::Singleton<TestStorageDir>().dir + '/' + CurrentTestName();
+  auto const options = C5T_STORAGE_OPTIONS().TTLSweepPeriod(std::chrono::milliseconds(0));
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    C5T_STORAGE(kv2).Set("a", SomeJSON().SetFoo(1).SetBar("one"));
+    C5T_STORAGE(kv2).Set("b", SomeJSON().SetFoo(2));
+    C5T_STORAGE(kv2).Set("t", SomeJSON().SetFoo(3), std::chrono::milliseconds(50));
+    C5T_STORAGE_INSTANCE().DoSave("kv2", "c", R"({"bar":"},\"foo\":3,{[","foo":42})");
+    C5T_STORAGE_INSTANCE().DoSave("kv2", "d", C5T_STORAGE_ENCODE<C5T_STORAGE_CODEC::Binary>(SomeJSON().SetFoo(4)));
+    C5T_STORAGE_INSTANCE().DoSave("kv2", "e", R"({"foo":5,"bar":[5]})");
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  {
+    auto const storage_scope = C5T_STORAGE_CREATE_UNIQUE_INSANCE(dir, options);
+    auto const a = C5T_STORAGE(kv2).View("a");
+    ASSERT_TRUE(static_cast<bool>(a));
+    EXPECT_EQ(1, C5T_STORAGE_VIEW_GET(a, foo));
+    EXPECT_EQ("one", Value(C5T_STORAGE_VIEW_GET(a, bar)));
+    auto const b = C5T_STORAGE(kv2).View("b");
+    EXPECT_EQ(2, C5T_STORAGE_VIEW_GET(b, foo));
+    EXPECT_FALSE(Exists(C5T_STORAGE_VIEW_GET(b, bar)));
+    // Only the JSON of the member read is parsed, the rest is skipped over, as tricky as it may be.
+    auto const c = C5T_STORAGE(kv2).View("c");
+    EXPECT_EQ(42, C5T_STORAGE_VIEW_GET(c, foo));
+    EXPECT_EQ("},\"foo\":3,{[", Value(C5T_STORAGE_VIEW_GET(c, bar)));
+    // The other codecs are decoded as a whole.
+    EXPECT_EQ(4, C5T_STORAGE_VIEW_GET(C5T_STORAGE(kv2).View("d"), foo));
+    EXPECT_FALSE(static_cast<bool>(C5T_STORAGE(kv2).View("t")));
+    EXPECT_FALSE(static_cast<bool>(C5T_STORAGE(kv2).View("nope")));
+    EXPECT_THROW(C5T_STORAGE(kv2).View("nope").Decode(), StorageKeyNotFoundException);
+    // The values are loaded from disk once, as they are viewed, and are decoded from memory once read as a whole.
+    EXPECT_EQ(6u, C5T_STORAGE_GET_STATS().cache_per_field["kv2"].misses);
+    EXPECT_EQ(2, C5T_STORAGE(kv2).GetOrThrow("b").foo);
+    EXPECT_EQ(42, C5T_STORAGE(kv2).GetOrThrow("c").foo);
+    EXPECT_FALSE(C5T_STORAGE(kv2).Has("t"));
+    EXPECT_EQ(6u, C5T_STORAGE_GET_STATS().cache_per_field["kv2"].misses);
+    // The views are over the values decoded already, and over the ones written, and stay as they were.
+    C5T_STORAGE(kv2).Set("a", SomeJSON().SetFoo(10));
+    EXPECT_EQ(10, C5T_STORAGE_VIEW_GET(C5T_STORAGE(kv2).View("a"), foo));
+    EXPECT_EQ(2, C5T_STORAGE(kv2).View("b").Decode().foo);
+    EXPECT_EQ(1, C5T_STORAGE_VIEW_GET(a, foo));
+    // The values that can not be decoded read as if they do not exist, as they do with `Has()` and `Get()`, including
+    // their members that are valid by themselves, once the value is found not to decode.
+    auto const e = C5T_STORAGE(kv2).View("e");
+    EXPECT_TRUE(static_cast<bool>(e));
+    EXPECT_THROW(C5T_STORAGE_VIEW_GET(e, bar), StorageKeyNotFoundException);
+    EXPECT_THROW(C5T_STORAGE_VIEW_GET(e, foo), StorageKeyNotFoundException);
+    EXPECT_THROW(e.Decode(), StorageKeyNotFoundException);
+    EXPECT_FALSE(C5T_STORAGE(kv2).Has("e"));
+    EXPECT_FALSE(static_cast<bool>(C5T_STORAGE(kv2).View("e")));
+  }
+}
+
 TEST(StorageTest, InjectedFromDLib) {
   current::Singleton<InitDLibOnce>();
 
@@ -191,7 +1489,7 @@ TEST(StorageTest, InjectedFromDLib) {
   });
 
   EXPECT_TRUE(Exists(storage_fields));
-  EXPECT_EQ("kv1,kv2,kv3", Value(storage_fields));
+  EXPECT_EQ("kv1,kv2,kv3,kv_indexed", Value(storage_fields));
 
   EXPECT_FALSE(C5T_STORAGE(kv1).Has("k"));
   ASSERT_THROW(C5T_STORAGE(kv1).GetOrThrow("k"), StorageKeyNotFoundException);
@@ -215,6 +1513,20 @@ TEST(StorageTest, InjectedFromDLib) {
 
   EXPECT_FALSE(C5T_STORAGE(kv1).Has("k"));
   ASSERT_THROW(C5T_STORAGE(kv1).GetOrThrow("k"), StorageKeyNotFoundException);
+  C5T_DLIB_USE("test_storage", [&](C5T_DLib& dlib) {
+    dlib.CallVoid<void(IDLib&, std::vector<std::pair<std::string, std::string>> const&)>(
+        "TestSetMany", istorage, std::vector<std::pair<std::string, std::string>>{{"a", "1"}, {"b", "2"}});
+  });
+
+  EXPECT_EQ("1", C5T_STORAGE(kv1).GetOrThrow("a"));
+  EXPECT_EQ("2", C5T_STORAGE(kv1).GetOrThrow("b"));
+
+  Optional<std::string> const many = C5T_DLIB_CALL("test_storage", [&](C5T_DLib& dlib) {
+    return dlib.CallReturningOptional<std::string(IDLib&, std::vector<std::string> const&)>(
+        "TestGetMany", istorage, std::vector<std::string>{"b", "k", "a"});
+  });
+  EXPECT_TRUE(Exists(many));
+  EXPECT_EQ("2,-,1", Value(many));
 }
 
 TEST(StorageTest, ThrowsOnDeclaredAndNotDefinedField) {
@@ -234,3 +1546,5 @@ TEST(StorageTest, ThrowsOnDeclaredAndNotDefinedField) {
 // [ ] persist set logger and errors on failing to evolve
 // [x] delete
 // [x] injected storage
+// [x] log backend, compaction, recovery from a torn write
+// [x] transactions, rollback, group commit